@@ -2,8 +2,6 @@
 
 import os
 import sys
-from PIL import Image
-from io import BytesIO
 from os.path import splitext, join as pjoin
 from game_maker import *
 
@@ -31,7 +29,7 @@ def escape_c_string(s):
 def build_sprites(fp, spritedir, builddir):
 	patch_def = []
 	patch_data_externs = []
-	patch_data_c = []
+	sprite_data_c = ['#include <stdint.h>\n']
 
 	fp.seek(0, 2)
 	file_size = fp.tell()
@@ -59,8 +57,39 @@ def build_sprites(fp, spritedir, builddir):
 			sprite_name = splitext(filename)[0]
 			replacement_sprites[sprite_name] = pjoin(prefix, filename)
 
-	replacement_sprites_by_txtr = {}
-	replacement_txtrs = {}
+	# The sprites are pasted into the texture pages by the patcher itself,
+	# at the place the archive that is patched says. This archive is only
+	# used to find out whether a name is a sprite or a background and to
+	# catch images of the wrong size early.
+	def add_sprite(macro, name, tpagptr):
+		fp.seek(tpagptr, 0)
+		data = fp.read(22)
+		tpag = struct.unpack('<HHHHHHHHHHH', data)
+		width, height = tpag[2:4]
+
+		filename = replacement_sprites[name]
+		with open(filename, 'rb') as spritefp:
+			data = spritefp.read()
+			spritefp.seek(0, 0)
+			info = parse_png_info(spritefp)
+
+		if (info.width, info.height) != (width, height):
+			raise FileFormatError("Sprite %s has incompatible size. PNG size: %d x %d, size in game archive: %d x %d" %
+				(name, info.width, info.height, width, height))
+
+		index = len(patch_data_externs)
+		patch_data_externs.append('extern const uint8_t csh_sprite_%03d_data[];' % index)
+		patch_def.append('%s("%s", csh_sprite_%03d_data, %d)' % (
+			macro, escape_c_string(name), index, len(data)))
+
+		hex_data = ',\n\t'.join(', '.join('0x%02x' % byte for byte in data[i:i+8]) for i in range(0,len(data),8))
+		sprite_data_c.append("""\
+// %s
+const uint8_t csh_sprite_%03d_data[] = {
+	%s
+};
+""" % (name, index, hex_data))
+
 	while fp.tell() < end_offset:
 		head = fp.read(8)
 		magic, size = struct.unpack("<4sI", head)
@@ -82,22 +111,7 @@ def build_sprites(fp, spritedir, builddir):
 				sprite_name = fp.read(strlen).decode()
 
 				if sprite_name in replacement_sprites:
-					tpagptr = sprite_record[-2]
-					fp.seek(tpagptr, 0)
-					data = fp.read(22)
-					tpag = struct.unpack('<HHHHHHHHHHH', data)
-
-					txtr_index = tpag[-1]
-					(x, y, width, height) = rect = tpag[:4]
-
-					sprite_info = (sprite_name, rect)
-					if txtr_index in replacement_sprites_by_txtr:
-						replacement_sprites_by_txtr[txtr_index].append(sprite_info)
-					else:
-						replacement_sprites_by_txtr[txtr_index] = [sprite_info]
-
-					patch_def.append('GM_PATCH_SPRT("%s", %d, %d, %d, %d, %d)' % (
-						escape_c_string(sprite_name), x, y, width, height, txtr_index))
+					add_sprite('GM_PATCH_SPRT_PNG', sprite_name, sprite_record[-2])
 
 		elif magic == b'BGND':
 			bgnd_count, = struct.unpack("<I", fp.read(4))
@@ -115,98 +129,14 @@ def build_sprites(fp, spritedir, builddir):
 				bgnd_name = fp.read(strlen).decode()
 
 				if bgnd_name in replacement_sprites:
-					tpagptr = bgnd_record[-1]
-					fp.seek(tpagptr, 0)
-					data = fp.read(22)
-					tpag = struct.unpack('<HHHHHHHHHHH', data)
-
-					txtr_index = tpag[-1]
-					(x, y, width, height) = rect = tpag[:4]
-
-					bgnd_info = (bgnd_name, rect)
-					if txtr_index in replacement_sprites_by_txtr:
-						replacement_sprites_by_txtr[txtr_index].append(bgnd_info)
-					else:
-						replacement_sprites_by_txtr[txtr_index] = [bgnd_info]
-
-					patch_def.append('GM_PATCH_BGND("%s", %d, %d, %d, %d, %d)' % (
-						escape_c_string(bgnd_name), x, y, width, height, txtr_index))
-
-		elif magic == b'TXTR':
-			start_offset = fp.tell()
-			count, = struct.unpack("<I", fp.read(4))
-			data = fp.read(4 * count)
-			info_offsets = struct.unpack("<%dI" % count, data)
-			file_infos = []
-
-			for offset in info_offsets:
-				if offset < start_offset or offset + 8 > end_offset:
-					raise FileFormatError("illegal TXTR info offset: %d" % offset)
-
-				fp.seek(offset, 0)
-				data = fp.read(8)
-				info = struct.unpack("<II",data)
-				file_infos.append(info)
-
-			seen_names = set()
-			for index, (unknown, offset) in enumerate(file_infos):
-				if offset < start_offset or offset > end_offset:
-					raise FileFormatError("illegal TXTR data offset: %d" % offset)
-
-				fp.seek(offset, 0)
-				info = parse_png_info(fp)
-
-				if offset + info.filesize > end_offset:
-					raise FileFormatError("PNG file at offset %d overflows TXTR data section end" % offset)
-
-				if index in replacement_sprites_by_txtr:
-					sprites = replacement_sprites_by_txtr[index]
-					fp.seek(offset, 0)
-					data = fp.read(info.filesize)
-
-					image = Image.open(BytesIO(data))
-
-					for sprite_name, (x, y, width, height) in sprites:
-						if sprite_name in seen_names:
-							raise FileFormatError("Sprite double occurence: " + sprite_name)
-
-						seen_names.add(sprite_name)
-
-						sprite = Image.open(replacement_sprites[sprite_name])
-						if sprite.size != (width, height):
-							raise FileFormatError("Sprite %s has incompatible size. PNG size: %d x %d, size in game archive: %d x %d" %
-								(sprite_name, sprite.size[0], sprite.size[1], width, height))
-
-						image.paste(sprite, box=(x, y, x + width, y + height))
-
-					# DEBUG:
-					# image.save(pjoin(builddir, '%05d.png' % index))
-
-					buf = BytesIO()
-					image.save(buf, format='PNG')
-					replacement_txtrs[index] = (image.size, buf.getvalue())
+					add_sprite('GM_PATCH_BGND_PNG', bgnd_name, bgnd_record[-1])
 
 		fp.seek(next_offset, 0)
 
-	for index, ((width, height), data) in replacement_txtrs.items():
-		patch_data_externs.append('extern const uint8_t csh_%05d_data[];' % index)
-		patch_def.append("GM_PATCH_TXTR(%d, csh_%05d_data, %d, %d, %d)" % (index, index, len(data), width, height))
-		data_filename = 'csh_%05d_data.c' % index
-
-		hex_data = ',\n\t'.join(', '.join('0x%02x' % byte for byte in data[i:i+8]) for i in range(0,len(data),8))
-
-		data_c = """\
-#include <stdint.h>
-
-const uint8_t csh_%05d_data[] = {
-	%s
-};
-""" % (index, hex_data)
-
-		out_filename = pjoin(builddir, data_filename)
-		print(out_filename)
-		with open(out_filename, 'w') as outfp:
-			outfp.write(data_c)
+	out_filename = pjoin(builddir, 'csh_sprite_data.c')
+	print(out_filename)
+	with open(out_filename, 'w') as outfp:
+		outfp.write('\n'.join(sprite_data_c))
 
 	patch_def_h = """\
 #ifndef CSH_PATCH_DEF_H
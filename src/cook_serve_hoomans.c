@@ -14,6 +14,7 @@
 #include <string.h>
 #include <limits.h>
 #include <assert.h>
+#include <fcntl.h>
 
 #ifndef static_assert
 #	define static_assert _Static_assert
@@ -232,107 +233,67 @@ static int find_archive(char *path, size_t pathlen) {
 }
 #endif
 
-#ifdef __linux__
-
-// use sendfile() under Linux for zero-context switch file copy
-#include <fcntl.h>
-#include <sys/sendfile.h>
-
+// Only needed if the archive can't be renamed. gm_copy_range() lets the
+// kernel clone or copy the file where possible and loops until done.
 static int copyfile(const char *src, const char *dst) {
 	int status =  0;
 	int infd   = -1;
 	int outfd  = -1;
 	struct stat info;
 
+#if defined(GM_WINDOWS)
+	infd = open(src, O_RDONLY | O_BINARY);
+#else
 	infd = open(src, O_RDONLY);
+#endif
 	if (infd < 0) {
 		goto error;
 	}
 
-	outfd = open(dst, O_CREAT | O_WRONLY);
+	if (fstat(infd, &info) < 0) {
+		goto error;
+	}
+
+#if defined(GM_WINDOWS)
+	outfd = open(dst, O_CREAT | O_EXCL | O_WRONLY | O_BINARY, 0644);
+#else
+	outfd = open(dst, O_CREAT | O_EXCL | O_WRONLY, 0644);
+#endif
 	if (outfd < 0) {
 		goto error;
 	}
 
-	if (fstat(infd, &info) < 0) {
+	if (gm_copy_range(infd, 0, outfd, 0, (size_t)info.st_size, NULL, NULL) != 0) {
 		goto error;
 	}
 
-	if (sendfile(outfd, infd, NULL, (size_t)info.st_size) < (ssize_t)info.st_size) {
+	if (close(outfd) != 0) {
+		outfd = -1;
 		goto error;
 	}
+	outfd = -1;
 
 	goto end;
 
 error:
 	status = -1;
 
-end:
-	if (infd >= 0) {
-		close(infd);
-		infd = -1;
-	}
-
 	if (outfd >= 0) {
+		int errnum = errno;
 		close(outfd);
 		outfd = -1;
+		unlink(dst);
+		errno = errnum;
 	}
 
-	return status;
-}
-#else
-static int copyfile(const char *src, const char *dst) {
-	char buf[BUFSIZ];
-	FILE *fsrc = NULL;
-	FILE *fdst = NULL;
-	int status = 0;
-
-	fsrc = fopen(src, "rb");
-	if (!fsrc) {
-		goto error;
-	}
-
-	fdst = fopen(dst, "wb");
-	if (!fdst) {
-		goto error;
-	}
-
-	for (;;) {
-		size_t count = fread(buf, 1, BUFSIZ, fsrc);
-
-		if (count < BUFSIZ && ferror(fsrc)) {
-			goto error;
-		}
-
-		if (count > 0 && fwrite(buf, 1, count, fdst) != count) {
-			goto error;
-		}
-
-		if (count < BUFSIZ) {
-			break;
-		}
-	}
-
-	goto end;
-
-error:
-	status = -1;
-
 end:
-
-	if (fsrc) {
-		fclose(fsrc);
-		fsrc = NULL;
-	}
-
-	if (fdst) {
-		fclose(fdst);
-		fdst = NULL;
+	if (infd >= 0) {
+		close(infd);
+		infd = -1;
 	}
 
 	return status;
 }
-#endif
 
 int main(int argc, char *argv[]) {
 	char game_name_buf[PATH_MAX];
@@ -365,28 +326,58 @@ int main(int argc, char *argv[]) {
 		goto error;
 	}
 
+	struct gm_patch_options options = GM_PATCH_OPTIONS_INIT;
+
 	if (stat(backup_name, &st) == 0) {
 		if (!S_ISREG(st.st_mode)) {
 			fprintf(stderr, "*** ERROR: Backup file is not a regular file.\n");
 			goto error;
 		}
-	}
-	else if (errno == ENOENT) {
-		if (copyfile(game_name, backup_name) != 0) {
-			perror("*** ERROR: Creatig backup");
+
+		// patch the archive, there is a backup so only rewrite what changed
+		options.mode = GM_PATCH_MODE_IN_PLACE;
+
+		if (gm_patch_archive(game_name, csh_patches, &options) != 0) {
+			fprintf(stderr, "*** ERROR: Error patching archive: %s\n", strerror(errno));
 			goto error;
 		}
-		printf("Created backup of game archive: %s\n", backup_name);
 	}
-	else {
+	else if (errno != ENOENT) {
 		perror("*** ERROR: Error accessing backup file");
 		goto error;
 	}
+	else if (rename(game_name, backup_name) == 0) {
+		// the original becomes the backup and the patched archive is
+		// written in its place, so the archive is only written once
+		printf("Created backup of game archive: %s\n", backup_name);
 
-	// patch the archive
-	if (gm_patch_archive(game_name, csh_patches) != 0) {
-		fprintf(stderr, "*** ERROR: Error patching archive: %s\n", strerror(errno));
-		goto error;
+		if (gm_patch_archive_to(backup_name, game_name, csh_patches, &options) != 0) {
+			int errnum = errno;
+			fprintf(stderr, "*** ERROR: Error patching archive: %s\n", strerror(errnum));
+
+			if (unlink(game_name) != 0 && errno != ENOENT) {
+				perror("*** ERROR: Removing incomplete game archive");
+			}
+			else if (rename(backup_name, game_name) != 0) {
+				perror("*** ERROR: Restoring game archive from backup");
+			}
+			goto error;
+		}
+	}
+	else {
+		// e.g. the archive is opened by another program (Windows)
+		if (copyfile(game_name, backup_name) != 0) {
+			perror("*** ERROR: Creatig backup");
+			goto error;
+		}
+		printf("Created backup of game archive: %s\n", backup_name);
+
+		options.mode = GM_PATCH_MODE_IN_PLACE;
+
+		if (gm_patch_archive(game_name, csh_patches, &options) != 0) {
+			fprintf(stderr, "*** ERROR: Error patching archive: %s\n", strerror(errno));
+			goto error;
+		}
 	}
 
 	printf("Successfully pached game.\n");
@@ -1,5 +1,12 @@
+// O_DIRECT (Linux)
+#if !defined(_GNU_SOURCE)
+#	define _GNU_SOURCE
+#endif
+
 #include "game_maker.h"
 #include "png_info.h"
+#include "png_decode.h"
+#include "gm_io.h"
 
 #include <errno.h>
 #include <stdlib.h>
@@ -8,11 +15,13 @@
 #include <limits.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <stdint.h>
 #include <dirent.h>
 #include <ctype.h>
 #include <stdbool.h>
+#include <stdatomic.h>
 
 #define U32LE_FROM_BUF(BUF) ( \
 	 (uint32_t)((BUF)[0])        | \
@@ -39,45 +48,55 @@
 #define LOG_ERR(FMT, ...) fprintf(stderr, "*** ERROR: " FMT "\n", ## __VA_ARGS__)
 #define LOG_ERR_MSG(MSG)  fprintf(stderr, "*** ERROR: " MSG "\n")
 
+// archives may be up to 4 GiB, also on 32-bit targets
+_Static_assert(sizeof(off_t) >= 8, "off_t too small, build with -D_FILE_OFFSET_BITS=64");
+
 #if defined(GM_WINDOWS)
+#	include <windows.h>
+#	include <io.h>
 #	include <direct.h>
 #	define mkdir(PATH,MODE) _mkdir(PATH)
+#else
+#	include <sys/mman.h>
+#	include <pthread.h>
+#	define GM_THREADS
 #endif
 
-static int gm_copydata(FILE *src, off_t srcoff, FILE *dst, off_t dstoff, size_t size) {
-	uint8_t buf[BUFSIZ];
-
+// Copies between two stdio streams on the file descriptor level, so that the
+// kernel can clone or copy the data without bouncing it through userspace.
+// Leaves dst positioned right after the copied data.
+static int gm_copydata(FILE *src, off_t srcoff, FILE *dst, off_t dstoff, size_t size, const struct gm_io_policy *policy) {
 	if (src == dst) {
 		errno = EINVAL;
 		return -1;
 	}
 
-	if (fseeko(src, srcoff, SEEK_SET) != 0) {
+	if (fflush(dst) != 0) {
 		return -1;
 	}
 
-	if (fseeko(dst, dstoff, SEEK_SET) != 0) {
+	if (gm_copy_range(fileno(src), srcoff, fileno(dst), dstoff, size, policy, NULL) != 0) {
 		return -1;
 	}
 
-	while (size > 0) {
-		size_t chunk_size = size >= BUFSIZ ? BUFSIZ : size;
-		if (fread(buf, chunk_size, 1, src) != 1) {
-			if (!ferror(src)) {
-				LOG_ERR_MSG("unexpected end of file while copying file data");
-				errno = EINVAL;
-			}
-			return -1;
-		}
-		if (fwrite(buf, chunk_size, 1, dst) != 1) {
-			return -1;
-		}
-		size -= chunk_size;
+	if (fseeko(dst, dstoff + size, SEEK_SET) != 0) {
+		return -1;
 	}
 
 	return 0;
 }
 
+static int gm_write_archive_data(const struct gm_archive *archive, off_t srcoff, FILE *dst, off_t dstoff, size_t size) {
+	if (srcoff < 0 || (uint64_t)srcoff > archive->size || size > archive->size - (size_t)srcoff) {
+		LOG_ERR_MSG("unexpected end of file while copying file data");
+
+		errno = EINVAL;
+		return -1;
+	}
+
+	return gm_copydata(archive->fp, srcoff, dst, dstoff, size, &archive->policy);
+}
+
 static int gm_mkpath(const char *pathname) {
 	char buf[PATH_MAX];
 	struct stat st;
@@ -161,65 +180,10 @@ static int gm_mkpath(const char *pathname) {
 	return 0;
 }
 
-static int gm_write_patch_data(FILE *fp, const struct gm_patch *patch) {
-	int status = 0;
-
-	switch (patch->patch_src) {
-	case GM_SRC_MEM:
-		if (fwrite(patch->src.data, patch->size, 1, fp) != 1) {
-			status = -1;
-		}
-		break;
-
-	case GM_SRC_FILE:
-		{
-			FILE *infile = fopen(patch->src.filename, "rb");
-			if (infile) {
-				status = gm_copydata(infile, 0, fp, ftello(fp), patch->size);
-				fclose(infile);
-			}
-			else {
-				status = -1;
-			}
-		}
-		break;
-
-	default:
-		errno = EINVAL;
-		status = -1;
-		break;
-	}
-
-	return status;
-}
-
+// Everything of an index is allocated from its arena.
 void gm_free_index(struct gm_index *index) {
 	if (index) {
-		for (struct gm_index *ptr = index; ptr->section != GM_END; ++ ptr) {
-			if (ptr->entries) {
-				switch (ptr->section) {
-				case GM_SPRT:
-					for (size_t index = 0; index < ptr->entry_count; ++ index) {
-						free(ptr->entries[index].meta.sprt.name);
-						ptr->entries[index].meta.sprt.name = NULL;
-					}
-					break;
-
-				case GM_BGND:
-					for (size_t index = 0; index < ptr->entry_count; ++ index) {
-						free(ptr->entries[index].meta.bgnd.name);
-						ptr->entries[index].meta.bgnd.name = NULL;
-					}
-					break;
-
-				default:
-					break;
-				}
-				free(ptr->entries);
-				ptr->entries = NULL;
-			}
-		}
-		free(index);
+		gm_arena_destroy(index->arena);
 	}
 }
 
@@ -232,31 +196,39 @@ struct gm_patched_index *gm_get_section(struct gm_patched_index *patched, enum g
 	return NULL;
 }
 
-int gm_shift_tail(struct gm_patched_index *index, off_t offset) {
-	for (; index->section != GM_END; ++ index) {
-		switch (index->section) {
-		// only know how to move these sections so far:
-		case GM_TXTR:
-		case GM_AUDO:
-			break;
-
-		default:
-			LOG_ERR("can't move %s section (not implemented)", gm_section_name(index->section));
+static size_t gm_entry_hdr_size(enum gm_section section) {
+	// AUDO entries are prefixed with their size
+	return section == GM_AUDO ? 4 : 0;
+}
 
-			errno = ENOSYS;
-			return -1;
-		}
+// The largest power of two (up to 4096) all entries of the original section
+// are aligned to. Relocated and repacked entries keep to that alignment.
+static off_t gm_section_alignment(const struct gm_patched_index *index) {
+	const off_t entry_hdr = gm_entry_hdr_size(index->section);
+	off_t alignment = 4096;
 
-		index->offset += offset;
+	if (index->entry_count == 0) {
+		return 4;
+	}
 
-		for (size_t i = 0; i < index->entry_count; ++ i) {
-			index->entries[i].offset += offset;
+	for (size_t i = 0; i < index->entry_count && alignment > 1; ++ i) {
+		const off_t start = (off_t)index->index->offsets[i] - entry_hdr;
+		while (alignment > 1 && start % alignment != 0) {
+			alignment >>= 1;
 		}
 	}
 
-	return 0;
+	return alignment;
 }
 
+static off_t gm_align(off_t offset, off_t alignment) {
+	return (offset + alignment - 1) / alignment * alignment;
+}
+
+static uint32_t *gm_sorted_entries(const struct gm_patched_index *section);
+
+static size_t gm_find_named_entry(const struct gm_index *section, const char *name);
+
 int gm_patch_entry(struct gm_patched_index *index, const struct gm_patch *patch) {
 	switch (index->section) {
 	// only know how to patch these sections so far:
@@ -266,35 +238,44 @@ int gm_patch_entry(struct gm_patched_index *index, const struct gm_patch *patch)
 
 	case GM_SPRT:
 	{
-		bool found = false;
-		for (size_t i = 0; i < index->entry_count; ++ i) {
-			const struct gm_entry *entry = index->entries[i].entry;
-			if (strcmp(entry->meta.sprt.name, patch->meta.sprt.name) == 0) {
-				found = true;
-
-				if (entry->meta.sprt.x != patch->meta.sprt.x ||
-				    entry->meta.sprt.y != patch->meta.sprt.y ||
-				    entry->meta.sprt.width  != patch->meta.sprt.width ||
-				    entry->meta.sprt.height != patch->meta.sprt.height) {
-
-					LOG_ERR("Sprite %s has incompatible coordinates. patch: x=%"
-					        PRIuPTR " y=%" PRIuPTR " width=%" PRIuPTR " height=%"
-					        PRIuPTR ", game archive: x=%" PRIuPTR " y=%" PRIuPTR
-					        " width=%" PRIuPTR " height=%" PRIuPTR,
-					        patch->meta.sprt.name, patch->meta.sprt.x,
-					        patch->meta.sprt.y, patch->meta.sprt.width,
-					        patch->meta.sprt.height, entry->meta.sprt.x,
-					        entry->meta.sprt.y, entry->meta.sprt.width,
-					        entry->meta.sprt.height);
-
-					errno = EINVAL;
-					return -1;
-				}
-			}
+		const size_t entry = gm_find_named_entry(index->index, patch->meta.sprt.name);
+		if (entry == SIZE_MAX) {
+			LOG_ERR("can't find sprite %s in game archive", patch->meta.sprt.name);
+
+			errno = EINVAL;
+			return -1;
 		}
 
-		if (!found) {
-			LOG_ERR("can't find sprite %s in game archive", patch->meta.sprt.name);
+		const struct gm_sprt_meta *sprite = &index->index->meta.sprt[entry];
+		if (patch->index >= sprite->frame_count) {
+			LOG_ERR("sprite %s has no frame %" PRIuPTR " (%" PRIu32 " frames)",
+				patch->meta.sprt.name, patch->index, sprite->frame_count);
+
+			errno = EINVAL;
+			return -1;
+		}
+
+		// pixels are pasted wherever the archive keeps the sprite
+		if (gm_patch_has_pixels(patch)) {
+			return 0;
+		}
+
+		const struct gm_tpag_table *tpag = index->index->tpag;
+		const size_t row = index->index->frames[sprite->first_frame + patch->index];
+		if (tpag->x[row] != patch->meta.sprt.x ||
+		    tpag->y[row] != patch->meta.sprt.y ||
+		    tpag->width[row]  != patch->meta.sprt.width ||
+		    tpag->height[row] != patch->meta.sprt.height) {
+
+			LOG_ERR("Sprite %s, frame %" PRIuPTR " has incompatible coordinates. patch: x=%"
+			        PRIuPTR " y=%" PRIuPTR " width=%" PRIuPTR " height=%"
+			        PRIuPTR ", game archive: x=%" PRIuPTR " y=%" PRIuPTR
+			        " width=%" PRIuPTR " height=%" PRIuPTR,
+			        patch->meta.sprt.name, patch->index, patch->meta.sprt.x,
+			        patch->meta.sprt.y, patch->meta.sprt.width,
+			        patch->meta.sprt.height, (size_t)tpag->x[row],
+			        (size_t)tpag->y[row], (size_t)tpag->width[row],
+			        (size_t)tpag->height[row]);
 
 			errno = EINVAL;
 			return -1;
@@ -304,35 +285,34 @@ int gm_patch_entry(struct gm_patched_index *index, const struct gm_patch *patch)
 	}
 	case GM_BGND:
 	{
-		bool found = false;
-		for (size_t i = 0; i < index->entry_count; ++ i) {
-			const struct gm_entry *entry = index->entries[i].entry;
-			if (strcmp(entry->meta.bgnd.name, patch->meta.bgnd.name) == 0) {
-				found = true;
-
-				if (entry->meta.bgnd.x != patch->meta.bgnd.x ||
-				    entry->meta.bgnd.y != patch->meta.bgnd.y ||
-				    entry->meta.bgnd.width  != patch->meta.bgnd.width ||
-				    entry->meta.bgnd.height != patch->meta.bgnd.height) {
-
-					LOG_ERR("Background %s has incompatible coordinates. patch: x=%"
-					        PRIuPTR " y=%" PRIuPTR " width=%" PRIuPTR " height=%"
-					        PRIuPTR ", game archive: x=%" PRIuPTR " y=%" PRIuPTR
-					        " width=%" PRIuPTR " height=%" PRIuPTR,
-					        patch->meta.bgnd.name, patch->meta.bgnd.x,
-					        patch->meta.bgnd.y, patch->meta.bgnd.width,
-					        patch->meta.bgnd.height, entry->meta.bgnd.x,
-					        entry->meta.bgnd.y, entry->meta.bgnd.width,
-					        entry->meta.bgnd.height);
-
-					errno = EINVAL;
-					return -1;
-				}
-			}
+		const size_t entry = gm_find_named_entry(index->index, patch->meta.bgnd.name);
+		if (entry == SIZE_MAX) {
+			LOG_ERR("can't find background %s in game archive", patch->meta.bgnd.name);
+
+			errno = EINVAL;
+			return -1;
 		}
 
-		if (!found) {
-			LOG_ERR("can't find background %s in game archive", patch->meta.bgnd.name);
+		if (gm_patch_has_pixels(patch)) {
+			return 0;
+		}
+
+		const struct gm_tpag_table *tpag = index->index->tpag;
+		const size_t row = index->index->meta.bgnd[entry].tpag_index;
+		if (tpag->x[row] != patch->meta.bgnd.x ||
+		    tpag->y[row] != patch->meta.bgnd.y ||
+		    tpag->width[row]  != patch->meta.bgnd.width ||
+		    tpag->height[row] != patch->meta.bgnd.height) {
+
+			LOG_ERR("Background %s has incompatible coordinates. patch: x=%"
+			        PRIuPTR " y=%" PRIuPTR " width=%" PRIuPTR " height=%"
+			        PRIuPTR ", game archive: x=%" PRIuPTR " y=%" PRIuPTR
+			        " width=%" PRIuPTR " height=%" PRIuPTR,
+			        patch->meta.bgnd.name, patch->meta.bgnd.x,
+			        patch->meta.bgnd.y, patch->meta.bgnd.width,
+			        patch->meta.bgnd.height, (size_t)tpag->x[row],
+			        (size_t)tpag->y[row], (size_t)tpag->width[row],
+			        (size_t)tpag->height[row]);
 
 			errno = EINVAL;
 			return -1;
@@ -356,17 +336,17 @@ int gm_patch_entry(struct gm_patched_index *index, const struct gm_patch *patch)
 		return -1;
 	}
 
-	struct gm_patched_entry *entry = &index->entries[patch->index];
-	if (entry->patch) {
+	const struct gm_index *orig = index->index;
+	if (index->patches[patch->index]) {
 		LOG_ERR("section %s, entry %" PRIuPTR " is already patched", gm_section_name(index->section), patch->index);
 
 		errno = EINVAL;
 		return -1;
 	}
 
-	if (entry->entry->type != patch->type) {
+	if (orig->types[patch->index] != patch->type) {
 		LOG_ERR("section %s, entry %" PRIuPTR " type missmatch: entry type = %s, patch type = %s",
-			gm_section_name(index->section), patch->index, gm_typename(entry->entry->type), gm_typename(patch->type));
+			gm_section_name(index->section), patch->index, gm_typename(orig->types[patch->index]), gm_typename(patch->type));
 
 		errno = EINVAL;
 		return -1;
@@ -374,11 +354,12 @@ int gm_patch_entry(struct gm_patched_index *index, const struct gm_patch *patch)
 
 	if (index->section == GM_TXTR) {
 		// validate replacement sprite dimensions
-		if (entry->entry->meta.txtr.width  != patch->meta.txtr.width ||
-		    entry->entry->meta.txtr.height != patch->meta.txtr.height) {
-			LOG_ERR("section %s, entry %" PRIuPTR " sprite dimensions missmatch: entry dimensions = %" PRIuPTR "x%" PRIuPTR
+		const struct gm_txtr_meta *txtr = &orig->meta.txtr[patch->index];
+		if (txtr->width  != patch->meta.txtr.width ||
+		    txtr->height != patch->meta.txtr.height) {
+			LOG_ERR("section %s, entry %" PRIuPTR " sprite dimensions missmatch: entry dimensions = %" PRIu32 "x%" PRIu32
 			        ", patch dimensions = %" PRIuPTR "x%" PRIuPTR,
-				gm_section_name(index->section), patch->index, entry->entry->meta.txtr.width, entry->entry->meta.txtr.height,
+				gm_section_name(index->section), patch->index, txtr->width, txtr->height,
 				patch->meta.txtr.width, patch->meta.txtr.height);
 
 			errno = EINVAL;
@@ -386,31 +367,370 @@ int gm_patch_entry(struct gm_patched_index *index, const struct gm_patch *patch)
 		}
 	}
 
-	off_t offset = patch->size - entry->entry->size;
-	index->size += offset;
-	entry->size  = patch->size;
-	entry->patch = patch;
+	// offsets are assigned by gm_plan_patched_index() once all patches are known
+	index->sizes[patch->index]   = (off_t)patch->size;
+	index->patches[patch->index] = patch;
 
-	// also look at previous siblings, just in case
-	for (size_t i = 0; i < index->entry_count; ++ i) {
-		struct gm_patched_entry *other = &index->entries[i];
-		if (other->offset > entry->offset) {
-			other->offset += offset;
+	return 0;
+}
+
+// The deltas are appended in file order anyway, but nothing depends on that.
+static int gm_offset_delta_cmp(const void *lhs, const void *rhs) {
+	const struct gm_offset_delta *a = lhs;
+	const struct gm_offset_delta *b = rhs;
+
+	return a->offset < b->offset ? -1 : a->offset > b->offset ? 1 : 0;
+}
+
+static void gm_patch_plan_add(struct gm_patch_plan *plan, off_t offset, off_t delta) {
+	if (delta != 0) {
+		struct gm_offset_delta *item = &plan->deltas[plan->delta_count ++];
+		item->offset = offset;
+		item->delta  = delta;
+	}
+}
+
+// Sum of all deltas that apply to data at offset in the original archive.
+off_t gm_patch_plan_shift(const struct gm_patch_plan *plan, off_t offset) {
+	size_t lo = 0;
+	size_t hi = plan->delta_count;
+	while (lo < hi) {
+		const size_t mid = lo + (hi - lo) / 2;
+		if (plan->deltas[mid].offset <= offset) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
 		}
 	}
 
-	return gm_shift_tail(index + 1, offset);
+	return lo > 0 ? plan->deltas[lo - 1].shift : 0;
 }
 
-void gm_free_patched_index(struct gm_patched_index *index) {
-	if (index) {
-		for (struct gm_patched_index *ptr = index; ptr->section != GM_END; ++ ptr) {
-			if (ptr->entries) {
-				free(ptr->entries);
-				ptr->entries = NULL;
+// GM_PATCH_STRATEGY_SHIFT: every patched entry moves everything behind it.
+static int gm_plan_shift_section(struct gm_patched_index *section, const uint32_t *sorted,
+                                 struct gm_patch_plan *plan, off_t *growth_ptr) {
+	const struct gm_index *orig = section->index;
+	const off_t shift = section->offset - orig->offset;
+	off_t growth = 0;
+
+	for (size_t i = 0; i < section->entry_count; ++ i) {
+		const uint32_t entry = sorted[i];
+
+		section->offsets[entry] = (off_t)orig->offsets[entry] + shift + growth;
+		if (section->patches[entry]) {
+			const off_t delta = section->sizes[entry] - (off_t)orig->sizes[entry];
+			gm_patch_plan_add(plan, (off_t)orig->offsets[entry] + (off_t)orig->sizes[entry], delta);
+			growth += delta;
+		}
+	}
+
+	section->size += growth;
+	*growth_ptr = growth;
+
+	return 0;
+}
+
+static int gm_patch_order_cmp(const void *lhs, const void *rhs) {
+	const struct gm_patch *a = *(const struct gm_patch * const *)lhs;
+	const struct gm_patch *b = *(const struct gm_patch * const *)rhs;
+
+	return a < b ? -1 : a > b ? 1 : 0;
+}
+
+// GM_PATCH_STRATEGY_APPEND: replacements that fit into the space of the
+// original entry are written over it. Bigger ones are relocated to the end
+// of the section in the order of the patch list, leaving the old data as a
+// dead hole, so only the sections behind this one move.
+static int gm_plan_append_section(struct gm_patched_index *section, const uint32_t *sorted,
+                                  struct gm_patch_plan *plan, off_t *growth_ptr) {
+	const struct gm_index *orig = section->index;
+	const off_t entry_hdr = gm_entry_hdr_size(section->section);
+	const off_t shift     = section->offset - orig->offset;
+	const off_t old_end   = orig->offset + 8 + (off_t)orig->size;
+	const size_t count    = section->entry_count;
+	off_t alignment = 0;
+	off_t growth    = 0;
+
+	const struct gm_patch **patches = calloc(count + 1, sizeof(struct gm_patch*));
+	if (!patches) {
+		return -1;
+	}
+
+	size_t patch_count = 0;
+	for (size_t i = 0; i < count; ++ i) {
+		section->offsets[i] = (off_t)orig->offsets[i] + shift;
+		if (section->patches[i]) {
+			patches[patch_count ++] = section->patches[i];
+		}
+	}
+
+	qsort(patches, patch_count, sizeof(struct gm_patch*), gm_patch_order_cmp);
+
+	for (size_t i = 0; i < patch_count; ++ i) {
+		const size_t entry = patches[i]->index;
+		const off_t offset = orig->offsets[entry];
+
+		// the space of an entry ends where the next one (or the section) starts
+		size_t lo = 0;
+		size_t hi = count;
+		while (lo < hi) {
+			const size_t mid = lo + (hi - lo) / 2;
+			if ((off_t)orig->offsets[sorted[mid]] - entry_hdr <= offset) {
+				lo = mid + 1;
+			}
+			else {
+				hi = mid;
+			}
+		}
+		const off_t next = lo < count ? (off_t)orig->offsets[sorted[lo]] - entry_hdr : old_end;
+		const off_t slot_end = next < old_end ? next : old_end;
+
+		if (offset + section->sizes[entry] <= slot_end) {
+			continue;
+		}
+
+		if (alignment == 0) {
+			alignment = gm_section_alignment(section);
+		}
+
+		const off_t tail  = section->offset + 8 + section->size;
+		const off_t start = gm_align(tail, alignment) + entry_hdr;
+
+		section->offsets[entry] = start;
+
+		// keep sections behind this one aligned
+		const off_t entry_growth = gm_align(start + section->sizes[entry], alignment) - tail;
+		section->size += entry_growth;
+		growth        += entry_growth;
+	}
+
+	free(patches);
+
+	gm_patch_plan_add(plan, old_end, growth);
+	*growth_ptr = growth;
+
+	return 0;
+}
+
+// GM_PATCH_STRATEGY_COMPACT: packs all entries of a section in file order,
+// dropping holes and slack.
+static int gm_plan_compact_section(struct gm_patched_index *section, const uint32_t *sorted,
+                                   struct gm_patch_plan *plan, off_t *growth_ptr) {
+	const struct gm_index *orig = section->index;
+	const off_t entry_hdr = gm_entry_hdr_size(section->section);
+	const off_t alignment = gm_section_alignment(section);
+	const off_t old_end   = orig->offset + 8 + (off_t)orig->size;
+
+	// whatever is between the offset tables and the first entry is kept
+	off_t pos = (off_t)orig->offsets[sorted[0]] - entry_hdr - orig->offset + section->offset;
+	for (size_t i = 0; i < section->entry_count; ++ i) {
+		const uint32_t entry = sorted[i];
+		const off_t offset = gm_align(pos, alignment) + entry_hdr;
+
+		section->offsets[entry] = offset;
+		pos = offset + section->sizes[entry];
+	}
+
+	const off_t size = gm_align(pos, alignment) - (section->offset + 8);
+	const off_t growth = size - section->size;
+	section->size = size;
+
+	gm_patch_plan_add(plan, old_end, growth);
+	*growth_ptr = growth;
+
+	return 0;
+}
+
+// Computes the final layout of all sections and entries in one pass over
+// the sections in file order: each section is laid out on its own, moved by
+// the growth of all sections before it. The size deltas are kept as the
+// patch plan, sorted by original offset with their running sums.
+static int gm_plan_patched_index(struct gm_patched_index *patched) {
+	struct gm_patch_plan *plan = NULL;
+	uint32_t *sorted = NULL;
+	size_t section_count = 0;
+	size_t patch_count   = 0;
+	off_t shift = 0;
+	int status = 0;
+
+	for (const struct gm_patched_index *section = patched; section->section != GM_END; ++ section) {
+		++ section_count;
+		if (section->section == GM_TXTR || section->section == GM_AUDO) {
+			for (size_t i = 0; i < section->entry_count; ++ i) {
+				if (section->patches[i]) {
+					++ patch_count;
+				}
+			}
+		}
+	}
+
+	plan = gm_arena_calloc(patched->arena, 1, sizeof(struct gm_patch_plan));
+	if (!plan) {
+		goto error;
+	}
+
+	plan->deltas = gm_arena_calloc(patched->arena, patch_count + section_count + 1, sizeof(struct gm_offset_delta));
+	if (!plan->deltas) {
+		goto error;
+	}
+
+	for (struct gm_patched_index *section = patched; ; ++ section) {
+		section->plan = plan;
+		if (section->section == GM_END) {
+			break;
+		}
+
+		// only know how to move these sections so far:
+		if (section->section != GM_TXTR && section->section != GM_AUDO) {
+			if (shift != 0) {
+				LOG_ERR("can't move %s section (not implemented)", gm_section_name(section->section));
+
+				errno = ENOSYS;
+				goto error;
+			}
+			continue;
+		}
+
+		section->offset = section->index->offset + shift;
+
+		bool changed = section->strategy == GM_PATCH_STRATEGY_COMPACT;
+		for (size_t i = 0; i < section->entry_count && !changed; ++ i) {
+			changed = section->patches[i] != NULL;
+		}
+
+		if (!changed || section->entry_count == 0) {
+			const uint32_t *offsets = section->index->offsets;
+			for (size_t i = 0; i < section->entry_count; ++ i) {
+				section->offsets[i] = (off_t)offsets[i] + shift;
 			}
+			continue;
+		}
+
+		sorted = gm_sorted_entries(section);
+		if (!sorted) {
+			goto error;
+		}
+
+		off_t growth = 0;
+		int result = 0;
+		switch (section->strategy) {
+		case GM_PATCH_STRATEGY_SHIFT:
+			result = gm_plan_shift_section(section, sorted, plan, &growth);
+			break;
+
+		case GM_PATCH_STRATEGY_APPEND:
+			result = gm_plan_append_section(section, sorted, plan, &growth);
+			break;
+
+		case GM_PATCH_STRATEGY_COMPACT:
+			result = gm_plan_compact_section(section, sorted, plan, &growth);
+			break;
+
+		default:
+			LOG_ERR("unknown patch strategy: %d", section->strategy);
+
+			errno = EINVAL;
+			goto error;
+		}
+
+		free(sorted);
+		sorted = NULL;
+
+		if (result != 0) {
+			goto error;
+		}
+
+		shift += growth;
+	}
+
+	qsort(plan->deltas, plan->delta_count, sizeof(struct gm_offset_delta), gm_offset_delta_cmp);
+
+	off_t sum = 0;
+	for (size_t i = 0; i < plan->delta_count; ++ i) {
+		sum += plan->deltas[i].delta;
+		plan->deltas[i].shift = sum;
+	}
+
+	goto end;
+
+error:
+	status = -1;
+
+end:
+	free(sorted);
+
+	return status;
+}
+
+// Prints the size deltas of the plan and the old and new location of every
+// section and every entry that can be moved, e.g. for testing a patch.
+int gm_print_patch_plan(const struct gm_patched_index *patched, FILE *out) {
+	const struct gm_patch_plan *plan = patched->plan;
+
+	fprintf(out, "Offset       Delta        Shift\n");
+	for (size_t i = 0; plan && i < plan->delta_count; ++ i) {
+		fprintf(out, "0x%010" PRIX64 " %+12" PRIi64 " %+12" PRIi64 "\n",
+			(uint64_t)plan->deltas[i].offset,
+			(int64_t)plan->deltas[i].delta,
+			(int64_t)plan->deltas[i].shift);
+	}
+
+	fprintf(out, "\nOffset       Size         New Offset   New Size     Type      Index\n");
+	for (const struct gm_patched_index *section = patched; section->section != GM_END; ++ section) {
+		fprintf(out, "0x%010" PRIX64 " 0x%010" PRIXPTR " 0x%010" PRIX64 " 0x%010" PRIX64 " %-9s -----\n",
+			(uint64_t)section->index->offset,
+			section->index->size,
+			(uint64_t)section->offset,
+			(uint64_t)section->size,
+			gm_section_name(section->section));
+
+		if (section->section != GM_TXTR && section->section != GM_AUDO) {
+			continue;
 		}
-		free(index);
+
+		const struct gm_index *orig = section->index;
+		for (size_t i = 0; i < section->entry_count; ++ i) {
+			fprintf(out, "0x%010" PRIX32 " 0x%010" PRIX32 " 0x%010" PRIX64 " 0x%010" PRIX64 " %-9s %5" PRIuPTR "%s\n",
+				orig->offsets[i],
+				orig->sizes[i],
+				(uint64_t)section->offsets[i],
+				(uint64_t)section->sizes[i],
+				gm_typename(orig->types[i]),
+				i,
+				section->patches[i] ? " patched" : "");
+		}
+	}
+
+	return ferror(out) ? -1 : 0;
+}
+
+// Prints to a file descriptor without closing it.
+static int gm_print_patch_plan_fd(const struct gm_patched_index *patched, int fd) {
+	int dupfd = dup(fd);
+	if (dupfd < 0) {
+		return -1;
+	}
+
+	FILE *out = fdopen(dupfd, "w");
+	if (!out) {
+		int errnum = errno;
+		close(dupfd);
+		errno = errnum;
+		return -1;
+	}
+
+	int status = gm_print_patch_plan(patched, out);
+	if (fclose(out) != 0) {
+		status = -1;
+	}
+
+	return status;
+}
+
+void gm_free_patched_index(struct gm_patched_index *index) {
+	if (index) {
+		gm_arena_destroy(index->arena);
 	}
 }
 
@@ -472,459 +792,1001 @@ enum gm_section gm_parse_section(const uint8_t *name) {
 	else return GM_END;
 }
 
-int gm_read_index_sprt(FILE *game, struct gm_index *section) {
-	uint8_t buffer[17 * 4];
-	size_t count = 0;
-	struct gm_entry *entries = NULL;
-	int status = 0;
+static const uint8_t *gm_archive_at(const struct gm_archive *archive, off_t offset, size_t size) {
+	if (offset < 0 || (uint64_t)offset > archive->size || size > archive->size - (size_t)offset) {
+		LOG_ERR("read out of bounds: offset = %" PRIi64 ", size = %" PRIuPTR ", archive size = %" PRIuPTR,
+		        (int64_t)offset, size, archive->size);
 
-	if (fread(buffer, 4, 1, game) != 1) {
-		goto error;
+		errno = EINVAL;
+		return NULL;
 	}
 
-	count = U32LE_FROM_BUF(buffer);
-	entries = calloc(count, sizeof(struct gm_entry));
-	if (!entries) {
+	return archive->data + offset;
+}
+
+struct gm_archive *gm_map_archive(FILE *game, int flags, const struct gm_io_policy *policy) {
+	static const struct gm_io_policy default_policy = GM_IO_POLICY_INIT;
+	struct gm_archive *archive = calloc(1, sizeof(struct gm_archive));
+	if (!archive) {
+		return NULL;
+	}
+
+	archive->flags  = flags;
+	archive->fp     = game;
+	archive->policy = policy ? *policy : default_policy;
+
+	struct stat st;
+	if (fstat(fileno(game), &st) != 0) {
 		goto error;
 	}
 
-	for (size_t index = 0; index < count; ++ index) {
-		struct gm_entry *entry = &entries[index];
+	if (!S_ISREG(st.st_mode)) {
+		LOG_ERR_MSG("game archive is not a regular file");
 
-		if (fread(buffer, 4, 1, game) != 1) {
-			goto error;
-		}
+		errno = EINVAL;
+		goto error;
+	}
 
-		off_t next_offset = ftello(game);
-		if (next_offset < 0) {
-			goto error;
-		}
+	if ((uint64_t)st.st_size > SIZE_MAX) {
+		LOG_ERR("game archive too big to map: size = %" PRIi64, (int64_t)st.st_size);
 
-		off_t offset = U32LE_FROM_BUF(buffer);
-		if (fseeko(game, offset, SEEK_SET) != 0) {
-			goto error;
-		}
+		errno = EFBIG;
+		goto error;
+	}
 
-		if (fread(buffer, 17 * 4, 1, game) != 1) {
-			goto error;
-		}
+	if (st.st_size < 8) {
+		LOG_ERR("game archive too small: size = %" PRIi64, (int64_t)st.st_size);
 
-		uint32_t str_offset = U32LE_FROM_BUF(buffer);
-		if (str_offset > INT32_MAX && str_offset >= 4) {
-			LOG_ERR("offset not in range: offset = %" PRIu32 ", min. allowed = 4, max. allowed = %" PRIu32, str_offset, INT32_MAX);
+		errno = EINVAL;
+		goto error;
+	}
 
-			errno = ERANGE;
-			goto error;
-		}
+	archive->size = (size_t)st.st_size;
 
-		uint32_t tpag_offset = U32LE_FROM_BUF(buffer + (15 * 4));
-		if (tpag_offset > INT32_MAX) {
-			LOG_ERR("offset too big: offset = %" PRIu32 ", max. allowed = %" PRIu32, tpag_offset, INT32_MAX);
+#if defined(GM_WINDOWS)
+	HANDLE mapping = CreateFileMapping((HANDLE)_get_osfhandle(fileno(game)), NULL, PAGE_READONLY, 0, 0, NULL);
+	if (!mapping) {
+		errno = EIO;
+		goto error;
+	}
+	archive->mapping = mapping;
 
-			errno = ERANGE;
-			goto error;
-		}
+	archive->data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, archive->size);
+	if (!archive->data) {
+		errno = EIO;
+		goto error;
+	}
 
-		if (fseeko(game, str_offset - 4, SEEK_SET) != 0) {
-			goto error;
+	if (flags & GM_ARCHIVE_POPULATE) {
+		// touch every page so that the following parsing doesn't fault
+		volatile uint8_t sum = 0;
+		for (size_t offset = 0; offset < archive->size; offset += 4096) {
+			sum += archive->data[offset];
 		}
+		(void)sum;
+	}
+#else
+	int mmap_flags = MAP_SHARED;
+#if defined(MAP_POPULATE)
+	if (flags & GM_ARCHIVE_POPULATE) {
+		mmap_flags |= MAP_POPULATE;
+	}
+#endif
+	void *data = mmap(NULL, archive->size, PROT_READ, mmap_flags, fileno(game), 0);
+	if (data == MAP_FAILED) {
+		goto error;
+	}
+	archive->data = data;
 
-		if (fread(buffer, 4, 1, game) != 1) {
-			goto error;
-		}
+	if (archive->policy.flags & GM_IO_WILLNEED) {
+		madvise(data, archive->size, MADV_WILLNEED);
+	}
+#endif
 
-		uint32_t str_length = U32LE_FROM_BUF(buffer);
-		if (str_length == UINT32_MAX) {
-			LOG_ERR("string size too big: string size = %" PRIu32 ", max. allowed = %" PRIu32, str_length, UINT32_MAX);
+	// hints for copying data out of the archive through its file descriptor
+	gm_io_advise(fileno(game), &archive->policy);
 
-			errno = ERANGE;
-			goto error;
-		}
+	return archive;
 
-		char *str = calloc(str_length + 1, 1);
-		if (str == NULL) {
-			goto error;
-		}
+error:
+	{
+		int errnum = errno;
+		archive->fp = NULL;
+		gm_close_archive(archive);
+		errno = errnum;
+	}
+	return NULL;
+}
 
-		size_t read_count;
-		if ((read_count = fread(str, str_length, 1, game)) != 1) {
-			free(str);
-			goto error;
+struct gm_archive *gm_open_archive(const char *filename, int flags, const struct gm_io_policy *policy) {
+	FILE *game = fopen(filename, "rb");
+	if (!game) {
+		return NULL;
+	}
+
+	struct gm_archive *archive = gm_map_archive(game, flags, policy);
+	if (!archive) {
+		int errnum = errno;
+		fclose(game);
+		errno = errnum;
+		return NULL;
+	}
+
+	archive->owns_fp = true;
+
+	return archive;
+}
+
+void gm_close_archive(struct gm_archive *archive) {
+	if (archive) {
+#if defined(GM_WINDOWS)
+		if (archive->data) {
+			UnmapViewOfFile(archive->data);
+		}
+		if (archive->mapping) {
+			CloseHandle(archive->mapping);
+			archive->mapping = NULL;
+		}
+#else
+		if (archive->data) {
+			munmap((void*)archive->data, archive->size);
 		}
+#endif
+		archive->data = NULL;
 
-		if (fseeko(game, tpag_offset, SEEK_SET) != 0) {
-			free(str);
-			goto error;
+		if (archive->fp) {
+			gm_io_release(fileno(archive->fp), false, &archive->policy);
 		}
 
-		if (fread(buffer, 11 * 2, 1, game) != 1) {
-			free(str);
-			goto error;
+		if (archive->fp && archive->owns_fp) {
+			fclose(archive->fp);
 		}
+		archive->fp = NULL;
 
-		entry->meta.sprt.name       = str;
-		entry->meta.sprt.x          = U16LE_FROM_BUF(buffer);
-		entry->meta.sprt.y          = U16LE_FROM_BUF(buffer +  2);
-		entry->meta.sprt.width      = U16LE_FROM_BUF(buffer +  4);
-		entry->meta.sprt.height     = U16LE_FROM_BUF(buffer +  6);
-		entry->meta.sprt.txtr_index = U16LE_FROM_BUF(buffer + 20);
+		free(archive);
+	}
+}
 
-		if (fseeko(game, next_offset, SEEK_SET) != 0) {
-			goto error;
-		}
+// Strings in STRG are stored as length, characters and a terminating NUL.
+// The returned name points straight into the mapped archive, it's only
+// copied into arena if the NUL is missing. See gm_detach_index().
+static const char *gm_read_string(const struct gm_archive *archive, uint32_t str_offset, struct gm_arena *arena) {
+	if (str_offset < 4) {
+		LOG_ERR("offset not in range: offset = %" PRIu32 ", min. allowed = 4", str_offset);
+
+		errno = ERANGE;
+		return NULL;
 	}
 
-	section->entry_count = count;
-	section->entries     = entries;
+	const uint8_t *ptr = gm_archive_at(archive, str_offset - 4, 4);
+	if (!ptr) {
+		return NULL;
+	}
 
-	goto end;
+	uint32_t str_length = U32LE_FROM_BUF(ptr);
+	if (str_length == UINT32_MAX) {
+		LOG_ERR("string size too big: string size = %" PRIu32 ", max. allowed = %" PRIu32, str_length, UINT32_MAX);
 
-error:
-	status = -1;
+		errno = ERANGE;
+		return NULL;
+	}
 
-	if (entries) {
-		for (size_t index = 0; index < count; ++ index) {
-			struct gm_entry *entry = &entries[index];
-			free(entry->meta.sprt.name);
-			entry->meta.sprt.name = NULL;
-		}
-		free(entries);
-		entries = NULL;
+	ptr = gm_archive_at(archive, str_offset, str_length);
+	if (!ptr) {
+		return NULL;
 	}
 
-end:
+	if ((size_t)str_offset + str_length < archive->size && ptr[str_length] == 0) {
+		return (const char*)ptr;
+	}
 
-	return status;
+	return gm_arena_strndup(arena, (const char*)ptr, str_length);
 }
-int gm_read_index_bgnd(FILE *game, struct gm_index *section) {
-	uint8_t buffer[17 * 4];
-	size_t count = 0;
-	struct gm_entry *entries = NULL;
-	int status = 0;
 
-	if (fread(buffer, 4, 1, game) != 1) {
-		goto error;
+static uint64_t gm_name_hash(const char *name) {
+	uint64_t hash = UINT64_C(0xcbf29ce484222325);
+	for (const uint8_t *ptr = (const uint8_t*)name; *ptr; ++ ptr) {
+		hash ^= *ptr;
+		hash *= UINT64_C(0x100000001b3);
 	}
+	return hash;
+}
 
-	count = U32LE_FROM_BUF(buffer);
-	entries = calloc(count, sizeof(struct gm_entry));
-	if (!entries) {
-		goto error;
+static const char *gm_entry_name(const struct gm_index *section, size_t index) {
+	switch (section->section) {
+	case GM_SPRT: return section->meta.sprt[index].name;
+	case GM_BGND: return section->meta.bgnd[index].name;
+	default:      return NULL;
 	}
+}
 
-	for (size_t index = 0; index < count; ++ index) {
-		struct gm_entry *entry = &entries[index];
-
-		if (fread(buffer, 4, 1, game) != 1) {
-			goto error;
+// Builds the hash table used by gm_find_sprite() and gm_find_background().
+// Slots hold entry index + 1 (0 = empty) and are probed linearly, so with
+// duplicate names the first entry wins.
+int gm_build_name_table(struct gm_index *section, struct gm_arena *arena) {
+	size_t slot_count = 16;
+	while (slot_count < section->entry_count * 2) {
+		if (slot_count > SIZE_MAX / 4 / sizeof(size_t)) {
+			errno = ENOMEM;
+			return -1;
 		}
+		slot_count *= 2;
+	}
 
-		off_t next_offset = ftello(game);
-		if (next_offset < 0) {
-			goto error;
+	size_t *slots = gm_arena_calloc(arena, slot_count, sizeof(size_t));
+	if (!slots) {
+		return -1;
+	}
+
+	for (size_t index = 0; index < section->entry_count; ++ index) {
+		const char *name = gm_entry_name(section, index);
+		if (!name) {
+			continue;
 		}
 
-		off_t offset = U32LE_FROM_BUF(buffer);
-		if (fseeko(game, offset, SEEK_SET) != 0) {
-			goto error;
+		size_t slot = gm_name_hash(name) & (slot_count - 1);
+		while (slots[slot] != 0) {
+			if (strcmp(gm_entry_name(section, slots[slot] - 1), name) == 0) {
+				break;
+			}
+			slot = (slot + 1) & (slot_count - 1);
 		}
 
-		if (fread(buffer, 5 * 4, 1, game) != 1) {
-			goto error;
+		if (slots[slot] == 0) {
+			slots[slot] = index + 1;
 		}
+	}
 
-		uint32_t str_offset = U32LE_FROM_BUF(buffer);
-		if (str_offset > INT32_MAX && str_offset >= 4) {
-			LOG_ERR("offset not in range: offset = %" PRIu32 ", min. allowed = 4, max. allowed = %" PRIu32, str_offset, INT32_MAX);
+	section->names      = slots;
+	section->name_slots = slot_count;
 
-			errno = ERANGE;
-			goto error;
-		}
+	return 0;
+}
 
-		uint32_t tpag_offset = U32LE_FROM_BUF(buffer + (4 * 4));
-		if (tpag_offset > INT32_MAX) {
-			LOG_ERR("offset too big: offset = %" PRIu32 ", max. allowed = %" PRIu32, tpag_offset, INT32_MAX);
+// Index of the entry called name or SIZE_MAX.
+static size_t gm_find_named_entry(const struct gm_index *section, const char *name) {
+	if (!section->names) {
+		return SIZE_MAX;
+	}
 
-			errno = ERANGE;
-			goto error;
+	size_t slot = gm_name_hash(name) & (section->name_slots - 1);
+	for (; section->names[slot] != 0; slot = (slot + 1) & (section->name_slots - 1)) {
+		const size_t index = section->names[slot] - 1;
+		if (strcmp(gm_entry_name(section, index), name) == 0) {
+			return index;
 		}
+	}
 
-		if (fseeko(game, str_offset - 4, SEEK_SET) != 0) {
-			goto error;
+	return SIZE_MAX;
+}
+
+const struct gm_sprt_meta *gm_find_sprite(const struct gm_index *index, const char *name) {
+	for (; index->section != GM_END; ++ index) {
+		if (index->section == GM_SPRT) {
+			const size_t entry = gm_find_named_entry(index, name);
+			return entry != SIZE_MAX ? &index->meta.sprt[entry] : NULL;
 		}
+	}
+	return NULL;
+}
 
-		if (fread(buffer, 4, 1, game) != 1) {
-			goto error;
+const struct gm_bgnd_meta *gm_find_background(const struct gm_index *index, const char *name) {
+	for (; index->section != GM_END; ++ index) {
+		if (index->section == GM_BGND) {
+			const size_t entry = gm_find_named_entry(index, name);
+			return entry != SIZE_MAX ? &index->meta.bgnd[entry] : NULL;
 		}
+	}
+	return NULL;
+}
 
-		uint32_t str_length = U32LE_FROM_BUF(buffer);
-		if (str_length == UINT32_MAX) {
-			LOG_ERR("string size too big: string size = %" PRIu32 ", max. allowed = %" PRIu32, str_length, UINT32_MAX);
+// Decodes a texture of a loaded TXTR section to RGBA. The PNG is inflated
+// straight from the archive's mapping.
+int gm_decode_txtr(const struct gm_archive *archive, const struct gm_index *section, size_t index, struct png_image *image) {
+	if (section->section != GM_TXTR || index >= section->entry_count) {
+		LOG_ERR("no such texture: section = %s, index = %" PRIuPTR, gm_section_name(section->section), index);
 
-			errno = ERANGE;
-			goto error;
-		}
+		errno = EINVAL;
+		return -1;
+	}
 
-		char *str = calloc(str_length + 1, 1);
-		if (str == NULL) {
-			goto error;
-		}
+	const uint8_t *data = gm_archive_at(archive, section->offsets[index], section->sizes[index]);
+	if (!data) {
+		return -1;
+	}
 
-		if (fread(str, str_length, 1, game) != 1) {
-			free(str);
-			goto error;
-		}
+	if (decode_png_mem(data, section->sizes[index], image) != 0) {
+		LOG_ERR("section %s, entry %" PRIuPTR ": error decoding sprite file: %s",
+			gm_section_name(section->section), index, strerror(errno));
 
-		if (fseeko(game, tpag_offset, SEEK_SET) != 0) {
-			free(str);
-			goto error;
+		return -1;
+	}
+
+	return 0;
+}
+
+// Names point into the archive's mapping, so an index that is used after
+// the archive was closed needs its own copy. All names lie in STRG, so
+// this copies the one range they span and rebases them.
+int gm_detach_index(struct gm_index *index, const struct gm_archive *archive) {
+	const uint8_t *begin = archive->data + archive->size;
+	const uint8_t *end   = archive->data;
+
+	for (const struct gm_index *section = index; section->section != GM_END; ++ section) {
+		for (size_t i = 0; i < section->entry_count; ++ i) {
+			const uint8_t *name = (const uint8_t*)gm_entry_name(section, i);
+			if (name && name >= archive->data && name < archive->data + archive->size) {
+				const uint8_t *name_end = name + strlen((const char*)name) + 1;
+				if (name < begin) {
+					begin = name;
+				}
+				if (name_end > end) {
+					end = name_end;
+				}
+			}
 		}
+	}
 
-		if (fread(buffer, 11 * 2, 1, game) != 1) {
-			free(str);
-			goto error;
+	if (begin >= end) {
+		return 0;
+	}
+
+	char *copy = gm_arena_alloc(index->arena, (size_t)(end - begin));
+	if (!copy) {
+		return -1;
+	}
+	memcpy(copy, begin, (size_t)(end - begin));
+
+	for (struct gm_index *section = index; section->section != GM_END; ++ section) {
+		for (size_t i = 0; i < section->entry_count; ++ i) {
+			const char **name = section->section == GM_SPRT ? &section->meta.sprt[i].name :
+			                    section->section == GM_BGND ? &section->meta.bgnd[i].name : NULL;
+			if (name && *name && (const uint8_t*)*name >= begin && (const uint8_t*)*name < end) {
+				*name = copy + ((const uint8_t*)*name - begin);
+			}
 		}
+	}
 
-		entry->meta.bgnd.name       = str;
-		entry->meta.bgnd.x          = U16LE_FROM_BUF(buffer);
-		entry->meta.bgnd.y          = U16LE_FROM_BUF(buffer +  2);
-		entry->meta.bgnd.width      = U16LE_FROM_BUF(buffer +  4);
-		entry->meta.bgnd.height     = U16LE_FROM_BUF(buffer +  6);
-		entry->meta.bgnd.txtr_index = U16LE_FROM_BUF(buffer + 20);
+	return 0;
+}
 
-		if (fseeko(game, next_offset, SEEK_SET) != 0) {
-			goto error;
+struct gm_tpag_table *gm_new_tpag_table(size_t count, struct gm_arena *arena) {
+	struct gm_tpag_table *table = gm_arena_calloc(arena, 1, sizeof(struct gm_tpag_table));
+	if (!table) {
+		return NULL;
+	}
+
+	table->offsets = gm_arena_calloc(arena, count, sizeof(uint32_t));
+	uint16_t *columns = gm_arena_calloc(arena, count, GM_TPAG_COLUMNS * sizeof(uint16_t));
+	if (!table->offsets || !columns) {
+		return NULL;
+	}
+
+	table->count           = count;
+	table->x               = columns;
+	table->y               = columns + count;
+	table->width           = columns + count *  2;
+	table->height          = columns + count *  3;
+	table->target_x        = columns + count *  4;
+	table->target_y        = columns + count *  5;
+	table->target_width    = columns + count *  6;
+	table->target_height   = columns + count *  7;
+	table->bounding_width  = columns + count *  8;
+	table->bounding_height = columns + count *  9;
+	table->txtr_index      = columns + count * 10;
+	table->sorted          = true;
+
+	return table;
+}
+
+// Allocates the entry tables of a section: where the data is for TXTR and
+// AUDO, the metadata for TXTR, SPRT and BGND. The caller sets entry_count
+// once they are filled in.
+int gm_alloc_entries(struct gm_index *section, size_t count, struct gm_arena *arena) {
+	if (section->section == GM_TXTR || section->section == GM_AUDO) {
+		section->offsets = gm_arena_calloc(arena, count, sizeof(uint32_t));
+		section->sizes   = gm_arena_calloc(arena, count, sizeof(uint32_t));
+		section->types   = gm_arena_calloc(arena, count, sizeof(uint8_t));
+		if (!section->offsets || !section->sizes || !section->types) {
+			return -1;
 		}
 	}
 
-	section->entry_count = count;
-	section->entries     = entries;
+	switch (section->section) {
+	case GM_TXTR:
+		section->meta.txtr = gm_arena_calloc(arena, count, sizeof(struct gm_txtr_meta));
+		return section->meta.txtr ? 0 : -1;
 
-	goto end;
+	case GM_SPRT:
+		section->meta.sprt = gm_arena_calloc(arena, count, sizeof(struct gm_sprt_meta));
+		return section->meta.sprt ? 0 : -1;
 
-error:
-	status = -1;
+	case GM_BGND:
+		section->meta.bgnd = gm_arena_calloc(arena, count, sizeof(struct gm_bgnd_meta));
+		return section->meta.bgnd ? 0 : -1;
+
+	default:
+		return 0;
+	}
+}
 
-	if (entries) {
-		for (size_t index = 0; index < count; ++ index) {
-			struct gm_entry *entry = &entries[index];
-			free(entry->meta.bgnd.name);
-			entry->meta.bgnd.name = NULL;
+// Returns the row of the record at offset or SIZE_MAX.
+static size_t gm_tpag_find(const struct gm_tpag_table *table, uint32_t offset) {
+	if (!table->sorted) {
+		for (size_t index = 0; index < table->count; ++ index) {
+			if (table->offsets[index] == offset) {
+				return index;
+			}
 		}
-		free(entries);
-		entries = NULL;
+		return SIZE_MAX;
 	}
 
-end:
+	size_t lo = 0;
+	size_t hi = table->count;
+	while (lo < hi) {
+		const size_t mid = lo + (hi - lo) / 2;
+		if (table->offsets[mid] < offset) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
 
-	return status;
+	return lo < table->count && table->offsets[lo] == offset ? lo : SIZE_MAX;
 }
 
-int gm_read_index_txtr(FILE *game, struct gm_index *section) {
-	uint8_t buffer[8];
+int gm_read_index_tpag(const struct gm_archive *archive, struct gm_index *section, struct gm_arena *arena) {
 	size_t count = 0;
-	off_t *info_offsets = NULL;
-	struct gm_entry *entries = NULL;
 	int status = 0;
 
-	if (fread(buffer, 4, 1, game) != 1) {
+	const uint8_t *body = gm_archive_at(archive, section->offset + 8, 4);
+	if (!body) {
 		goto error;
 	}
 
-	count = U32LE_FROM_BUF(buffer);
-	entries = calloc(count, sizeof(struct gm_entry));
-	if (!entries) {
+	count = U32LE_FROM_BUF(body);
+	if (count > archive->size / 4) {
+		LOG_ERR("%s section: entry count too big: %" PRIuPTR, gm_section_name(section->section), count);
+
+		errno = EINVAL;
 		goto error;
 	}
 
-	info_offsets = calloc(count, sizeof(off_t));
-	if (!info_offsets) {
+	const uint8_t *offsets = gm_archive_at(archive, section->offset + 12, count * 4);
+	if (!offsets) {
 		goto error;
 	}
 
-	for (size_t index = 0; index < count; ++ index) {
-		if (fread(buffer, 4, 1, game) != 1) {
-			goto error;
-		}
-
-		uint32_t offset = U32LE_FROM_BUF(buffer);
-		if (offset > INT32_MAX) {
-			LOG_ERR("offset too big: offset = %" PRIu32 ", max. allowed = %" PRIu32, offset, INT32_MAX);
-
-			errno = ERANGE;
-			goto error;
-		}
-		info_offsets[index] = (off_t)offset;
+	struct gm_tpag_table *table = gm_new_tpag_table(count, arena);
+	if (!table) {
+		goto error;
 	}
 
+	// all columns in one block, see gm_new_tpag_table()
+	uint16_t *columns = table->x;
 	for (size_t index = 0; index < count; ++ index) {
-		struct gm_entry *entry = &entries[index];
-		if (fseeko(game, info_offsets[index], SEEK_SET) != 0) {
+		const uint32_t offset = U32LE_FROM_BUF(offsets + index * 4);
+		const uint8_t *record = gm_archive_at(archive, offset, GM_TPAG_COLUMNS * 2);
+		if (!record) {
 			goto error;
 		}
 
-		if (fread(buffer, 8, 1, game) != 1) {
-			goto error;
+		table->offsets[index] = offset;
+		if (index > 0 && offset <= table->offsets[index - 1]) {
+			table->sorted = false;
 		}
 
-		const uint32_t value = U32LE_FROM_BUF(buffer);
-		if (value > 1) {
-			LOG_ERR("at offset %" PRIi64 ", section %s, entry %" PRIuPTR ": unexpected value of non-reverse engineered field: value = %" PRIu32,
-				(int64_t)info_offsets[index], gm_section_name(section->section), index, value);
-
-			errno = ENOSYS;
-			goto error;
+		for (size_t column = 0; column < GM_TPAG_COLUMNS; ++ column) {
+			columns[column * count + index] = U16LE_FROM_BUF(record + column * 2);
 		}
+	}
 
-		uint32_t offset = U32LE_FROM_BUF(buffer + 4);
-		if (offset > INT32_MAX) {
-			LOG_ERR("offset too big: offset = %" PRIu32 ", max. allowed = %" PRIu32, offset, INT32_MAX);
+	section->tpag = table;
 
-			errno = ERANGE;
-			goto error;
-		}
-		entry->offset = (off_t)offset;
-		if (fseeko(game, (off_t)offset, SEEK_SET) != 0) {
-			goto error;
-		}
+	goto end;
 
-		struct png_info meta;
-		if (parse_png_info(game, &meta) != 0) {
-			LOG_ERR("section %s, entry %" PRIuPTR ": error parsing sprite file",
-				gm_section_name(section->section), index);
+error:
+	status = -1;
 
-			goto error;
-		}
+end:
 
-		entry->size = meta.filesize;
-		entry->type = GM_PNG;
-		entry->meta.txtr.width  = meta.width;
-		entry->meta.txtr.height = meta.height;
-	}
+	return status;
+}
 
-	section->entry_count = count;
-	section->entries     = entries;
+#define GM_SPRT_FRAME_COUNT 14 // word index of the frame count in a sprite record
 
-	goto end;
+// Reads the frame count of the sprite record at offset and checks that the
+// whole record is inside the archive, including the collision masks.
+static int gm_sprt_record(const struct gm_archive *archive, off_t offset, const uint8_t **record, size_t *frame_count) {
+	const uint8_t *ptr = gm_archive_at(archive, offset, (GM_SPRT_FRAME_COUNT + 1) * 4);
+	if (!ptr) {
+		return -1;
+	}
 
-error:
-	status = -1;
+	const size_t width  = U32LE_FROM_BUF(ptr + 4);
+	const size_t height = U32LE_FROM_BUF(ptr + 8);
+	const size_t frames = U32LE_FROM_BUF(ptr + GM_SPRT_FRAME_COUNT * 4);
+	if (frames > archive->size / 4) {
+		LOG_ERR("sprite at offset %" PRIi64 ": frame count too big: %" PRIuPTR, (int64_t)offset, frames);
+
+		errno = EINVAL;
+		return -1;
+	}
 
-	if (entries) {
-		free(entries);
-		entries = NULL;
+	// frame TPAG offsets, then the number of masks
+	const size_t masks_offset = (GM_SPRT_FRAME_COUNT + 1 + frames) * 4;
+	ptr = gm_archive_at(archive, offset, masks_offset + 4);
+	if (!ptr) {
+		return -1;
 	}
 
-end:
+	// one bit per pixel, rows padded to whole bytes
+	const uint64_t masks     = U32LE_FROM_BUF(ptr + masks_offset);
+	const uint64_t mask_size = (uint64_t)((width + 7) / 8) * height;
+	if ((mask_size != 0 && masks > archive->size / mask_size) ||
+	    !gm_archive_at(archive, offset, masks_offset + 4 + (size_t)(masks * mask_size))) {
+		LOG_ERR("sprite at offset %" PRIi64 ": masks out of bounds", (int64_t)offset);
 
-	if (info_offsets) {
-		free(info_offsets);
-		info_offsets = NULL;
+		errno = EINVAL;
+		return -1;
 	}
 
-	return status;
+	*record      = ptr;
+	*frame_count = frames;
+
+	return 0;
 }
 
-int gm_read_index_audo(FILE *game, struct gm_index *section) {
-	uint8_t buffer[12];
+int gm_read_index_sprt(const struct gm_archive *archive, struct gm_index *section, struct gm_arena *arena) {
 	size_t count = 0;
-	off_t *offsets = NULL;
-	struct gm_entry *entries = NULL;
+	size_t frame_count = 0;
+	struct gm_sprt_meta *sprites = NULL;
+	uint32_t *frames = NULL;
 	int status = 0;
 
-	if (fread(buffer, 4, 1, game) != 1) {
+	const uint8_t *body = gm_archive_at(archive, section->offset + 8, 4);
+	if (!body) {
 		goto error;
 	}
 
-	count = U32LE_FROM_BUF(buffer);
-	entries = calloc(count, sizeof(struct gm_entry));
-	if (!entries) {
+	count = U32LE_FROM_BUF(body);
+	if (count > archive->size / 4) {
+		LOG_ERR("%s section: entry count too big: %" PRIuPTR, gm_section_name(section->section), count);
+
+		errno = EINVAL;
 		goto error;
 	}
 
-	offsets = calloc(count, sizeof(off_t));
+	const uint8_t *offsets = gm_archive_at(archive, section->offset + 12, count * 4);
 	if (!offsets) {
 		goto error;
 	}
 
+	if (gm_alloc_entries(section, count, arena) != 0) {
+		goto error;
+	}
+	sprites = section->meta.sprt;
+
+	// first pass: size the frame table, which is allocated once
 	for (size_t index = 0; index < count; ++ index) {
-		if (fread(buffer, 4, 1, game) != 1) {
+		const uint8_t *record = NULL;
+		size_t frames_here = 0;
+
+		if (gm_sprt_record(archive, U32LE_FROM_BUF(offsets + index * 4), &record, &frames_here) != 0) {
 			goto error;
 		}
 
-		uint32_t offset = U32LE_FROM_BUF(buffer);
-		if (offset > INT32_MAX) {
-			LOG_ERR("offset too big: offset = %" PRIu32 ", max. allowed = %" PRIu32, offset, INT32_MAX);
+		if (frames_here > archive->size / 4 - frame_count) {
+			LOG_ERR("%s section: too many frames", gm_section_name(section->section));
 
-			errno = ERANGE;
+			errno = EINVAL;
 			goto error;
 		}
-		offsets[index] = (off_t)offset;
+
+		sprites[index].first_frame = (uint32_t)frame_count;
+		sprites[index].frame_count = (uint32_t)frames_here;
+		frame_count += frames_here;
+	}
+
+	frames = gm_arena_calloc(arena, frame_count, sizeof(uint32_t));
+	if (!frames && frame_count > 0) {
+		goto error;
 	}
 
 	for (size_t index = 0; index < count; ++ index) {
-		struct gm_entry *entry = &entries[index];
-		if (fseeko(game, offsets[index], SEEK_SET) != 0) {
-			goto error;
-		}
+		struct gm_sprt_meta *sprite = &sprites[index];
+		const uint8_t *record = archive->data + U32LE_FROM_BUF(offsets + index * 4);
+		const uint8_t *tpag_offsets = record + (GM_SPRT_FRAME_COUNT + 1) * 4;
 
-		if (fread(buffer, 4, 1, game) != 1) {
-			goto error;
+		for (size_t frame = 0; frame < sprite->frame_count; ++ frame) {
+			uint32_t tpag_offset = U32LE_FROM_BUF(tpag_offsets + frame * 4);
+			size_t tpag_index = gm_tpag_find(section->tpag, tpag_offset);
+			if (tpag_index == SIZE_MAX) {
+				LOG_ERR("%s section, entry %" PRIuPTR ", frame %" PRIuPTR ": no TPAG record at offset %" PRIu32,
+					gm_section_name(section->section), index, frame, tpag_offset);
+
+				errno = EINVAL;
+				goto error;
+			}
+			frames[sprite->first_frame + frame] = (uint32_t)tpag_index;
 		}
 
-		uint32_t size = U32LE_FROM_BUF(buffer);
-		uint32_t hdrsize = size < 12 ? size : 12;
-		if (fread(buffer, hdrsize, 1, game) != 1) {
+		const char *str = gm_read_string(archive, U32LE_FROM_BUF(record), arena);
+		if (!str) {
 			goto error;
 		}
-		if (hdrsize >= 12 &&
-		    memcmp(buffer, "RIFF", 4) == 0 &&
-		    memcmp(buffer + 8, "WAVE", 4) == 0) {
-			entry->type = GM_WAVE;
-		}
-		else if (hdrsize >= 4 && memcmp(buffer, "OggS", 4) == 0) {
-			entry->type = GM_OGG;
-		}
-		else {
-			entry->type = GM_UNKNOWN;
-		}
-		entry->offset = offsets[index] + 4;
-		entry->size   = size;
+
+		sprite->name = str;
 	}
 
 	section->entry_count = count;
-	section->entries     = entries;
-
-	goto end;
+	section->frame_count = frame_count;
+	section->frames      = frames;
+
+	if (gm_build_name_table(section, arena) != 0) {
+		goto error;
+	}
+
+	goto end;
 
 error:
 	status = -1;
 
-	if (entries) {
-		free(entries);
-		entries = NULL;
+end:
+
+	return status;
+}
+
+int gm_read_index_bgnd(const struct gm_archive *archive, struct gm_index *section, struct gm_arena *arena) {
+	size_t count = 0;
+	int status = 0;
+
+	const uint8_t *body = gm_archive_at(archive, section->offset + 8, 4);
+	if (!body) {
+		goto error;
+	}
+
+	count = U32LE_FROM_BUF(body);
+	if (count > archive->size / 4) {
+		LOG_ERR("%s section: entry count too big: %" PRIuPTR, gm_section_name(section->section), count);
+
+		errno = EINVAL;
+		goto error;
+	}
+
+	const uint8_t *offsets = gm_archive_at(archive, section->offset + 12, count * 4);
+	if (!offsets) {
+		goto error;
+	}
+
+	if (gm_alloc_entries(section, count, arena) != 0) {
+		goto error;
+	}
+
+	for (size_t index = 0; index < count; ++ index) {
+		struct gm_bgnd_meta *background = &section->meta.bgnd[index];
+
+		off_t offset = U32LE_FROM_BUF(offsets + index * 4);
+		const uint8_t *record = gm_archive_at(archive, offset, 5 * 4);
+		if (!record) {
+			goto error;
+		}
+
+		uint32_t tpag_offset = U32LE_FROM_BUF(record + (4 * 4));
+		size_t tpag_index = gm_tpag_find(section->tpag, tpag_offset);
+		if (tpag_index == SIZE_MAX) {
+			LOG_ERR("%s section, entry %" PRIuPTR ": no TPAG record at offset %" PRIu32,
+				gm_section_name(section->section), index, tpag_offset);
+
+			errno = EINVAL;
+			goto error;
+		}
+
+		const char *str = gm_read_string(archive, U32LE_FROM_BUF(record), arena);
+		if (!str) {
+			goto error;
+		}
+
+		background->name       = str;
+		background->tpag_index = (uint32_t)tpag_index;
+	}
+
+	section->entry_count = count;
+
+	if (gm_build_name_table(section, arena) != 0) {
+		goto error;
 	}
 
+	goto end;
+
+error:
+	status = -1;
+
 end:
 
-	if (offsets) {
-		free(offsets);
-		offsets = NULL;
+	return status;
+}
+
+static int gm_offset_cmp(const void *lhs, const void *rhs) {
+	const off_t a = *(const off_t*)lhs;
+	const off_t b = *(const off_t*)rhs;
+
+	return a < b ? -1 : a > b ? 1 : 0;
+}
+
+// Where the data that starts at offset ends at the latest: at the next
+// higher offset of the same section or at the end of the section.
+static off_t gm_slot_limit(const off_t *sorted, size_t count, off_t offset, off_t section_end) {
+	size_t lo = 0, hi = count;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (sorted[mid] <= offset) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+
+	return lo < count ? sorted[lo] : section_end;
+}
+
+// TXTR sections are parsed in two steps: the file info table first, then
+// every PNG on its own, which can be spread over several threads.
+struct gm_txtr_scan {
+	struct gm_index *section; // entry tables are allocated up front
+	off_t           *sorted;
+	size_t           count;
+};
+
+static void gm_txtr_scan_free(struct gm_txtr_scan *scan) {
+	free(scan->sorted);
+	scan->sorted  = NULL;
+	scan->count   = 0;
+}
+
+static int gm_txtr_scan_offsets(const struct gm_archive *archive, struct gm_index *section, struct gm_txtr_scan *scan,
+                                struct gm_arena *arena) {
+	size_t count = 0;
+
+	scan->section = section;
+	scan->sorted  = NULL;
+	scan->count   = 0;
+
+	const uint8_t *body = gm_archive_at(archive, section->offset + 8, 4);
+	if (!body) {
+		goto error;
+	}
+
+	count = U32LE_FROM_BUF(body);
+	if (count > archive->size / 4) {
+		LOG_ERR("%s section: entry count too big: %" PRIuPTR, gm_section_name(section->section), count);
+
+		errno = EINVAL;
+		goto error;
+	}
+
+	const uint8_t *info_offsets = gm_archive_at(archive, section->offset + 12, count * 4);
+	if (!info_offsets) {
+		goto error;
+	}
+
+	if (gm_alloc_entries(section, count, arena) != 0) {
+		goto error;
+	}
+
+	scan->sorted = calloc(count + 1, sizeof(off_t));
+	if (!scan->sorted) {
+		goto error;
+	}
+
+	scan->count = count;
+
+	for (size_t index = 0; index < count; ++ index) {
+		uint32_t info_offset = U32LE_FROM_BUF(info_offsets + index * 4);
+		const uint8_t *info = gm_archive_at(archive, info_offset, 8);
+		if (!info) {
+			goto error;
+		}
+
+		const uint32_t value = U32LE_FROM_BUF(info);
+		if (value > 1) {
+			LOG_ERR("at offset %" PRIu32 ", section %s, entry %" PRIuPTR ": unexpected value of non-reverse engineered field: value = %" PRIu32,
+				info_offset, gm_section_name(section->section), index, value);
+
+			errno = ENOSYS;
+			goto error;
+		}
+
+		uint32_t offset = U32LE_FROM_BUF(info + 4);
+		section->offsets[index] = offset;
+		scan->sorted[index] = (off_t)offset;
+	}
+
+	// The textures are stored back to back, so the space up to the next one
+	// holds the PNG and maybe some padding. Only the header and the end of
+	// each PNG are looked at, instead of walking all of its chunks.
+	qsort(scan->sorted, count, sizeof(off_t), gm_offset_cmp);
+
+	return 0;
+
+error:
+	{
+		int errnum = errno;
+		gm_txtr_scan_free(scan);
+		errno = errnum;
+	}
+
+	return -1;
+}
+
+static int gm_txtr_scan_entry(const struct gm_archive *archive, const struct gm_txtr_scan *scan, size_t index) {
+	struct gm_index *section = scan->section;
+	const off_t offset = section->offsets[index];
+	const off_t section_end = section->offset + 8 + (off_t)section->size;
+
+	const uint8_t *data = gm_archive_at(archive, offset, 0);
+	if (!data) {
+		return -1;
+	}
+
+	struct png_info meta;
+	const bool verify = (archive->flags & GM_ARCHIVE_VERIFY_PNG) != 0;
+	const off_t limit = offset < section_end ?
+		gm_slot_limit(scan->sorted, scan->count, offset, section_end) :
+		(off_t)archive->size;
+
+	// fall back to walking the chunks for unusual layouts
+	if ((verify || parse_png_header_mem(data, (size_t)(limit - offset), &meta) != 0) &&
+	    parse_png_info_mem(data, archive->size - (size_t)offset, &meta) != 0) {
+		LOG_ERR("section %s, entry %" PRIuPTR ": error parsing sprite file",
+			gm_section_name(section->section), index);
+
+		return -1;
+	}
+
+	if (verify && meta.filesize > (size_t)(limit - offset)) {
+		LOG_ERR("section %s, entry %" PRIuPTR ": sprite file overlaps following data: size = %" PRIuPTR ", available = %" PRIi64,
+			gm_section_name(section->section), index, meta.filesize, (int64_t)(limit - offset));
+
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (meta.filesize > UINT32_MAX) {
+		LOG_ERR("section %s, entry %" PRIuPTR ": sprite file too big: size = %" PRIuPTR,
+			gm_section_name(section->section), index, meta.filesize);
+
+		errno = EINVAL;
+		return -1;
+	}
+
+	section->sizes[index] = (uint32_t)meta.filesize;
+	section->types[index] = GM_PNG;
+	section->meta.txtr[index].width  = (uint32_t)meta.width;
+	section->meta.txtr[index].height = (uint32_t)meta.height;
+
+	return 0;
+}
+
+static void gm_txtr_scan_finish(struct gm_txtr_scan *scan) {
+	scan->section->entry_count = scan->count;
+	gm_txtr_scan_free(scan);
+}
+
+int gm_read_index_txtr(const struct gm_archive *archive, struct gm_index *section, struct gm_arena *arena) {
+	struct gm_txtr_scan scan;
+
+	if (gm_txtr_scan_offsets(archive, section, &scan, arena) != 0) {
+		return -1;
+	}
+
+	for (size_t index = 0; index < scan.count; ++ index) {
+		if (gm_txtr_scan_entry(archive, &scan, index) != 0) {
+			int errnum = errno;
+			gm_txtr_scan_free(&scan);
+			errno = errnum;
+			return -1;
+		}
+	}
+
+	gm_txtr_scan_finish(&scan);
+
+	return 0;
+}
+
+int gm_read_index_audo(const struct gm_archive *archive, struct gm_index *section, struct gm_arena *arena) {
+	size_t count = 0;
+	int status = 0;
+
+	const uint8_t *body = gm_archive_at(archive, section->offset + 8, 4);
+	if (!body) {
+		goto error;
+	}
+
+	count = U32LE_FROM_BUF(body);
+	if (count > archive->size / 4) {
+		LOG_ERR("%s section: entry count too big: %" PRIuPTR, gm_section_name(section->section), count);
+
+		errno = EINVAL;
+		goto error;
+	}
+
+	const uint8_t *offsets = gm_archive_at(archive, section->offset + 12, count * 4);
+	if (!offsets) {
+		goto error;
+	}
+
+	if (gm_alloc_entries(section, count, arena) != 0) {
+		goto error;
+	}
+
+	for (size_t index = 0; index < count; ++ index) {
+		// the index stores where the data starts, behind the size
+		uint32_t offset = U32LE_FROM_BUF(offsets + index * 4);
+		if (offset > UINT32_MAX - 4) {
+			LOG_ERR("offset too big: offset = %" PRIu32 ", max. allowed = %" PRIu32, offset, UINT32_MAX - 4);
+
+			errno = ERANGE;
+			goto error;
+		}
+
+		const uint8_t *ptr = gm_archive_at(archive, offset, 4);
+		if (!ptr) {
+			goto error;
+		}
+
+		uint32_t size = U32LE_FROM_BUF(ptr);
+		const uint8_t *data = gm_archive_at(archive, (off_t)offset + 4, size);
+		if (!data) {
+			goto error;
+		}
+
+		if (size >= 12 &&
+		    memcmp(data, "RIFF", 4) == 0 &&
+		    memcmp(data + 8, "WAVE", 4) == 0) {
+			section->types[index] = GM_WAVE;
+		}
+		else if (size >= 4 && memcmp(data, "OggS", 4) == 0) {
+			section->types[index] = GM_OGG;
+		}
+		else {
+			section->types[index] = GM_UNKNOWN;
+		}
+		section->offsets[index] = offset + 4;
+		section->sizes[index]   = size;
 	}
 
+	section->entry_count = count;
+
+	goto end;
+
+error:
+	status = -1;
+
+end:
+
 	return status;
 }
 
-struct gm_index *gm_read_index(FILE *game) {
+struct gm_index *gm_read_archive_index(const struct gm_archive *archive) {
 	size_t capacity = 32;
 	size_t count = 0;
-	struct gm_index *index = calloc(capacity, sizeof(struct gm_index));
+	struct gm_index *index = NULL;
+	struct gm_arena *arena = gm_arena_create(0);
+	if (!arena) {
+		return NULL;
+	}
+
+	index = gm_arena_calloc(arena, capacity, sizeof(struct gm_index));
 	if (!index) {
 		goto error;
 	}
 
-	uint8_t buffer[8];
-	if (fread(buffer, 8, 1, game) != 1) {
+	const uint8_t *buffer = gm_archive_at(archive, 0, 8);
+	if (!buffer) {
 		goto error;
 	}
 
@@ -937,12 +1799,12 @@ struct gm_index *gm_read_index(FILE *game) {
 		goto error;
 	}
 
-	const size_t form_size = U32LE_FROM_BUF(buffer + 4);
-	const off_t end_offset = form_size + 8;
+	const off_t end_offset = (off_t)U32LE_FROM_BUF(buffer + 4) + 8;
 	off_t offset = 8;
 
 	while (offset < end_offset) {
-		if (fread(buffer, 8, 1, game) != 1) {
+		buffer = gm_archive_at(archive, offset, 8);
+		if (!buffer) {
 			goto error;
 		}
 
@@ -958,14 +1820,7 @@ struct gm_index *gm_read_index(FILE *game) {
 		}
 
 		size_t section_size = U32LE_FROM_BUF(buffer + 4);
-		if (section_size > INT32_MAX - 8 || offset > INT32_MAX - 8 - (int32_t)section_size) {
-			LOG_ERR("section size big: section size = %" PRIuPTR ", max. allowed = %" PRIu32, section_size, INT32_MAX);
-
-			errno = ERANGE;
-			goto error;
-		}
-
-		if ((size_t)offset + section_size + 8 > (size_t)end_offset) {
+		if (offset + 8 + (off_t)section_size > end_offset) {
 			LOG_ERR("%s section overflows file: section offset = %" PRIi64 ", section size = %" PRIuPTR ", file size = %" PRIi64,
 				gm_section_name(section_type), (int64_t)offset, section_size + 8, (int64_t)end_offset);
 
@@ -973,13 +1828,14 @@ struct gm_index *gm_read_index(FILE *game) {
 			goto error;
 		}
 
-		if (count >= capacity) {
+		// keep room for the GM_END terminator
+		if (count + 1 >= capacity) {
 			capacity *= 2;
-			struct gm_index *new_index = realloc(index, capacity * sizeof(struct gm_index));
+			struct gm_index *new_index = gm_arena_calloc(arena, capacity, sizeof(struct gm_index));
 			if (!new_index) {
 				goto error;
 			}
-			memset(new_index + count * sizeof(struct gm_index), 0, (capacity - count) * sizeof(struct gm_index));
+			memcpy(new_index, index, count * sizeof(struct gm_index));
 			index = new_index;
 		}
 
@@ -988,328 +1844,1715 @@ struct gm_index *gm_read_index(FILE *game) {
 		section->offset  = offset;
 		section->size    = section_size;
 
-		switch (section_type) {
-		case GM_SPRT:
-			if (gm_read_index_sprt(game, section) != 0) {
-				goto error;
-			}
-			break;
-
-		case GM_BGND:
-			if (gm_read_index_bgnd(game, section) != 0) {
-				goto error;
-			}
-			break;
-
-		case GM_TXTR:
-			if (gm_read_index_txtr(game, section) != 0) {
-				goto error;
-			}
-			break;
-
-		case GM_AUDO:
-			if (gm_read_index_audo(game, section) != 0) {
-				goto error;
-			}
-			break;
-
-		default:
-			break;
-		}
-
 		offset += section_size + 8;
-		if (fseeko(game, offset, SEEK_SET) != 0) {
-			goto error;
-		}
-
 		++ count;
 	}
 
-	goto end;
+	for (size_t i = 0; i <= count; ++ i) {
+		index[i].arena = arena;
+	}
 
-error:
-	if (index) {
-		gm_free_index(index);
-		index = NULL;
+	if (!(archive->flags & GM_ARCHIVE_LAZY) && gm_load_sections(archive, index, NULL) != 0) {
+		goto error;
 	}
 
-end:
 	return index;
+
+error:
+	{
+		int errnum = errno;
+		gm_arena_destroy(arena);
+		errno = errnum;
+	}
+
+	return NULL;
 }
 
-size_t gm_form_size(const struct gm_patched_index *index) {
-	size_t size = 0;
-	while (index->section != GM_END) {
-		size += index->size + 8;
-		++ index;
+struct gm_index *gm_find_section(struct gm_index *index, enum gm_section section) {
+	for (; index->section != GM_END; ++ index) {
+		if (index->section == section) {
+			return index;
+		}
 	}
-	return size;
+	return NULL;
 }
 
-int gm_write_hdr(FILE *fp, const uint8_t *magic, size_t size) {
-	if (!magic) {
-		LOG_ERR_MSG("magic may not be NULL");
+// Parses the entries of a section of an index that was read with
+// GM_ARCHIVE_LAZY and allocates them from arena, which doesn't have to be
+// the arena of the index (parallel jobs each use their own). Does nothing
+// if that already happened.
+static int gm_load_section_into(const struct gm_archive *archive, struct gm_index *section, struct gm_arena *arena) {
+	int status = 0;
 
-		errno = EINVAL;
-		return -1;
+	if (section->loaded) {
+		return 0;
 	}
 
-	if (size > UINT32_MAX) {
-		LOG_ERR("section size out of range: size = %" PRIuPTR ", max size = %" PRIu32, size, UINT32_MAX);
+	if ((section->section == GM_SPRT || section->section == GM_BGND) && !section->tpag) {
+		LOG_ERR("can't parse %s section: TPAG section is not loaded", gm_section_name(section->section));
 
 		errno = EINVAL;
 		return -1;
 	}
 
-	uint8_t buffer[8];
-	memcpy(buffer, magic, 4);
-	WRITE_U32LE(buffer + 4, (uint32_t)size);
+	switch (section->section) {
+	case GM_SPRT:
+		status = gm_read_index_sprt(archive, section, arena);
+		break;
+
+	case GM_BGND:
+		status = gm_read_index_bgnd(archive, section, arena);
+		break;
+
+	case GM_TPAG:
+		status = gm_read_index_tpag(archive, section, arena);
+		break;
+
+	case GM_TXTR:
+		status = gm_read_index_txtr(archive, section, arena);
+		break;
+
+	case GM_AUDO:
+		status = gm_read_index_audo(archive, section, arena);
+		break;
+
+	default:
+		break;
+	}
+
+	if (status == 0) {
+		section->loaded = true;
+	}
+
+	return status;
+}
+
+int gm_load_section(const struct gm_archive *archive, struct gm_index *section) {
+	return gm_load_section_into(archive, section, section->arena);
+}
+
+// A piece of work for parsing sections in parallel: either a whole
+// section or a range of the PNGs of a TXTR section.
+struct gm_index_job {
+	struct gm_index     *section;
+	struct gm_arena     *arena; // per job, merged into the index' arena afterwards
+	struct gm_txtr_scan *scan;
+	size_t first;
+	size_t count;
+};
+
+struct gm_index_phase {
+	const struct gm_archive   *archive;
+	const struct gm_index_job *jobs;
+	size_t job_count;
+
+	atomic_size_t next_job;
+	atomic_int    errnum;
+};
+
+static int gm_run_index_job(const struct gm_archive *archive, const struct gm_index_job *job) {
+	if (job->scan) {
+		for (size_t index = job->first; index < job->first + job->count; ++ index) {
+			if (gm_txtr_scan_entry(archive, job->scan, index) != 0) {
+				return -1;
+			}
+		}
+		return 0;
+	}
+
+	return gm_load_section_into(archive, job->section, job->arena);
+}
+
+static void *gm_index_worker(void *arg) {
+	struct gm_index_phase *phase = arg;
+
+	while (atomic_load(&phase->errnum) == 0) {
+		size_t index = atomic_fetch_add(&phase->next_job, 1);
+		if (index >= phase->job_count) {
+			break;
+		}
+
+		if (gm_run_index_job(phase->archive, &phase->jobs[index]) != 0) {
+			int expected = 0;
+			atomic_compare_exchange_strong(&phase->errnum, &expected, errno ? errno : EINVAL);
+		}
+	}
+
+	return NULL;
+}
+
+static bool gm_section_listed(const enum gm_section *sections, enum gm_section section) {
+	if (!sections) {
+		return true;
+	}
+
+	for (; *sections != GM_END; ++ sections) {
+		if (*sections == section) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// Sprites and backgrounds refer to TPAG records, so TPAG is parsed before
+// any of them and linked to them.
+static int gm_link_tpag(const struct gm_archive *archive, struct gm_index *index, const enum gm_section *sections) {
+	bool needed = false;
+	for (struct gm_index *section = index; section->section != GM_END; ++ section) {
+		if ((section->section == GM_SPRT || section->section == GM_BGND) &&
+		    gm_section_listed(sections, section->section) && !section->loaded) {
+			needed = true;
+		}
+	}
+
+	if (!needed) {
+		return 0;
+	}
+
+	struct gm_index *tpag = gm_find_section(index, GM_TPAG);
+	if (!tpag) {
+		LOG_ERR_MSG("archive contains no TPAG section");
+
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (gm_load_section(archive, tpag) != 0) {
+		return -1;
+	}
+
+	for (struct gm_index *section = index; section->section != GM_END; ++ section) {
+		if (section->section == GM_SPRT || section->section == GM_BGND) {
+			section->tpag = tpag->tpag;
+		}
+	}
+
+	return 0;
+}
+
+// Parses the listed sections (GM_END terminated, NULL = all) that aren't
+// loaded yet. The sections are independent of each other, so unless the
+// archive was opened with GM_ARCHIVE_SERIAL they are parsed concurrently
+// and the PNGs of TXTR sections are spread over all threads. The result
+// is the same either way.
+int gm_load_sections(const struct gm_archive *archive, struct gm_index *index, const enum gm_section *sections) {
+	struct gm_txtr_scan *scans = NULL;
+	struct gm_index_job *jobs  = NULL;
+	size_t scan_count = 0;
+	size_t job_count  = 0;
+	size_t threads = archive->flags & GM_ARCHIVE_SERIAL ? 1 : gm_cpu_count();
+	int status = 0;
+
+	if (gm_link_tpag(archive, index, sections) != 0) {
+		return -1;
+	}
+
+	if (threads <= 1) {
+		for (struct gm_index *section = index; section->section != GM_END; ++ section) {
+			if (gm_section_listed(sections, section->section) && gm_load_section(archive, section) != 0) {
+				return -1;
+			}
+		}
+		return 0;
+	}
+
+	size_t max_scans = 0;
+	size_t max_jobs  = 0;
+	for (struct gm_index *section = index; section->section != GM_END; ++ section) {
+		if (gm_section_listed(sections, section->section) && !section->loaded) {
+			++ max_jobs;
+			if (section->section == GM_TXTR) {
+				++ max_scans;
+			}
+		}
+	}
+
+	scans = calloc(max_scans + 1, sizeof(struct gm_txtr_scan));
+	if (!scans) {
+		goto error;
+	}
+
+	// the file info tables are read up front, they're needed to split the work
+	size_t txtr_entries = 0;
+	for (struct gm_index *section = index; section->section != GM_END; ++ section) {
+		if (section->section == GM_TXTR && gm_section_listed(sections, section->section) && !section->loaded) {
+			if (gm_txtr_scan_offsets(archive, section, &scans[scan_count], section->arena) != 0) {
+				goto error;
+			}
+			txtr_entries += scans[scan_count].count;
+			++ scan_count;
+		}
+	}
+
+	const size_t batch = txtr_entries / (threads * 4) + 1;
+	jobs = calloc(max_jobs + txtr_entries / batch + scan_count + 1, sizeof(struct gm_index_job));
+	if (!jobs) {
+		goto error;
+	}
+
+	for (struct gm_index *section = index; section->section != GM_END; ++ section) {
+		if (section->section != GM_TXTR && gm_section_listed(sections, section->section) && !section->loaded) {
+			struct gm_index_job *job = &jobs[job_count ++];
+			job->section = section;
+			job->arena   = gm_arena_create(0);
+			if (!job->arena) {
+				goto error;
+			}
+		}
+	}
+
+	for (size_t i = 0; i < scan_count; ++ i) {
+		for (size_t first = 0; first < scans[i].count; first += batch) {
+			struct gm_index_job *job = &jobs[job_count ++];
+			job->scan  = &scans[i];
+			job->first = first;
+			job->count = scans[i].count - first < batch ? scans[i].count - first : batch;
+		}
+	}
+
+	struct gm_index_phase phase = {
+		.archive   = archive,
+		.jobs      = jobs,
+		.job_count = job_count
+	};
+	atomic_init(&phase.next_job, 0);
+	atomic_init(&phase.errnum, 0);
+
+	gm_run_workers(gm_index_worker, &phase, threads < job_count ? threads : job_count);
+
+	int errnum = atomic_load(&phase.errnum);
+	if (errnum != 0) {
+		errno = errnum;
+		goto error;
+	}
+
+	for (size_t i = 0; i < scan_count; ++ i) {
+		scans[i].section->loaded = true;
+		gm_txtr_scan_finish(&scans[i]);
+	}
+
+	goto end;
+
+error:
+	status = -1;
+
+end:
+	{
+		int errnum = errno;
+		if (scans) {
+			for (size_t i = 0; i < scan_count; ++ i) {
+				gm_txtr_scan_free(&scans[i]);
+			}
+			free(scans);
+		}
+		if (jobs) {
+			// entries of sections that were parsed point into these
+			for (size_t i = 0; i < job_count; ++ i) {
+				if (jobs[i].arena) {
+					gm_arena_adopt(index->arena, jobs[i].arena);
+				}
+			}
+			free(jobs);
+		}
+		errno = errnum;
+	}
+
+	return status;
+}
+
+struct gm_index *gm_read_index(FILE *game, const struct gm_io_policy *policy) {
+	struct gm_archive *archive = gm_map_archive(game, 0, policy);
+	if (!archive) {
+		return NULL;
+	}
+
+	struct gm_index *index = gm_read_archive_index(archive);
+	if (index && gm_detach_index(index, archive) != 0) {
+		gm_free_index(index);
+		index = NULL;
+	}
+	int errnum = errno;
+
+	gm_close_archive(archive);
+	errno = errnum;
+
+	return index;
+}
+
+off_t gm_form_size(const struct gm_patched_index *index) {
+	off_t size = 0;
+	while (index->section != GM_END) {
+		size += index->size + 8;
+		++ index;
+	}
+	return size;
+}
+
+int gm_write_hdr(FILE *fp, const uint8_t *magic, size_t size) {
+	if (!magic) {
+		LOG_ERR_MSG("magic may not be NULL");
+
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (size > UINT32_MAX) {
+		LOG_ERR("section size out of range: size = %" PRIuPTR ", max size = %" PRIu32, size, UINT32_MAX);
+
+		errno = EINVAL;
+		return -1;
+	}
+
+	uint8_t buffer[8];
+	memcpy(buffer, magic, 4);
+	WRITE_U32LE(buffer + 4, (uint32_t)size);
+
+	if (fwrite(buffer, 8, 1, fp) != 1) {
+		return -1;
+	}
+
+	return 0;
+}
+
+size_t gm_index_length(const struct gm_index *index) {
+	size_t len = 0;
+	while (index->section != GM_END) {
+		++ len;
+		++ index;
+	}
+	return len;
+}
+
+int gm_copy_plan_add(struct gm_copy_plan *plan, off_t src_offset, off_t dst_offset, size_t size) {
+	if (size == 0) {
+		return 0;
+	}
+
+	if (plan->extent_count == plan->capacity) {
+		size_t capacity = plan->capacity ? plan->capacity * 2 : 64;
+		if (SIZE_MAX / sizeof(struct gm_extent) < capacity) {
+			errno = ENOMEM;
+			return -1;
+		}
+
+		struct gm_extent *extents = realloc(plan->extents, capacity * sizeof(struct gm_extent));
+		if (!extents) {
+			return -1;
+		}
+
+		plan->extents  = extents;
+		plan->capacity = capacity;
+	}
+
+	struct gm_extent *extent = &plan->extents[plan->extent_count ++];
+	extent->src_offset = src_offset;
+	extent->dst_offset = dst_offset;
+	extent->size       = size;
+
+	return 0;
+}
+
+static int gm_extent_cmp(const void *lhs, const void *rhs) {
+	const struct gm_extent *a = lhs;
+	const struct gm_extent *b = rhs;
+
+	return a->src_offset < b->src_offset ? -1 : a->src_offset > b->src_offset ? 1 : 0;
+}
+
+void gm_merge_copy_plan(struct gm_copy_plan *plan) {
+	if (plan->extent_count == 0) {
+		return;
+	}
+
+	qsort(plan->extents, plan->extent_count, sizeof(struct gm_extent), gm_extent_cmp);
+
+	size_t count = 1;
+	for (size_t i = 1; i < plan->extent_count; ++ i) {
+		struct gm_extent *last = &plan->extents[count - 1];
+		const struct gm_extent *extent = &plan->extents[i];
+
+		if (last->src_offset + (off_t)last->size == extent->src_offset &&
+		    last->dst_offset + (off_t)last->size == extent->dst_offset) {
+			last->size += extent->size;
+		}
+		else {
+			plan->extents[count ++] = *extent;
+		}
+	}
+	plan->extent_count = count;
+}
+
+// Plans copying of everything in a TXTR or AUDO section that isn't replaced
+// by a patch. Each entry owns the bytes up to the start of the next entry
+// (in file order), so padding moves along with the entry it follows.
+// entry_hdr is the size of the per-entry header preceding the entry offsets.
+static int gm_copy_plan_section(struct gm_copy_plan *plan, const struct gm_patched_index *section,
+                                size_t table_size, size_t entry_hdr) {
+	const struct gm_index *orig = section->index;
+	const off_t section_end = orig->offset + 8 + orig->size;
+	const off_t table_end   = orig->offset + 8 + table_size;
+	const size_t count = section->entry_count;
+	int status = 0;
+
+	uint32_t *sorted = gm_sorted_entries(section);
+	if (!sorted) {
+		return -1;
+	}
+
+	if (section->strategy == GM_PATCH_STRATEGY_APPEND) {
+		// Nothing but the appended data moves relative to the section start.
+		// Entries that are overwritten in place are written over the copy.
+		if (gm_copy_plan_add(plan, table_end, section->offset + 8 + table_size, section_end - table_end) != 0) {
+			goto error;
+		}
+		goto end;
+	}
+
+	// padding between the offset tables and the first entry
+	off_t data_start = count > 0 ? (off_t)orig->offsets[sorted[0]] - (off_t)entry_hdr : section_end;
+	if (data_start > table_end &&
+	    gm_copy_plan_add(plan, table_end, section->offset + 8 + table_size, data_start - table_end) != 0) {
+		goto error;
+	}
+
+	if (section->strategy == GM_PATCH_STRATEGY_COMPACT) {
+		for (size_t i = 0; i < count; ++ i) {
+			const uint32_t entry = sorted[i];
+			if (!section->patches[entry] && gm_copy_plan_add(plan,
+					(off_t)orig->offsets[entry] - (off_t)entry_hdr,
+					(off_t)section->offsets[entry] - (off_t)entry_hdr,
+					section->sizes[entry] + entry_hdr) != 0) {
+				goto error;
+			}
+		}
+		goto end;
+	}
+
+	for (size_t i = 0; i < count; ++ i) {
+		const uint32_t entry = sorted[i];
+		const off_t slot_start = (off_t)orig->offsets[entry] - (off_t)entry_hdr;
+		const off_t data_end   = (off_t)orig->offsets[entry] + (off_t)orig->sizes[entry];
+		const off_t offset     = section->offsets[entry];
+		off_t slot_end = i + 1 < count ? (off_t)orig->offsets[sorted[i + 1]] - (off_t)entry_hdr : section_end;
+
+		if (slot_end < data_end) {
+			slot_end = data_end;
+		}
+
+		if (section->patches[entry]) {
+			if (gm_copy_plan_add(plan, data_end, offset + (off_t)section->sizes[entry], slot_end - data_end) != 0) {
+				goto error;
+			}
+		}
+		else if (gm_copy_plan_add(plan, slot_start, offset - (off_t)entry_hdr, slot_end - slot_start) != 0) {
+			goto error;
+		}
+	}
+
+	goto end;
+
+error:
+	status = -1;
+
+end:
+	free(sorted);
+
+	return status;
+}
+
+int gm_build_copy_plan(const struct gm_patched_index *patched, struct gm_copy_plan *plan) {
+	for (; patched->section != GM_END; ++ patched) {
+		const size_t count = patched->entry_count;
+
+		switch (patched->section) {
+		case GM_TXTR:
+			if (gm_copy_plan_section(plan, patched, 4 + 12 * count, gm_entry_hdr_size(GM_TXTR)) != 0) {
+				return -1;
+			}
+			break;
+
+		case GM_AUDO:
+			if (gm_copy_plan_section(plan, patched, 4 + 4 * count, gm_entry_hdr_size(GM_AUDO)) != 0) {
+				return -1;
+			}
+			break;
+
+		default:
+			if (gm_copy_plan_add(plan, patched->index->offset, patched->offset, patched->size + 8) != 0) {
+				return -1;
+			}
+			break;
+		}
+	}
+
+	gm_merge_copy_plan(plan);
+
+	return 0;
+}
+
+int gm_execute_copy_plan(const struct gm_copy_plan *plan, int srcfd, int dstfd, const struct gm_io_policy *policy) {
+	for (size_t i = 0; i < plan->extent_count; ++ i) {
+		const struct gm_extent *extent = &plan->extents[i];
+
+		if (gm_copy_range(srcfd, extent->src_offset, dstfd, extent->dst_offset, extent->size, policy, NULL) != 0) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+// Executes a copy plan where source and destination are the same file.
+// The plan has to be sorted by source offset (see gm_merge_copy_plan()) and
+// has to preserve the order of the data, which is what gm_build_copy_plan()
+// produces. Then extents that move to the left can be moved in ascending
+// order and extents that move to the right in descending order without ever
+// overwriting data that still has to be moved. Extents that stay where they
+// are are skipped.
+int gm_execute_move_plan(const struct gm_copy_plan *plan, int fd, const struct gm_io_policy *policy) {
+	const size_t count = plan->extent_count;
+
+	for (size_t i = 1; i < count; ++ i) {
+		const struct gm_extent *prev   = &plan->extents[i - 1];
+		const struct gm_extent *extent = &plan->extents[i];
+
+		if (prev->src_offset + (off_t)prev->size > extent->src_offset ||
+		    prev->dst_offset + (off_t)prev->size > extent->dst_offset) {
+			LOG_ERR_MSG("cyclic data dependency, cannot rewrite archive in place");
+
+			errno = EINVAL;
+			return -1;
+		}
+	}
+
+	for (size_t i = 0; i < count; ++ i) {
+		const struct gm_extent *extent = &plan->extents[i];
+
+		if (extent->dst_offset < extent->src_offset &&
+		    gm_move_range(fd, extent->src_offset, extent->dst_offset, extent->size, policy) != 0) {
+			return -1;
+		}
+	}
+
+	for (size_t i = count; i > 0; -- i) {
+		const struct gm_extent *extent = &plan->extents[i - 1];
+
+		if (extent->dst_offset > extent->src_offset &&
+		    gm_move_range(fd, extent->src_offset, extent->dst_offset, extent->size, policy) != 0) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+void gm_free_copy_plan(struct gm_copy_plan *plan) {
+	free(plan->extents);
+	plan->extents      = NULL;
+	plan->extent_count = 0;
+	plan->capacity     = 0;
+}
+
+static int gm_u64_cmp(const void *lhs, const void *rhs) {
+	const uint64_t a = *(const uint64_t*)lhs;
+	const uint64_t b = *(const uint64_t*)rhs;
+
+	return a < b ? -1 : a > b ? 1 : 0;
+}
+
+// Indices of the entries of a section in the order they are stored in the
+// original archive. Sorts offset/index pairs packed into one integer, so no
+// comparison has to look anything up.
+static uint32_t *gm_sorted_entries(const struct gm_patched_index *section) {
+	const size_t count = section->entry_count;
+	uint64_t *keys = calloc(count + 1, sizeof(uint64_t));
+	uint32_t *sorted = calloc(count + 1, sizeof(uint32_t));
+	if (!keys || !sorted) {
+		free(keys);
+		free(sorted);
+		return NULL;
+	}
+
+	const uint32_t *offsets = section->index->offsets;
+	for (size_t i = 0; i < count; ++ i) {
+		keys[i] = (uint64_t)offsets[i] << 32 | (uint32_t)i;
+	}
+
+	qsort(keys, count, sizeof(uint64_t), gm_u64_cmp);
+
+	for (size_t i = 0; i < count; ++ i) {
+		sorted[i] = (uint32_t)keys[i];
+	}
+	free(keys);
+
+	return sorted;
+}
+
+struct gm_patched_index *gm_build_patched_index(const struct gm_index *index, const struct gm_patch *patches, enum gm_patch_strategy strategy) {
+	const size_t count = gm_index_length(index);
+	struct gm_patched_index *patched = NULL;
+
+	// size the arena so that everything fits into its first block
+	size_t block_size = (count + 2) * (sizeof(struct gm_patched_index) + sizeof(struct gm_offset_delta) + 64);
+	for (size_t i = 0; i < count; ++ i) {
+		block_size += index[i].entry_count * (2 * sizeof(off_t) + sizeof(struct gm_patch*)) + 3 * 16;
+	}
+	for (const struct gm_patch *patch = patches; patch->section != GM_END; ++ patch) {
+		block_size += sizeof(struct gm_offset_delta);
+	}
+
+	struct gm_arena *arena = gm_arena_create(block_size);
+	if (!arena) {
+		return NULL;
+	}
+
+	patched = gm_arena_calloc(arena, count + 1, sizeof(struct gm_patched_index));
+	if (!patched) {
+		goto error;
+	}
+
+	for (size_t i = 0; i < count; ++ i) {
+		if ((index[i].section == GM_TXTR || index[i].section == GM_AUDO) && !index[i].loaded) {
+			LOG_ERR("%s section is not loaded", gm_section_name(index[i].section));
+
+			errno = EINVAL;
+			goto error;
+		}
+
+		// only sections whose entries can move get tables
+		if (index[i].offsets) {
+			const size_t entry_count = index[i].entry_count;
+			patched[i].offsets = gm_arena_calloc(arena, entry_count, sizeof(off_t));
+			patched[i].sizes   = gm_arena_calloc(arena, entry_count, sizeof(off_t));
+			patched[i].patches = gm_arena_calloc(arena, entry_count, sizeof(struct gm_patch*));
+			if (!patched[i].offsets || !patched[i].sizes || !patched[i].patches) {
+				goto error;
+			}
+
+			for (size_t j = 0; j < entry_count; ++ j) {
+				patched[i].offsets[j] = index[i].offsets[j];
+				patched[i].sizes[j]   = index[i].sizes[j];
+			}
+			patched[i].entry_count = entry_count;
+		}
+
+		patched[i].section     = index[i].section;
+		patched[i].offset      = index[i].offset;
+		patched[i].size        = index[i].size;
+		patched[i].index       = &index[i];
+		patched[i].strategy    = strategy;
+		patched[i].arena       = arena;
+	}
+	patched[count].section = GM_END;
+	patched[count].arena   = arena;
+
+	for (const struct gm_patch *patch = patches; patch->section != GM_END; ++ patch) {
+		struct gm_patched_index *section = gm_get_section(patched, patch->section);
+		if (!section) {
+			LOG_ERR("archive contains no %s section", gm_section_name(patch->section));
+
+			errno = EINVAL;
+			goto error;
+		}
+
+		if (!section->index->loaded) {
+			LOG_ERR("%s section is not loaded", gm_section_name(patch->section));
+
+			errno = EINVAL;
+			goto error;
+		}
+
+		if (gm_patch_entry(section, patch) != 0) {
+			LOG_ERR("applying patch for section %s, entry %" PRIuPTR " failed",
+				gm_section_name(patch->section), patch->index);
+			goto error;
+		}
+	}
+
+	if (gm_plan_patched_index(patched) != 0) {
+		goto error;
+	}
+
+	return patched;
+
+error:
+	{
+		int errnum = errno;
+		gm_arena_destroy(arena);
+		errno = errnum;
+	}
+
+	return NULL;
+}
+
+static bool gm_section_changed(const struct gm_patched_index *section) {
+	if (section->offset != section->index->offset || section->size != (off_t)section->index->size) {
+		return true;
+	}
+
+	for (size_t i = 0; i < section->entry_count; ++ i) {
+		if (section->patches[i] || section->offsets[i] != section->index->offsets[i]) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+enum gm_chunk_type {
+	GM_CHUNK_DATA,
+	GM_CHUNK_PATCH,
+	GM_CHUNK_ZERO
+};
+
+// a piece of the patched archive that isn't copied from the original
+struct gm_chunk {
+	off_t  offset;
+	size_t size;
+	enum gm_chunk_type type;
+
+	union {
+		uint8_t *data;
+		const struct gm_patch *patch;
+	} src;
+};
+
+struct gm_chunk_list {
+	size_t count;
+	size_t capacity;
+	struct gm_chunk *chunks;
+};
+
+static struct gm_chunk *gm_chunk_add(struct gm_chunk_list *list, off_t offset, size_t size, enum gm_chunk_type type) {
+	if (list->count == list->capacity) {
+		size_t capacity = list->capacity ? list->capacity * 2 : 64;
+		struct gm_chunk *chunks = realloc(list->chunks, capacity * sizeof(struct gm_chunk));
+		if (!chunks) {
+			return NULL;
+		}
+		list->chunks   = chunks;
+		list->capacity = capacity;
+	}
+
+	struct gm_chunk *chunk = &list->chunks[list->count];
+	chunk->offset   = offset;
+	chunk->size     = size;
+	chunk->type     = type;
+	chunk->src.data = NULL;
+
+	if (type == GM_CHUNK_DATA) {
+		chunk->src.data = malloc(size);
+		if (!chunk->src.data) {
+			return NULL;
+		}
+	}
+
+	++ list->count;
+
+	return chunk;
+}
+
+static void gm_free_chunks(struct gm_chunk_list *list) {
+	for (size_t i = 0; i < list->count; ++ i) {
+		if (list->chunks[i].type == GM_CHUNK_DATA) {
+			free(list->chunks[i].src.data);
+		}
+	}
+	free(list->chunks);
+	list->chunks   = NULL;
+	list->count    = 0;
+	list->capacity = 0;
+}
+
+static int gm_chunk_cmp(const void *lhs, const void *rhs) {
+	const struct gm_chunk *a = lhs;
+	const struct gm_chunk *b = rhs;
+
+	return a->offset < b->offset ? -1 : a->offset > b->offset ? 1 : 0;
+}
+
+// Where the original slot of an entry ends up in the output.
+static off_t gm_old_slot_offset(const struct gm_patched_index *index, size_t entry) {
+	return (off_t)index->index->offsets[entry] + (index->offset - index->index->offset);
+}
+
+// Whether the append strategy moved an entry to the end of its section.
+static bool gm_entry_relocated(const struct gm_patched_index *index, size_t entry) {
+	return index->strategy == GM_PATCH_STRATEGY_APPEND &&
+		(off_t)index->offsets[entry] != gm_old_slot_offset(index, entry);
+}
+
+// Zero fills the space between an entry and whatever follows it in the
+// patched section, so that stale data doesn't end up in alignment gaps.
+static int gm_add_slack(struct gm_chunk_list *list, const struct gm_patched_index *index, size_t entry) {
+	const off_t entry_hdr = gm_entry_hdr_size(index->section);
+	const off_t start = (off_t)index->offsets[entry] + (off_t)index->sizes[entry];
+	off_t end = index->offset + 8 + (off_t)index->size;
+
+	for (size_t i = 0; i < index->entry_count; ++ i) {
+		off_t next = (off_t)index->offsets[i] - entry_hdr;
+		if (next >= start && next < end) {
+			end = next;
+		}
+
+		// holes left by relocated entries are cleared on their own
+		next = gm_old_slot_offset(index, i) - entry_hdr;
+		if (gm_entry_relocated(index, i) && next >= start && next < end) {
+			end = next;
+		}
+	}
+
+	if (end > start && !gm_chunk_add(list, start, end - start, GM_CHUNK_ZERO)) {
+		return -1;
+	}
+
+	return 0;
+}
+
+// Collects everything that isn't copied from the original archive: the FORM
+// header, headers and offset tables of TXTR and AUDO sections and the patch
+// data, sorted by offset. If only_changed is true sections that stay the
+// same are skipped.
+//
+// This is where the 64-bit layout is written back as 32-bit fields. Every
+// offset and size written lies within the patched archive, so checking its
+// end once covers all of them.
+static int gm_build_chunks(struct gm_chunk_list *list, const struct gm_patched_index *patched, bool only_changed) {
+	const off_t archive_size = gm_form_size(patched) + 8;
+	if (archive_size > (off_t)UINT32_MAX + 1) {
+		LOG_ERR("patched archive too big: size = %" PRIi64 ", max. allowed = %" PRIu64,
+			(int64_t)archive_size, (uint64_t)UINT32_MAX + 1);
+
+		errno = EFBIG;
+		return -1;
+	}
+
+	struct gm_chunk *chunk = gm_chunk_add(list, 0, 8, GM_CHUNK_DATA);
+	if (!chunk) {
+		return -1;
+	}
+	memcpy(chunk->src.data, "FORM", 4);
+	WRITE_U32LE(chunk->src.data + 4, gm_form_size(patched));
+
+	for (const struct gm_patched_index *ptr = patched; ptr->section != GM_END; ++ ptr) {
+		if (ptr->section != GM_TXTR && ptr->section != GM_AUDO) {
+			// copied as a whole by the copy plan
+			continue;
+		}
+
+		if (only_changed && !gm_section_changed(ptr)) {
+			continue;
+		}
+
+		const size_t count = ptr->entry_count;
+		const size_t table_size = ptr->section == GM_TXTR ? 4 + 12 * count : 4 + 4 * count;
+
+		chunk = gm_chunk_add(list, ptr->offset, 8 + table_size, GM_CHUNK_DATA);
+		if (!chunk) {
+			return -1;
+		}
+
+		uint8_t *buffer = chunk->src.data;
+		memcpy(buffer, gm_section_name(ptr->section), 4);
+		WRITE_U32LE(buffer + 4, ptr->size);
+		WRITE_U32LE(buffer + 8, count);
+		buffer += 12;
+
+		if (ptr->section == GM_TXTR) {
+			const uint32_t fileinfo_offset = (uint32_t)ptr->offset + 12 + 4 * count;
+			for (size_t i = 0; i < count; ++ i) {
+				WRITE_U32LE(buffer, fileinfo_offset + i * 8);
+				buffer += 4;
+			}
+			for (size_t i = 0; i < count; ++ i) {
+				WRITE_U32LE(buffer, 1);
+				WRITE_U32LE(buffer + 4, ptr->offsets[i]);
+				buffer += 8;
+			}
+		}
+		else {
+			for (size_t i = 0; i < count; ++ i) {
+				WRITE_U32LE(buffer, ptr->offsets[i] - 4);
+				buffer += 4;
+			}
+		}
+
+		for (size_t i = 0; i < count; ++ i) {
+			const struct gm_patch *patch = ptr->patches[i];
+			if (patch) {
+				if (ptr->section == GM_AUDO) {
+					chunk = gm_chunk_add(list, (off_t)ptr->offsets[i] - 4, 4, GM_CHUNK_DATA);
+					if (!chunk) {
+						return -1;
+					}
+					WRITE_U32LE(chunk->src.data, patch->size);
+				}
+
+				chunk = gm_chunk_add(list, ptr->offsets[i], patch->size, GM_CHUNK_PATCH);
+				if (!chunk) {
+					return -1;
+				}
+				chunk->src.patch = patch;
+
+				// Don't leave the old data in the hole. Readers that derive
+				// entry sizes from the offsets would see it as part of the
+				// entry in front of it.
+				const size_t entry_hdr = gm_entry_hdr_size(ptr->section);
+				if (gm_entry_relocated(ptr, i) && !gm_chunk_add(list,
+						gm_old_slot_offset(ptr, i) - (off_t)entry_hdr,
+						ptr->index->sizes[i] + entry_hdr, GM_CHUNK_ZERO)) {
+					return -1;
+				}
+			}
+
+			if (ptr->strategy != GM_PATCH_STRATEGY_SHIFT &&
+			    (patch || ptr->strategy == GM_PATCH_STRATEGY_COMPACT) &&
+			    gm_add_slack(list, ptr, i) != 0) {
+				return -1;
+			}
+		}
+	}
+
+	qsort(list->chunks, list->count, sizeof(struct gm_chunk), gm_chunk_cmp);
+
+	return 0;
+}
+
+static int gm_open_patch_file(const struct gm_patch *patch) {
+#if defined(GM_WINDOWS)
+	int fd = open(patch->src.filename, O_RDONLY | O_BINARY);
+#else
+	int fd = open(patch->src.filename, O_RDONLY);
+#endif
+	if (fd < 0) {
+		int errnum = errno;
+		LOG_ERR("Failed to open patch file: %s: %s", patch->src.filename, strerror(errnum));
+		errno = errnum;
+	}
+	return fd;
+}
+
+static int gm_write_chunk_at(const struct gm_chunk *chunk, int fd, const struct gm_io_policy *policy) {
+	static const uint8_t zeros[4096] = { 0 };
+
+	switch (chunk->type) {
+	case GM_CHUNK_DATA:
+		return gm_pwrite_all(fd, chunk->src.data, chunk->size, chunk->offset);
+
+	case GM_CHUNK_ZERO:
+		for (size_t done = 0; done < chunk->size; ) {
+			size_t size = chunk->size - done < sizeof(zeros) ? chunk->size - done : sizeof(zeros);
+			if (gm_pwrite_all(fd, zeros, size, chunk->offset + done) != 0) {
+				return -1;
+			}
+			done += size;
+		}
+		return 0;
+
+	case GM_CHUNK_PATCH:
+		if (chunk->src.patch->patch_src == GM_SRC_MEM) {
+			return gm_pwrite_all(fd, chunk->src.patch->src.data, chunk->size, chunk->offset);
+		}
+		else {
+			int infd = gm_open_patch_file(chunk->src.patch);
+			if (infd < 0) {
+				return -1;
+			}
+			int status = gm_pcopy_range(infd, 0, fd, chunk->offset, chunk->size, policy, NULL);
+			int errnum = errno;
+			close(infd);
+			errno = errnum;
+			return status;
+		}
+	}
+
+	errno = EINVAL;
+	return -1;
+}
+
+// writes chunks to their offsets, used to patch an archive in place
+static int gm_write_chunks_at(const struct gm_chunk_list *list, int fd, const struct gm_io_policy *policy) {
+	for (size_t i = 0; i < list->count; ++ i) {
+		if (gm_write_chunk_at(&list->chunks[i], fd, policy) != 0) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+// Copies everything from the original archive that the copy plan maps to
+// [stream->pos, end), zero filling what it doesn't cover. *extent is the
+// first extent that might still be relevant.
+static int gm_stream_fill(struct gm_stream *stream, int srcfd, const struct gm_copy_plan *plan, size_t *extent, off_t end) {
+	while (stream->pos < end) {
+		while (*extent < plan->extent_count &&
+		       plan->extents[*extent].dst_offset + (off_t)plan->extents[*extent].size <= stream->pos) {
+			++ *extent;
+		}
+
+		if (*extent < plan->extent_count && plan->extents[*extent].dst_offset <= stream->pos) {
+			const struct gm_extent *ext = &plan->extents[*extent];
+			const off_t ext_end = ext->dst_offset + (off_t)ext->size;
+			const off_t copy_end = ext_end < end ? ext_end : end;
+
+			if (gm_stream_copy(stream, srcfd, ext->src_offset + (stream->pos - ext->dst_offset), copy_end - stream->pos) != 0) {
+				return -1;
+			}
+		}
+		else {
+			off_t zero_end = end;
+			if (*extent < plan->extent_count && plan->extents[*extent].dst_offset < zero_end) {
+				zero_end = plan->extents[*extent].dst_offset;
+			}
+
+			if (gm_stream_zero(stream, zero_end - stream->pos) != 0) {
+				return -1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+// Writes the patched archive front to back without ever seeking, so fd can
+// be a pipe or socket. Generated chunks take precedence over the copy plan.
+int gm_write_patched_archive(const struct gm_archive *archive, const struct gm_patched_index *patched, int fd) {
+	struct gm_copy_plan plan = { 0, 0, NULL };
+	struct gm_chunk_list chunks = { 0, 0, NULL };
+	struct gm_stream stream_buf = { -1, 0, 0, 0, NULL, false, NULL };
+	struct gm_stream *stream = &stream_buf;
+	const int srcfd = fileno(archive->fp);
+	size_t extent = 0;
+	int status = 0;
+
+	if (gm_stream_open(stream, fd, &archive->policy) != 0) {
+		goto error;
+	}
+
+	if (gm_build_copy_plan(patched, &plan) != 0 || gm_build_chunks(&chunks, patched, false) != 0) {
+		goto error;
+	}
+
+	for (size_t i = 0; i < chunks.count; ++ i) {
+		const struct gm_chunk *chunk = &chunks.chunks[i];
+
+		if (gm_stream_fill(stream, srcfd, &plan, &extent, chunk->offset) != 0) {
+			goto error;
+		}
+
+		if (chunk->offset != stream->pos) {
+			LOG_ERR("overlapping data at offset %" PRIi64 " in patched archive", (int64_t)chunk->offset);
+
+			errno = EINVAL;
+			goto error;
+		}
+
+		switch (chunk->type) {
+		case GM_CHUNK_DATA:
+			if (gm_stream_write(stream, chunk->src.data, chunk->size) != 0) {
+				goto error;
+			}
+			break;
+
+		case GM_CHUNK_ZERO:
+			if (gm_stream_zero(stream, chunk->size) != 0) {
+				goto error;
+			}
+			break;
+
+		case GM_CHUNK_PATCH:
+			if (chunk->src.patch->patch_src == GM_SRC_MEM) {
+				if (gm_stream_write(stream, chunk->src.patch->src.data, chunk->size) != 0) {
+					goto error;
+				}
+			}
+			else {
+				int infd = gm_open_patch_file(chunk->src.patch);
+				if (infd < 0) {
+					goto error;
+				}
+				int copy_status = gm_stream_copy(stream, infd, 0, chunk->size);
+				int errnum = errno;
+				close(infd);
+				errno = errnum;
+				if (copy_status != 0) {
+					goto error;
+				}
+			}
+			break;
+		}
+	}
+
+	if (gm_stream_fill(stream, srcfd, &plan, &extent, gm_form_size(patched) + 8) != 0 ||
+	    gm_stream_finish(stream) != 0) {
+		goto error;
+	}
+
+	goto end;
+
+error:
+	status = -1;
+
+end:
+	{
+		int errnum = errno;
+		gm_stream_close(stream);
+		gm_free_chunks(&chunks);
+		gm_free_copy_plan(&plan);
+		errno = errnum;
+	}
+
+	return status;
+}
+
+// A job of the parallel writer is either a piece of a copy plan extent or
+// a generated chunk. Extents are split so that big sections get spread over
+// several threads.
+#define GM_PARALLEL_SPLIT_SIZE (16 * 1024 * 1024)
+
+struct gm_parallel_job {
+	const struct gm_chunk *chunk;
+	struct gm_extent extent;
+};
+
+struct gm_parallel_phase {
+	const struct gm_parallel_job *jobs;
+	size_t job_count;
+	int srcfd;
+	int dstfd;
+	const struct gm_io_policy *policy;
+
+	atomic_size_t next_job;
+	atomic_int    errnum;
+};
+
+static int gm_run_job(const struct gm_parallel_phase *phase, const struct gm_parallel_job *job) {
+	if (job->chunk) {
+		return gm_write_chunk_at(job->chunk, phase->dstfd, phase->policy);
+	}
+
+	return gm_pcopy_range(phase->srcfd, job->extent.src_offset,
+		phase->dstfd, job->extent.dst_offset, job->extent.size, phase->policy, NULL);
+}
+
+static void *gm_parallel_worker(void *arg) {
+	struct gm_parallel_phase *phase = arg;
+
+	while (atomic_load(&phase->errnum) == 0) {
+		size_t index = atomic_fetch_add(&phase->next_job, 1);
+		if (index >= phase->job_count) {
+			break;
+		}
+
+		if (gm_run_job(phase, &phase->jobs[index]) != 0) {
+			int expected = 0;
+			atomic_compare_exchange_strong(&phase->errnum, &expected, errno ? errno : EIO);
+		}
+	}
+
+	return NULL;
+}
+
+static int gm_run_parallel(const struct gm_parallel_job *jobs, size_t job_count, int srcfd, int dstfd,
+                           const struct gm_io_policy *policy, size_t threads) {
+	struct gm_parallel_phase phase = {
+		.jobs      = jobs,
+		.job_count = job_count,
+		.srcfd     = srcfd,
+		.dstfd     = dstfd,
+		.policy    = policy
+	};
+	atomic_init(&phase.next_job, 0);
+	atomic_init(&phase.errnum, 0);
+
+	if (threads > job_count) {
+		threads = job_count;
+	}
+
+	gm_run_workers(gm_parallel_worker, &phase, threads);
+
+	int errnum = atomic_load(&phase.errnum);
+	if (errnum != 0) {
+		errno = errnum;
+		return -1;
+	}
+
+	return 0;
+}
+
+// Writes the patched archive with several threads. Every section and entry
+// already has its final offset, so the output is preallocated and filled
+// with pwrite() out of order: first everything copied from the original
+// archive, then the generated chunks, which may cover parts of the copied
+// data (e.g. entries replaced in place by the append strategy).
+int gm_write_patched_archive_parallel(const struct gm_archive *archive, const struct gm_patched_index *patched,
+                                      int fd, size_t threads) {
+	struct gm_copy_plan plan = { 0, 0, NULL };
+	struct gm_chunk_list chunks = { 0, 0, NULL };
+	struct gm_parallel_job *jobs = NULL;
+	const int srcfd = fileno(archive->fp);
+	int status = 0;
+
+	if (threads == 0) {
+		threads = gm_cpu_count();
+	}
+
+#if !defined(GM_THREADS)
+	threads = 1;
+#endif
+
+	if (gm_build_copy_plan(patched, &plan) != 0 || gm_build_chunks(&chunks, patched, false) != 0) {
+		goto error;
+	}
+
+	size_t job_count = chunks.count;
+	for (size_t i = 0; i < plan.extent_count; ++ i) {
+		job_count += (plan.extents[i].size + GM_PARALLEL_SPLIT_SIZE - 1) / GM_PARALLEL_SPLIT_SIZE;
+	}
+
+	jobs = calloc(job_count + 1, sizeof(struct gm_parallel_job));
+	if (!jobs) {
+		goto error;
+	}
+
+	size_t copy_jobs = 0;
+	for (size_t i = 0; i < plan.extent_count; ++ i) {
+		const struct gm_extent *extent = &plan.extents[i];
+		for (size_t done = 0; done < extent->size; done += GM_PARALLEL_SPLIT_SIZE) {
+			struct gm_parallel_job *job = &jobs[copy_jobs ++];
+			job->extent.src_offset = extent->src_offset + done;
+			job->extent.dst_offset = extent->dst_offset + done;
+			job->extent.size = extent->size - done < GM_PARALLEL_SPLIT_SIZE ? extent->size - done : GM_PARALLEL_SPLIT_SIZE;
+		}
+	}
+
+	for (size_t i = 0; i < chunks.count; ++ i) {
+		jobs[copy_jobs + i].chunk = &chunks.chunks[i];
+	}
+
+	if (gm_preallocate(fd, gm_form_size(patched) + 8) != 0) {
+		goto error;
+	}
+
+	if (gm_run_parallel(jobs, copy_jobs, srcfd, fd, &archive->policy, threads) != 0 ||
+	    gm_run_parallel(jobs + copy_jobs, chunks.count, srcfd, fd, &archive->policy, threads) != 0) {
+		goto error;
+	}
+
+	goto end;
+
+error:
+	status = -1;
+
+end:
+	{
+		int errnum = errno;
+		free(jobs);
+		gm_free_chunks(&chunks);
+		gm_free_copy_plan(&plan);
+		errno = errnum;
+	}
+
+	return status;
+}
+
+// Writes the patched archive to a new file (replacing whatever is there).
+static int gm_write_archive_file(const char *outname, const struct gm_archive *game,
+                                 const struct gm_patched_index *patched, size_t threads) {
+	const bool direct = (game->policy.flags & GM_IO_DIRECT) != 0;
+	int fd = -1;
+
+#if defined(GM_WINDOWS)
+	(void)direct;
+	fd = open(outname, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+#else
+#if defined(O_DIRECT)
+	if (direct) {
+		fd = open(outname, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+		// not every filesystem supports it, the aligned writes work anyway
+	}
+#endif
+	if (fd < 0) {
+		fd = open(outname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	}
+#endif
+	if (fd < 0) {
+		LOG_ERR("Failed to open output file: %s", outname);
+		return -1;
+	}
+
+	// O_DIRECT needs the aligned buffer of the sequential writer
+	int status = threads == 1 || direct ?
+		gm_write_patched_archive(game, patched, fd) :
+		gm_write_patched_archive_parallel(game, patched, fd, threads);
+
+	if (status == 0) {
+		gm_io_release(fd, true, &game->policy);
+	}
+
+	int errnum = errno;
+	if (close(fd) != 0 && status == 0) {
+		return -1;
+	}
+	errno = errnum;
+
+	return status;
+}
+
+static int gm_patch_to_tmp(const char *filename, struct gm_archive **game,
+                           const struct gm_patched_index *patched, size_t threads) {
+	char tmpname[PATH_MAX];
+	int status = 0;
+
+	memset(tmpname, 0, sizeof(tmpname));
+	if (GM_CONCAT(tmpname, sizeof(tmpname), filename, ".tmp") != 0) {
+		errno = ENAMETOOLONG;
+		goto error;
+	}
+
+	if (gm_write_archive_file(tmpname, *game, patched, threads) != 0) {
+		goto error;
+	}
+
+	// unmap before the original is replaced (required on Windows)
+	gm_close_archive(*game);
+	*game = NULL;
+
+	// delete target mainly to make it work on windows:
+	if (unlink(filename) != 0) {
+		LOG_ERR("Failed to remove original game archive: %s", filename);
+		goto error;
+	}
+
+	if (rename(tmpname, filename) != 0) {
+		LOG_ERR("Failed to rename temp file to: %s", filename);
+		goto error;
+	}
+
+	goto end;
+
+error:
+	status = -1;
+	int errnum = errno;
+
+	if (tmpname[0]) {
+		unlink(tmpname);
+	}
+
+	// keep the original error
+	errno = errnum;
+
+end:
+
+	return status;
+}
+
+static int gm_patch_in_place(const char *filename, struct gm_archive **game,
+                             const struct gm_patched_index *patched) {
+	char backup_name[PATH_MAX];
+	struct stat st;
+	struct gm_copy_plan plan = { 0, 0, NULL };
+	struct gm_chunk_list chunks = { 0, 0, NULL };
+	const struct gm_io_policy policy = (*game)->policy;
+	FILE *fp = NULL;
+	int status = 0;
+
+	// Nothing protects the archive if anything fails in between, so only do
+	// this when there is a backup to go back to.
+	if (GM_CONCAT(backup_name, sizeof(backup_name), filename, ".backup") != 0) {
+		errno = ENAMETOOLONG;
+		goto error;
+	}
+
+	if (stat(backup_name, &st) != 0 || !S_ISREG(st.st_mode)) {
+		LOG_ERR("In-place patching requires a backup of the game archive: %s", backup_name);
+
+		errno = EINVAL;
+		goto error;
+	}
+
+	// copy everything that is unchanged, coalesced into as few extents as possible
+	if (gm_build_copy_plan(patched, &plan) != 0 || gm_build_chunks(&chunks, patched, true) != 0) {
+		goto error;
+	}
+
+	// the mapping must be gone before the file can be truncated on Windows
+	gm_close_archive(*game);
+	*game = NULL;
+
+	// a half patched archive might still match the old cache
+	gm_remove_index_cache(filename);
+
+	fp = fopen(filename, "r+b");
+	if (!fp) {
+		LOG_ERR("Failed to open archive for writing: %s", filename);
+		goto error;
+	}
+
+	if (gm_execute_move_plan(&plan, fileno(fp), &policy) != 0) {
+		LOG_ERR("Error moving data inside of game archive, please restore it from: %s", backup_name);
+		goto error;
+	}
+
+	if (gm_write_chunks_at(&chunks, fileno(fp), &policy) != 0) {
+		LOG_ERR("Error writing game archive, please restore it from: %s", backup_name);
+		goto error;
+	}
+
+	if (gm_truncate(fileno(fp), gm_form_size(patched) + 8) != 0) {
+		LOG_ERR("Error truncating game archive, please restore it from: %s", backup_name);
+		goto error;
+	}
+
+	gm_io_release(fileno(fp), true, &policy);
+
+	{
+		int close_status = fclose(fp);
+		fp = NULL;
+		if (close_status != 0) {
+			goto error;
+		}
+	}
+
+	goto end;
+
+error:
+	status = -1;
+
+	if (fp) {
+		int errnum = errno;
+		fclose(fp);
+		fp = NULL;
+		errno = errnum;
+	}
 
-	if (fwrite(buffer, 8, 1, fp) != 1) {
-		return -1;
+end:
+	{
+		int errnum = errno;
+		gm_free_chunks(&chunks);
+		gm_free_copy_plan(&plan);
+		errno = errnum;
 	}
 
-	return 0;
+	return status;
 }
 
-size_t gm_index_length(const struct gm_index *index) {
-	size_t len = 0;
-	while (index->section != GM_END) {
-		++ len;
-		++ index;
+// Parses what patching needs: the sections that are rewritten and the ones
+// that are targeted by patches.
+static int gm_load_patch_sections(const struct gm_archive *archive, struct gm_index *index,
+                                  const struct gm_patch *patches) {
+	enum gm_section sections[] = { GM_TXTR, GM_AUDO, GM_END, GM_END, GM_END };
+	size_t count = 2;
+
+	for (const struct gm_patch *patch = patches; patch->section != GM_END; ++ patch) {
+		if ((patch->section == GM_SPRT || patch->section == GM_BGND) &&
+		    !gm_section_listed(sections, patch->section)) {
+			sections[count ++] = patch->section;
+		}
 	}
-	return len;
+
+	return gm_load_sections(archive, index, sections);
 }
 
-int gm_patch_archive(const char *filename, const struct gm_patch *patches) {
-	char tmpname[PATH_MAX];
-	FILE *game = NULL;
-	FILE *tmp  = NULL;
+// outname == NULL means the archive itself is patched
+static int gm_patch_archive_impl(const char *filename, const char *outname,
+                                 const struct gm_patch *patches, const struct gm_patch_options *options) {
+	static const struct gm_patch_options default_options = GM_PATCH_OPTIONS_INIT;
+	struct gm_archive *game = NULL;
 	struct gm_index *index           = NULL;
 	struct gm_patched_index *patched = NULL;
+	struct gm_composite composite = { NULL, NULL, 0 };
 	int status = 0;
 
-	memset(tmpname, 0, sizeof(tmpname));
-	if (GM_CONCAT(tmpname, sizeof(tmpname), filename, ".tmp") != 0) {
-		errno = ENAMETOOLONG;
-		goto error;
+	if (!options) {
+		options = &default_options;
 	}
 
-	game = fopen(filename, "rb");
+	game = gm_open_archive(filename, GM_ARCHIVE_LAZY, options->io);
 	if (!game) {
 		LOG_ERR("Failed to open archive: %s", filename);
 		goto error;
 	}
 
-	index = gm_read_index(game);
+	index = gm_read_archive_index_cached(game, filename);
 	if (!index) {
 		goto error;
 	}
 
-	// build patch index
-	const size_t count = gm_index_length(index);
-	patched = calloc(count + 1, sizeof(struct gm_patched_index));
-	if (!patched) {
+	if (gm_load_patch_sections(game, index, patches) != 0) {
 		goto error;
 	}
 
-	for (size_t i = 0; i < count; ++ i) {
-		size_t entry_count = index[i].entry_count;
-		struct gm_patched_entry *entries = calloc(entry_count, sizeof(struct gm_patched_entry));
-		if (!entries) {
-			goto error;
-		}
-
-		struct gm_entry *index_entries = index[i].entries;
-		for (size_t j = 0; j < entry_count; ++ j) {
-			entries[j].offset = index_entries[j].offset;
-			entries[j].size   = index_entries[j].size;
-			entries[j].entry  = &index_entries[j];
-		}
-
-		patched[i].section     = index[i].section;
-		patched[i].offset      = index[i].offset;
-		patched[i].size        = index[i].size;
-		patched[i].entry_count = entry_count;
-		patched[i].entries     = entries;
-		patched[i].index       = &index[i];
+	if (gm_composite_patches(game, index, patches, options->threads, &composite) != 0) {
+		goto error;
 	}
-	patched[count].section = GM_END;
-
-	// adjust patch index
-	for (const struct gm_patch *patch = patches; patch->section != GM_END; ++ patch) {
-		struct gm_patched_index *section = gm_get_section(patched, patch->section);
-		if (!section) {
-			LOG_ERR("archive contains no %s section", gm_section_name(patch->section));
-
-			errno = EINVAL;
-			goto error;
-		}
 
-		if (gm_patch_entry(section, patch) != 0) {
-			LOG_ERR("applying patch for section %s, entry %" PRIuPTR " failed",
-				gm_section_name(patch->section), patch->index);
-			goto error;
-		}
+	if (composite.patches) {
+		patches = composite.patches;
 	}
 
-	// write new archive
-	tmp = fopen(tmpname, "wb");
-	if (!tmp) {
-		LOG_ERR("Failed to open temp file: %s", tmpname);
+	patched = gm_build_patched_index(index, patches, options->strategy);
+	if (!patched) {
 		goto error;
 	}
 
-	size_t form_size = gm_form_size(patched);
-	if (gm_write_hdr(tmp, (const uint8_t*)"FORM", form_size) != 0) {
+	if (outname && options->mode != GM_PATCH_MODE_COPY) {
+		LOG_ERR_MSG("an output file can only be used with the copy patch mode");
+
+		errno = EINVAL;
 		goto error;
 	}
 
-	for (struct gm_patched_index *ptr = patched; ptr->section != GM_END; ++ ptr) {
-		uint8_t buffer[8];
+	// these unmap the archive before the patched index cache is written
+	if (!outname && (options->mode == GM_PATCH_MODE_COPY || options->mode == GM_PATCH_MODE_IN_PLACE) &&
+	    gm_detach_index(index, game) != 0) {
+		goto error;
+	}
 
-		if (fseeko(tmp, ptr->offset, SEEK_SET) != 0) {
+	switch (options->mode) {
+	case GM_PATCH_MODE_COPY:
+		if (outname) {
+			if (gm_write_archive_file(outname, game, patched, options->threads) != 0) {
+				goto error;
+			}
+		}
+		else if (gm_patch_to_tmp(filename, &game, patched, options->threads) != 0) {
 			goto error;
 		}
+		break;
 
-		if (gm_write_hdr(tmp, (const uint8_t*)gm_section_name(ptr->section), ptr->size) != 0) {
+	case GM_PATCH_MODE_IN_PLACE:
+		if (gm_patch_in_place(filename, &game, patched) != 0) {
 			goto error;
 		}
+		break;
 
-		switch (ptr->section) {
-		case GM_TXTR:
-		{
-			WRITE_U32LE(buffer, ptr->entry_count);
-			if (fwrite(buffer, 4, 1, tmp) != 1) {
-				goto error;
-			}
-			const uint32_t fileinfo_offset = (uint32_t)ptr->offset + 12 + 4 * ptr->entry_count;
-			for (size_t i = 0; i < ptr->entry_count; ++ i) {
-				WRITE_U32LE(buffer, fileinfo_offset + i * 8);
-				if (fwrite(buffer, 4, 1, tmp) != 1) {
-					goto error;
-				}
-			}
-			for (size_t i = 0; i < ptr->entry_count; ++ i) {
-				WRITE_U32LE(buffer, 1);
-				WRITE_U32LE(buffer + 4, ptr->entries[i].offset);
-				if (fwrite(buffer, 8, 1, tmp) != 1) {
-					goto error;
-				}
-			}
-			for (size_t i = 0; i < ptr->entry_count; ++ i) {
-				struct gm_patched_entry *entry = &ptr->entries[i];
-				if (entry->patch) {
-					if (fseeko(tmp, entry->offset, SEEK_SET) != 0) {
-						goto error;
-					}
-					if (gm_write_patch_data(tmp, entry->patch) != 0) {
-						goto error;
-					}
-				}
-				else if (gm_copydata(game, entry->entry->offset, tmp, entry->offset, entry->size) != 0) {
-					goto error;
-				}
-			}
-			break;
+	case GM_PATCH_MODE_STREAM:
+		if (gm_write_patched_archive(game, patched, options->fd) != 0) {
+			goto error;
 		}
+		break;
 
-		case GM_AUDO:
-			WRITE_U32LE(buffer, ptr->entry_count);
-			if (fwrite(buffer, 4, 1, tmp) != 1) {
-				goto error;
-			}
-			for (size_t i = 0; i < ptr->entry_count; ++ i) {
-				uint32_t offset = ptr->entries[i].offset - 4;
-				WRITE_U32LE(buffer, offset);
-				if (fwrite(buffer, 4, 1, tmp) != 1) {
-					goto error;
-				}
-			}
-			for (size_t i = 0; i < ptr->entry_count; ++ i) {
-				struct gm_patched_entry *entry = &ptr->entries[i];
-				if (entry->patch) {
-					if (fseeko(tmp, entry->offset - 4, SEEK_SET) != 0) {
-						goto error;
-					}
-					WRITE_U32LE(buffer, entry->patch->size);
-					if (fwrite(buffer, 4, 1, tmp) != 1) {
-						goto error;
-					}
-					if (gm_write_patch_data(tmp, entry->patch) != 0) {
-						goto error;
-					}
-				}
-				else if (gm_copydata(game, entry->entry->offset - 4, tmp, entry->offset - 4, entry->size + 4) != 0) {
-					goto error;
-				}
-			}
-			break;
-
-		default:
-			if (gm_copydata(game, ptr->index->offset, tmp, ptr->offset, ptr->size + 8) != 0) {
-				goto error;
-			}
+	case GM_PATCH_MODE_PLAN:
+		if (gm_print_patch_plan_fd(patched, options->fd) != 0) {
+			goto error;
 		}
-	}
-
-	if (fclose(game) != 0) {
-		game = NULL;
-		goto error;
-	}
+		break;
 
-	if (fclose(tmp) != 0) {
-		tmp = NULL;
-		goto error;
-	}
+	default:
+		LOG_ERR("Unknown patch mode: %d", options->mode);
 
-	// delete target mainly to make it work on windows:
-	if (unlink(filename) != 0) {
-		LOG_ERR("Failed to remove original game archive: %s", filename);
+		errno = EINVAL;
 		goto error;
 	}
 
-	if (rename(tmpname, filename) != 0) {
-		LOG_ERR("Failed to rename temp file to: %s", filename);
-		goto error;
+	// the next run can skip parsing the new archive (best effort)
+	if (options->mode == GM_PATCH_MODE_COPY || options->mode == GM_PATCH_MODE_IN_PLACE) {
+		gm_save_patched_index_cache(patched, outname ? outname : filename);
 	}
 
 	goto end;
 
 error:
 	status = -1;
-	int errnum = errno;
 
-	if (game) {
-		fclose(game);
-		game = NULL;
+end:
+	{
+		int errnum = errno;
+
+		if (game) {
+			gm_close_archive(game);
+			game = NULL;
+		}
+
+		if (index) {
+			gm_free_index(index);
+			index = NULL;
+		}
+
+		if (patched) {
+			gm_free_patched_index(patched);
+			patched = NULL;
+		}
+
+		gm_free_composite(&composite);
+
+		// keep the original error
+		errno = errnum;
 	}
 
-	if (tmp) {
-		fclose(tmp);
-		tmp = NULL;
+	return status;
+}
+
+// Parses one of the options for writing the patched archive shared by the
+// command line tools. Returns 1 if arg was such an option, 0 if not and -1
+// if its value is invalid.
+int gm_parse_patch_option(const char *arg, struct gm_patch_options *options) {
+	if (strcmp(arg, "--in-place") == 0) {
+		options->mode = GM_PATCH_MODE_IN_PLACE;
+	}
+	else if (strcmp(arg, "--append") == 0) {
+		options->strategy = GM_PATCH_STRATEGY_APPEND;
 	}
+	else if (strcmp(arg, "--compact") == 0) {
+		options->strategy = GM_PATCH_STRATEGY_COMPACT;
+	}
+	else if (strncmp(arg, "--threads=", 10) == 0) {
+		char *endptr = NULL;
+		unsigned long threads = strtoul(arg + 10, &endptr, 10);
 
-	if (tmpname[0]) {
-		unlink(tmpname);
+		if (!arg[10] || *endptr) {
+			return -1;
+		}
+
+		options->threads = threads;
+	}
+	else if (strcmp(arg, "--stdout") == 0) {
+		options->mode = GM_PATCH_MODE_STREAM;
+		options->fd   = STDOUT_FILENO;
+	}
+	else if (strcmp(arg, "--plan") == 0) {
+		options->mode = GM_PATCH_MODE_PLAN;
+		options->fd   = STDOUT_FILENO;
+	}
+	else {
+		return 0;
 	}
 
-	// keep the original error
-	errno = errnum;
+	return 1;
+}
 
-end:
+int gm_patch_archive(const char *filename, const struct gm_patch *patches, const struct gm_patch_options *options) {
+	return gm_patch_archive_impl(filename, NULL, patches, options);
+}
 
-	if (index) {
-		gm_free_index(index);
-		index = NULL;
+// Writes the patched version of infile to outfile, e.g. after the original
+// was renamed to a backup. This saves writing the whole archive twice.
+int gm_patch_archive_to(const char *infile, const char *outfile, const struct gm_patch *patches,
+                        const struct gm_patch_options *options) {
+	struct stat in_st, out_st;
+
+	if (stat(infile, &in_st) != 0) {
+		LOG_ERR("Failed to access archive: %s", infile);
+		return -1;
 	}
 
-	if (patched) {
-		gm_free_patched_index(patched);
-		patched = NULL;
+	// opening outfile would truncate the archive that is being read
+	// (Windows has no inode numbers, but won't truncate a mapped file)
+#if !defined(GM_WINDOWS)
+	if (stat(outfile, &out_st) == 0 && in_st.st_dev == out_st.st_dev && in_st.st_ino == out_st.st_ino) {
+		LOG_ERR("Input and output are the same file: %s", outfile);
+
+		errno = EINVAL;
+		return -1;
 	}
+#else
+	(void)out_st;
+#endif
 
-	return status;
+	return gm_patch_archive_impl(infile, outfile, patches, options);
 }
 
 struct gm_patch_buf {
@@ -1318,8 +3561,10 @@ struct gm_patch_buf {
 	size_t size;
 };
 
+// Only collects the file names, the files are inspected afterwards by
+// gm_read_patch_files().
 static int gm_patch_scan_dir(struct gm_patch_buf *pbuf, const char *dirname, const char *subdirname, const char *exts[],
-                             int read_info(FILE *fp, struct gm_patch *patch)) {
+                             enum gm_section section) {
 	char namebuf[PATH_MAX];
 	DIR *dir = NULL;
 	int status = 0;
@@ -1385,23 +3630,11 @@ static int gm_patch_scan_dir(struct gm_patch_buf *pbuf, const char *dirname, con
 			}
 
 			struct gm_patch *patch = &pbuf->patches[pbuf->size];
+			patch->section      = section;
 			patch->index        = index;
 			patch->patch_src    = GM_SRC_FILE;
 			patch->src.filename = filename;
 
-			FILE *fp = fopen(namebuf, "rb");
-			if (!fp) {
-				perror(namebuf);
-				goto error;
-			}
-
-			if (read_info(fp, patch) != 0) {
-				perror(namebuf);
-				fclose(fp);
-				goto error;
-			}
-			fclose(fp);
-
 			++ pbuf->size;
 		}
 	}
@@ -1424,14 +3657,44 @@ end:
 	return status;
 }
 
-static int gm_read_txtr_info(FILE *fp, struct gm_patch *patch) {
+// Most PNGs end with IEND, so only the header and the last chunk are read.
+// Anything else, e.g. a file with trailing garbage, is read as a whole to
+// walk its chunks.
+static int gm_read_txtr_info(int fd, off_t filesize, struct gm_patch *patch) {
+	uint8_t head[PNG_HEAD_SIZE];
+	uint8_t tail[PNG_TAIL_SIZE];
 	struct png_info info;
+	bool found = false;
 
-	if (parse_png_info(fp, &info) != 0) {
+	if ((uintmax_t)filesize > SIZE_MAX) {
+		errno = EFBIG;
 		return -1;
 	}
 
-	patch->section          = GM_TXTR;
+	if (filesize >= PNG_HEAD_SIZE + PNG_TAIL_SIZE) {
+		if (gm_pread_all(fd, head, sizeof(head), 0) != 0 ||
+		    gm_pread_all(fd, tail, sizeof(tail), filesize - PNG_TAIL_SIZE) != 0) {
+			return -1;
+		}
+		found = parse_png_head_tail(head, tail, (size_t)filesize, &info) == 0;
+	}
+
+	if (!found) {
+		uint8_t *data = malloc(filesize > 0 ? (size_t)filesize : 1);
+		if (!data) {
+			return -1;
+		}
+
+		if (gm_pread_all(fd, data, (size_t)filesize, 0) != 0 ||
+		    parse_png_info_mem(data, (size_t)filesize, &info) != 0) {
+			int errnum = errno;
+			free(data);
+			errno = errnum;
+			return -1;
+		}
+		free(data);
+	}
+
 	patch->type             = GM_PNG;
 	patch->size             = info.filesize;
 	patch->meta.txtr.width  = info.width;
@@ -1440,16 +3703,16 @@ static int gm_read_txtr_info(FILE *fp, struct gm_patch *patch) {
 	return 0;
 }
 
-static int gm_read_audo_info(FILE *fp, struct gm_patch *patch) {
+static int gm_read_audo_info(int fd, off_t filesize, struct gm_patch *patch) {
 	uint8_t buffer[12];
-	struct stat st;
+	const size_t count = filesize < (off_t)sizeof(buffer) ? (size_t)filesize : sizeof(buffer);
 
-	if (fstat(fileno(fp), &st) != 0) {
+	if ((uintmax_t)filesize > SIZE_MAX) {
+		errno = EFBIG;
 		return -1;
 	}
 
-	const size_t count = fread(buffer, 1, sizeof(buffer), fp);
-	if (ferror(fp)) {
+	if (gm_pread_all(fd, buffer, count, 0) != 0) {
 		return -1;
 	}
 
@@ -1463,13 +3726,115 @@ static int gm_read_audo_info(FILE *fp, struct gm_patch *patch) {
 		patch->type = GM_UNKNOWN;
 	}
 
-	patch->section = GM_AUDO;
-	patch->size    = st.st_size;
+	patch->size = (size_t)filesize;
+
+	return 0;
+}
+
+static int gm_read_patch_file(struct gm_patch *patch) {
+	struct stat st;
+	int status = 0;
+
+	if (patch->section == GM_SPRT || patch->section == GM_BGND) {
+		// read as a whole when it's pasted into its texture page
+		return 0;
+	}
+
+	if (patch->section != GM_TXTR && patch->section != GM_AUDO) {
+		LOG_ERR("%s: only TXTR, AUDO, SPRT and BGND entries can be read from files", patch->src.filename);
+
+		errno = EINVAL;
+		return -1;
+	}
+
+	int fd = gm_open_patch_file(patch);
+	if (fd < 0) {
+		return -1;
+	}
+
+	if (fstat(fd, &st) != 0) {
+		status = -1;
+	}
+	else if (patch->section == GM_TXTR) {
+		status = gm_read_txtr_info(fd, st.st_size, patch);
+	}
+	else {
+		status = gm_read_audo_info(fd, st.st_size, patch);
+	}
+
+	int errnum = errno;
+	if (status != 0) {
+		perror(patch->src.filename);
+	}
+	close(fd);
+	errno = errnum;
+
+	return status;
+}
+
+struct gm_patch_file_phase {
+	struct gm_patch *patches;
+	size_t count;
+
+	atomic_size_t next;
+	atomic_int    errnum;
+};
+
+static void *gm_patch_file_worker(void *arg) {
+	struct gm_patch_file_phase *phase = arg;
+
+	while (atomic_load(&phase->errnum) == 0) {
+		size_t index = atomic_fetch_add(&phase->next, 1);
+		if (index >= phase->count) {
+			break;
+		}
+
+		struct gm_patch *patch = &phase->patches[index];
+		if (patch->patch_src == GM_SRC_FILE && gm_read_patch_file(patch) != 0) {
+			int expected = 0;
+			atomic_compare_exchange_strong(&phase->errnum, &expected, errno ? errno : EINVAL);
+		}
+	}
+
+	return NULL;
+}
+
+// Fills in type, size and meta data of all GM_SRC_FILE patches (GM_END
+// terminated) from their files. Only the start and the end of each file is
+// read and the files are inspected by up to threads threads, 0 = one per CPU.
+int gm_read_patch_files(struct gm_patch *patches, size_t threads) {
+	struct gm_patch_file_phase phase = {
+		.patches = patches,
+		.count   = 0
+	};
+
+	while (patches[phase.count].section != GM_END) {
+		++ phase.count;
+	}
+
+	if (threads == 0) {
+		threads = gm_cpu_count();
+	}
+
+	if (threads > phase.count) {
+		threads = phase.count > 0 ? phase.count : 1;
+	}
+
+	atomic_init(&phase.next, 0);
+	atomic_init(&phase.errnum, 0);
+
+	gm_run_workers(gm_patch_file_worker, &phase, threads);
+
+	int errnum = atomic_load(&phase.errnum);
+	if (errnum != 0) {
+		errno = errnum;
+		return -1;
+	}
 
 	return 0;
 }
 
-int gm_patch_archive_from_dir(const char *filename, const char *dirname) {
+int gm_patch_archive_from_dir(const char *filename, const char *dirname, const struct gm_patch_options *options) {
 	struct gm_patch_buf pbuf;
 	int status = 0;
 
@@ -1482,17 +3847,21 @@ int gm_patch_archive_from_dir(const char *filename, const char *dirname) {
 		goto error;
 	}
 
-	if (gm_patch_scan_dir(&pbuf, dirname, "txtr", (const char*[]){".png", ".dat", NULL}, gm_read_txtr_info) != 0) {
+	if (gm_patch_scan_dir(&pbuf, dirname, "txtr", (const char*[]){".png", ".dat", NULL}, GM_TXTR) != 0) {
 		goto error;
 	}
 
-	if (gm_patch_scan_dir(&pbuf, dirname, "audo", (const char*[]){".wav", ".ogg", ".dat", NULL}, gm_read_audo_info) != 0) {
+	if (gm_patch_scan_dir(&pbuf, dirname, "audo", (const char*[]){".wav", ".ogg", ".dat", NULL}, GM_AUDO) != 0) {
 		goto error;
 	}
 
 	pbuf.patches[pbuf.size].section = GM_END;
 
-	if (gm_patch_archive(filename, pbuf.patches) != 0) {
+	if (gm_read_patch_files(pbuf.patches, options ? options->threads : 0) != 0) {
+		goto error;
+	}
+
+	if (gm_patch_archive(filename, pbuf.patches, options) != 0) {
 		goto error;
 	}
 
@@ -1534,9 +3903,13 @@ const char *gm_typename(enum gm_filetype type) {
 	}
 }
 
-int gm_dump_files(const struct gm_index *index, FILE *game, const char *outdir) {
+int gm_dump_archive_files(struct gm_index *index, const struct gm_archive *archive, const char *outdir) {
 	char buf[PATH_MAX];
 
+	if (gm_load_sections(archive, index, (const enum gm_section[]){ GM_TXTR, GM_AUDO, GM_END }) != 0) {
+		return -1;
+	}
+
 	for (; index->section != GM_END; ++ index) {
 		const char *dir = NULL;
 
@@ -1562,8 +3935,7 @@ int gm_dump_files(const struct gm_index *index, FILE *game, const char *outdir)
 		}
 
 		for (size_t i = 0; i < index->entry_count; ++ i) {
-			const struct gm_entry *entry = &index->entries[i];
-			const char *ext = gm_extension(entry->type);
+			const char *ext = gm_extension(index->types[i]);
 			int count = snprintf(buf, sizeof(buf), "%s%c%s%c%04" PRIuPTR "%s",
 			                     outdir, GM_PATH_SEP, dir, GM_PATH_SEP, i, ext);
 
@@ -1585,11 +3957,13 @@ int gm_dump_files(const struct gm_index *index, FILE *game, const char *outdir)
 				return -1;
 			}
 
-			if (gm_copydata(game, entry->offset, fp, 0, entry->size) != 0) {
+			if (gm_write_archive_data(archive, index->offsets[i], fp, 0, index->sizes[i]) != 0 || fflush(fp) != 0) {
 				fclose(fp);
 				return -1;
 			}
 
+			gm_io_release(fileno(fp), true, &archive->policy);
+
 			if (fclose(fp) != 0) {
 				return -1;
 			}
@@ -1599,6 +3973,21 @@ int gm_dump_files(const struct gm_index *index, FILE *game, const char *outdir)
 	return 0;
 }
 
+int gm_dump_files(struct gm_index *index, FILE *game, const char *outdir, const struct gm_io_policy *policy) {
+	struct gm_archive *archive = gm_map_archive(game, 0, policy);
+	if (!archive) {
+		return -1;
+	}
+
+	int status = gm_dump_archive_files(index, archive, outdir);
+	int errnum = errno;
+
+	gm_close_archive(archive);
+	errno = errnum;
+
+	return status;
+}
+
 int gm_concat(char *buf, size_t size, const char *strs[], size_t nstrs) {
 	size_t ch_index = 0;
 
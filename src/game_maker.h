@@ -4,6 +4,11 @@
 
 #include <stdio.h>
 #include <inttypes.h>
+#include <stdbool.h>
+
+#include "gm_io.h"
+#include "gm_arena.h"
+#include "png_decode.h"
 
 #if defined(_WIN16) || defined(_WIN32) || defined(_WIN64)
 #	define GM_WINDOWS
@@ -95,12 +100,27 @@ struct gm_patch {
 	} meta;
 };
 
+// For sprites index is the frame number.
+#define GM_PATCH_SPRT_FRAME(NAME, FRAME, X, Y, WIDTH, HEIGHT, TXTR_INDEX) \
+	{ GM_SPRT, (FRAME), GM_PNG, GM_SRC_MEM, 0, { .data = NULL }, { .sprt = { (NAME), (X), (Y), (WIDTH), (HEIGHT), (TXTR_INDEX) } } }
+
 #define GM_PATCH_SPRT(NAME, X, Y, WIDTH, HEIGHT, TXTR_INDEX) \
-	{ GM_SPRT, 0, GM_PNG, GM_SRC_MEM, 0, { .data = NULL }, { .sprt = { (NAME), (X), (Y), (WIDTH), (HEIGHT), (TXTR_INDEX) } } }
+	GM_PATCH_SPRT_FRAME(NAME, 0, X, Y, WIDTH, HEIGHT, TXTR_INDEX)
 
 #define GM_PATCH_BGND(NAME, X, Y, WIDTH, HEIGHT, TXTR_INDEX) \
 	{ GM_BGND, 0, GM_PNG, GM_SRC_MEM, 0, { .data = NULL }, { .bgnd = { (NAME), (X), (Y), (WIDTH), (HEIGHT), (TXTR_INDEX) } } }
 
+// Sprites and backgrounds given as PNG images are pasted into the texture
+// page the game archive keeps them in, see gm_composite_patches().
+#define GM_PATCH_SPRT_FRAME_PNG(NAME, FRAME, DATA, SIZE) \
+	{ GM_SPRT, (FRAME), GM_PNG, GM_SRC_MEM, (SIZE), { .data = (DATA) }, { .sprt = { (NAME), 0, 0, 0, 0, 0 } } }
+
+#define GM_PATCH_SPRT_PNG(NAME, DATA, SIZE) \
+	GM_PATCH_SPRT_FRAME_PNG(NAME, 0, DATA, SIZE)
+
+#define GM_PATCH_BGND_PNG(NAME, DATA, SIZE) \
+	{ GM_BGND, 0, GM_PNG, GM_SRC_MEM, (SIZE), { .data = (DATA) }, { .bgnd = { (NAME), 0, 0, 0, 0, 0 } } }
+
 #define GM_PATCH_TXTR(INDEX, DATA, SIZE, WIDTH, HEIGHT) \
 	{ GM_TXTR, (INDEX), GM_PNG, GM_SRC_MEM, (SIZE), { .data = (DATA) }, { .txtr = { (WIDTH), (HEIGHT) } } }
 
@@ -110,87 +130,255 @@ struct gm_patch {
 #define GM_PATCH_END \
 	{ GM_END, 0, GM_UNKNOWN, GM_SRC_MEM, 0, { .data = NULL }, { .txtr = { 0, 0 } } }
 
-struct gm_entry {
-	off_t            offset;
-	size_t           size;
-	enum gm_filetype type;
+// Per entry metadata of the sections that have any, one array per section.
+struct gm_txtr_meta {
+	uint32_t width;
+	uint32_t height;
+};
 
-	union {
-		struct {
-			size_t width;
-			size_t height;
-		} txtr;
+struct gm_sprt_meta {
+	const char *name;        // usually points into the archive, see gm_detach_index()
+	uint32_t    first_frame; // in the frames of the section
+	uint32_t    frame_count;
+};
 
-		struct {
-			char *name;
-			size_t x;
-			size_t y;
-			size_t width;
-			size_t height;
-			size_t txtr_index;
-		} sprt;
+struct gm_bgnd_meta {
+	const char *name;
+	uint32_t    tpag_index;
+};
 
-		struct {
-			char *name;
-			size_t x;
-			size_t y;
-			size_t width;
-			size_t height;
-			size_t txtr_index;
-		} bgnd;
-	} meta;
+// Texture page items (TPAG section), one array per record field. Sprites
+// and backgrounds refer to rows by index. The columns are allocated as one
+// block, in record order starting with x.
+struct gm_tpag_table {
+	size_t    count;
+	uint32_t *offsets;         // of the records in the archive
+	uint16_t *x;               // region on the texture page
+	uint16_t *y;
+	uint16_t *width;
+	uint16_t *height;
+	uint16_t *target_x;        // where the region is drawn within the image
+	uint16_t *target_y;
+	uint16_t *target_width;
+	uint16_t *target_height;
+	uint16_t *bounding_width;  // size of the whole image
+	uint16_t *bounding_height;
+	uint16_t *txtr_index;
+	bool      sorted;          // offsets are ascending
 };
 
+#define GM_TPAG_COLUMNS 11
+
 struct gm_index {
 	enum gm_section section;
 
 	off_t  offset;
 	size_t size;
 
-	size_t entry_count;
-	struct gm_entry *entries;
+	size_t    entry_count;
+	uint32_t *offsets; // TXTR/AUDO: where the data of each entry starts, NULL otherwise
+	uint32_t *sizes;
+	uint8_t  *types;   // enum gm_filetype
+	bool      loaded;  // entries are parsed, see gm_load_section()
+
+	union {
+		struct gm_txtr_meta *txtr;
+		struct gm_sprt_meta *sprt;
+		struct gm_bgnd_meta *bgnd;
+	} meta; // NULL for sections without metadata (AUDO)
+
+	const size_t *names;      // SPRT/BGND: hash table of entry index + 1 by name
+	size_t        name_slots; // power of two
+
+	// TPAG: the parsed records (entry_count is 0), SPRT/BGND: the table
+	// that tpag_index refers to
+	struct gm_tpag_table *tpag;
+
+	size_t    frame_count; // SPRT: TPAG row of every frame of every sprite
+	uint32_t *frames;
+
+	struct gm_arena *arena; // owns the index, shared by all of its sections
 };
 
-struct gm_patched_entry {
-	off_t  offset;
-	size_t size;
+enum gm_archive_flags {
+	GM_ARCHIVE_POPULATE   = 1 << 0,
+	GM_ARCHIVE_LAZY       = 1 << 1, // gm_read_archive_index() only reads section headers
+	GM_ARCHIVE_VERIFY_PNG = 1 << 2, // walk all PNG chunks to get TXTR entry sizes
+	GM_ARCHIVE_SERIAL     = 1 << 3  // parse sections on the calling thread only
+};
+
+struct gm_archive {
+	const uint8_t *data;
+	size_t         size;
+	int            flags;
+
+	struct gm_io_policy policy;
+
+	// private:
+	FILE *fp;
+	bool  owns_fp;
+#if defined(GM_WINDOWS)
+	void *mapping;
+#endif
+};
 
-	const struct gm_patch *patch;
-	const struct gm_entry *entry;
+enum gm_patch_strategy {
+	GM_PATCH_STRATEGY_SHIFT = 0,
+	GM_PATCH_STRATEGY_APPEND,
+	GM_PATCH_STRATEGY_COMPACT
 };
 
+// Everything that starts at or behind offset in the original archive moves
+// by delta. shift is the sum of the deltas up to and including this one.
+struct gm_offset_delta {
+	off_t offset;
+	off_t delta;
+	off_t shift;
+};
+
+// How patching changes the layout, see gm_build_patched_index().
+struct gm_patch_plan {
+	size_t delta_count;
+	struct gm_offset_delta *deltas; // sorted by offset
+};
+
+// Offsets and sizes of the patched archive are 64-bit, so a patch that
+// outgrows the 32-bit format is only rejected when it's written, see
+// gm_write_patched_archive().
 struct gm_patched_index {
 	enum gm_section section;
 
-	off_t  offset;
-	size_t size;
+	off_t offset;
+	off_t size;
 
-	size_t entry_count;
-	struct gm_patched_entry *entries;
+	// TXTR/AUDO: new location of every entry of index, 0 entries otherwise
+	size_t  entry_count;
+	off_t  *offsets;
+	off_t  *sizes;
+	const struct gm_patch **patches; // NULL for entries that aren't replaced
 
 	const struct gm_index *index;
+	enum gm_patch_strategy strategy;
+
+	struct gm_arena *arena; // owns the patched index
+	const struct gm_patch_plan *plan; // shared by all sections
+};
+
+enum gm_patch_mode {
+	GM_PATCH_MODE_COPY = 0,
+	GM_PATCH_MODE_IN_PLACE,
+	GM_PATCH_MODE_STREAM,
+	GM_PATCH_MODE_PLAN   // only print the patch plan, see gm_print_patch_plan()
+};
+
+struct gm_patch_options {
+	enum gm_patch_mode     mode;
+	enum gm_patch_strategy strategy;
+	int                    fd;      // output for GM_PATCH_MODE_STREAM and GM_PATCH_MODE_PLAN
+	size_t                 threads; // for compositing and writing with GM_PATCH_MODE_COPY, 0 = one per CPU
+
+	const struct gm_io_policy *io;  // NULL = default policy
+};
+
+#define GM_PATCH_OPTIONS_INIT { GM_PATCH_MODE_COPY, GM_PATCH_STRATEGY_SHIFT, -1, 0, NULL }
+
+// command line options parsed by gm_parse_patch_option()
+#define GM_PATCH_OPTIONS_USAGE "[--in-place|--stdout|--plan] [--append|--compact] [--threads=N]"
+
+struct gm_extent {
+	off_t  src_offset;
+	off_t  dst_offset;
+	size_t size;
+};
+
+struct gm_copy_plan {
+	size_t extent_count;
+	size_t capacity;
+	struct gm_extent *extents;
+};
+
+// Texture pages re-encoded by gm_composite_patches().
+struct gm_composite {
+	struct gm_patch *patches; // the given patches plus one GM_TXTR patch per page, NULL if none
+	uint8_t        **pages;   // PNG data referenced by those patches
+	size_t           page_count;
+};
+
+// Outcome of gm_optimize_textures() for one texture.
+struct gm_txtr_optimization {
+	size_t   old_size;
+	size_t   new_size; // old_size if the texture is kept
+	uint8_t *data;     // the smaller PNG, NULL if the texture is kept
+	uint32_t width;
+	uint32_t height;
+};
+
+struct gm_optimized {
+	struct gm_patch *patches; // GM_TXTR patches for the textures that got smaller
+	struct gm_txtr_optimization *pages; // one per TXTR entry
+	size_t           page_count;
 };
 
 struct gm_patched_index *gm_get_section(struct gm_patched_index *patched, enum gm_section section);
 size_t                   gm_index_length(const struct gm_index *index);
-int                      gm_patch_archive(const char *filename, const struct gm_patch *patches);
-int                      gm_patch_archive_from_dir(const char *filename, const char *dirname);
+int                      gm_parse_patch_option(const char *arg, struct gm_patch_options *options);
+int                      gm_patch_archive(const char *filename, const struct gm_patch *patches, const struct gm_patch_options *options);
+int                      gm_patch_archive_to(const char *infile, const char *outfile, const struct gm_patch *patches, const struct gm_patch_options *options);
+int                      gm_patch_archive_from_dir(const char *filename, const char *dirname, const struct gm_patch_options *options);
+int                      gm_read_patch_files(struct gm_patch *patches, size_t threads);
+struct gm_patched_index *gm_build_patched_index(const struct gm_index *index, const struct gm_patch *patches, enum gm_patch_strategy strategy);
 int                      gm_patch_entry(struct gm_patched_index *index, const struct gm_patch *patch);
-int                      gm_shift_tail(struct gm_patched_index *index, off_t offset);
+bool                     gm_patch_has_pixels(const struct gm_patch *patch);
+int                      gm_composite_patches(const struct gm_archive *archive, struct gm_index *index, const struct gm_patch *patches, size_t threads, struct gm_composite *composite);
+void                     gm_free_composite(struct gm_composite *composite);
+int                      gm_optimize_textures(const struct gm_archive *archive, struct gm_index *index, bool reduce, size_t threads, struct gm_optimized *optimized);
+void                     gm_free_optimized(struct gm_optimized *optimized);
+off_t                    gm_patch_plan_shift(const struct gm_patch_plan *plan, off_t offset);
+int                      gm_print_patch_plan(const struct gm_patched_index *patched, FILE *out);
+int                      gm_copy_plan_add(struct gm_copy_plan *plan, off_t src_offset, off_t dst_offset, size_t size);
+void                     gm_merge_copy_plan(struct gm_copy_plan *plan);
+int                      gm_build_copy_plan(const struct gm_patched_index *patched, struct gm_copy_plan *plan);
+int                      gm_execute_copy_plan(const struct gm_copy_plan *plan, int srcfd, int dstfd, const struct gm_io_policy *policy);
+int                      gm_execute_move_plan(const struct gm_copy_plan *plan, int fd, const struct gm_io_policy *policy);
+int                      gm_write_patched_archive(const struct gm_archive *archive, const struct gm_patched_index *patched, int fd);
+int                      gm_write_patched_archive_parallel(const struct gm_archive *archive, const struct gm_patched_index *patched, int fd, size_t threads);
+void                     gm_free_copy_plan(struct gm_copy_plan *plan);
 void                     gm_free_patched_index(struct gm_patched_index *index);
 const char              *gm_section_name(enum gm_section section);
 const char              *gm_extension(enum gm_filetype type);
 const char              *gm_typename(enum gm_filetype type);
 enum gm_section          gm_parse_section(const uint8_t *magic);
-int                      gm_read_index_sprt(FILE *game, struct gm_index *section);
-int                      gm_read_index_bgnd(FILE *game, struct gm_index *section);
-int                      gm_read_index_txtr(FILE *game, struct gm_index *section);
-int                      gm_read_index_audo(FILE *game, struct gm_index *section);
-struct gm_index         *gm_read_index(FILE *game);
+struct gm_archive       *gm_open_archive(const char *filename, int flags, const struct gm_io_policy *policy);
+struct gm_archive       *gm_map_archive(FILE *game, int flags, const struct gm_io_policy *policy);
+void                     gm_close_archive(struct gm_archive *archive);
+int                      gm_read_index_sprt(const struct gm_archive *archive, struct gm_index *section, struct gm_arena *arena);
+int                      gm_read_index_bgnd(const struct gm_archive *archive, struct gm_index *section, struct gm_arena *arena);
+int                      gm_read_index_txtr(const struct gm_archive *archive, struct gm_index *section, struct gm_arena *arena);
+int                      gm_read_index_tpag(const struct gm_archive *archive, struct gm_index *section, struct gm_arena *arena);
+struct gm_tpag_table    *gm_new_tpag_table(size_t count, struct gm_arena *arena);
+int                      gm_alloc_entries(struct gm_index *section, size_t count, struct gm_arena *arena);
+int                      gm_read_index_audo(const struct gm_archive *archive, struct gm_index *section, struct gm_arena *arena);
+struct gm_index         *gm_read_archive_index(const struct gm_archive *archive);
+struct gm_index         *gm_find_section(struct gm_index *index, enum gm_section section);
+int                      gm_load_section(const struct gm_archive *archive, struct gm_index *section);
+int                      gm_load_sections(const struct gm_archive *archive, struct gm_index *index, const enum gm_section *sections);
+int                      gm_build_name_table(struct gm_index *section, struct gm_arena *arena);
+const struct gm_sprt_meta *gm_find_sprite(const struct gm_index *index, const char *name);
+const struct gm_bgnd_meta *gm_find_background(const struct gm_index *index, const char *name);
+int                      gm_decode_txtr(const struct gm_archive *archive, const struct gm_index *section, size_t index, struct png_image *image);
+int                      gm_detach_index(struct gm_index *index, const struct gm_archive *archive);
+struct gm_index         *gm_read_index(FILE *game, const struct gm_io_policy *policy);
+struct gm_index         *gm_read_archive_index_cached(const struct gm_archive *archive, const char *filename);
+struct gm_index         *gm_load_index_cache(const struct gm_archive *archive, const char *filename);
+int                      gm_save_index_cache(const struct gm_index *index, const struct gm_archive *archive, const char *filename);
+int                      gm_save_patched_index_cache(const struct gm_patched_index *patched, const char *filename);
+void                     gm_remove_index_cache(const char *filename);
+int                      gm_index_cache_name(char *buf, size_t size, const char *filename);
 void                     gm_free_index(struct gm_index *index);
-size_t                   gm_form_size(const struct gm_patched_index *index);
+off_t                    gm_form_size(const struct gm_patched_index *index);
 int                      gm_write_hdr(FILE *fp, const uint8_t *magic, size_t size);
-int                      gm_dump_files(const struct gm_index *index, FILE *game, const char *outdir);
+int                      gm_dump_archive_files(struct gm_index *index, const struct gm_archive *archive, const char *outdir);
+int                      gm_dump_files(struct gm_index *index, FILE *game, const char *outdir, const struct gm_io_policy *policy);
 int                      gm_concat(char *buf, size_t size, const char *strs[], size_t nstrs);
 int                      gm_join_path(char *buf, size_t size, const char *comps[], size_t ncomps);
 
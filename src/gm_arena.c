@@ -0,0 +1,143 @@
+#include "gm_arena.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdalign.h>
+
+#define GM_ARENA_ALIGN alignof(max_align_t)
+#define GM_ARENA_ROUND(SIZE) (((SIZE) + GM_ARENA_ALIGN - 1) & ~(GM_ARENA_ALIGN - 1))
+
+struct gm_arena_block {
+	struct gm_arena_block *next;
+	size_t size;
+	size_t used;
+	alignas(max_align_t) uint8_t data[];
+};
+
+static struct gm_arena_block *gm_arena_block_new(size_t size) {
+	if (size > SIZE_MAX - sizeof(struct gm_arena_block)) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	// calloc, so every allocation is zeroed already
+	struct gm_arena_block *block = calloc(1, sizeof(struct gm_arena_block) + size);
+	if (!block) {
+		return NULL;
+	}
+
+	block->size = size;
+
+	return block;
+}
+
+// The arena itself lives in its first block, which stays at the end of the
+// block list.
+struct gm_arena *gm_arena_create(size_t block_size) {
+	if (block_size == 0) {
+		block_size = GM_ARENA_BLOCK_SIZE;
+	}
+
+	const size_t header = GM_ARENA_ROUND(sizeof(struct gm_arena));
+	if (block_size < header * 2) {
+		block_size = header * 2;
+	}
+
+	struct gm_arena_block *block = gm_arena_block_new(block_size);
+	if (!block) {
+		return NULL;
+	}
+
+	struct gm_arena *arena = (struct gm_arena*)block->data;
+	block->used = header;
+	arena->head = block;
+	arena->block_size = block_size;
+
+	return arena;
+}
+
+void gm_arena_destroy(struct gm_arena *arena) {
+	if (arena) {
+		struct gm_arena_block *block = arena->head;
+		while (block) {
+			struct gm_arena_block *next = block->next;
+			free(block);
+			block = next;
+		}
+	}
+}
+
+void *gm_arena_alloc(struct gm_arena *arena, size_t size) {
+	if (size > SIZE_MAX - GM_ARENA_ALIGN) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	size = GM_ARENA_ROUND(size);
+
+	// only the newest block is filled, the older ones are considered full
+	struct gm_arena_block *block = arena->head;
+	if (block->size - block->used >= size) {
+		void *ptr = block->data + block->used;
+		block->used += size;
+		return ptr;
+	}
+
+	if (size > arena->block_size / 4) {
+		// big allocations get a block of their own, behind the current one
+		struct gm_arena_block *big = gm_arena_block_new(size);
+		if (!big) {
+			return NULL;
+		}
+		big->used = size;
+		big->next = block->next;
+		block->next = big;
+		return big->data;
+	}
+
+	block = gm_arena_block_new(arena->block_size);
+	if (!block) {
+		return NULL;
+	}
+	block->used = size;
+	block->next = arena->head;
+	arena->head = block;
+
+	return block->data;
+}
+
+void *gm_arena_calloc(struct gm_arena *arena, size_t count, size_t size) {
+	if (size != 0 && count > SIZE_MAX / size) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	return gm_arena_alloc(arena, count * size);
+}
+
+char *gm_arena_strndup(struct gm_arena *arena, const char *str, size_t length) {
+	if (length == SIZE_MAX) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	char *copy = gm_arena_alloc(arena, length + 1);
+	if (copy) {
+		memcpy(copy, str, length);
+	}
+
+	return copy;
+}
+
+// Moves all memory of other into arena. other is gone afterwards.
+void gm_arena_adopt(struct gm_arena *arena, struct gm_arena *other) {
+	struct gm_arena_block *last = other->head;
+	while (last->next) {
+		last = last->next;
+	}
+
+	// keep the current head so the free space in it is still used
+	last->next = arena->head->next;
+	arena->head->next = other->head;
+}
@@ -0,0 +1,35 @@
+#ifndef GM_ARENA_H
+#define GM_ARENA_H
+#pragma once
+
+#include <stddef.h>
+#include <inttypes.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define GM_ARENA_BLOCK_SIZE (64 * 1024)
+
+struct gm_arena_block;
+
+// Memory that is only ever freed all at once. Allocations are zeroed.
+// An arena must not be used by several threads at the same time, give each
+// thread its own and gm_arena_adopt() them afterwards.
+struct gm_arena {
+	struct gm_arena_block *head;
+	size_t block_size;
+};
+
+struct gm_arena *gm_arena_create(size_t block_size);
+void             gm_arena_destroy(struct gm_arena *arena);
+void            *gm_arena_alloc(struct gm_arena *arena, size_t size);
+void            *gm_arena_calloc(struct gm_arena *arena, size_t count, size_t size);
+char            *gm_arena_strndup(struct gm_arena *arena, const char *str, size_t length);
+void             gm_arena_adopt(struct gm_arena *arena, struct gm_arena *other);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,522 @@
+#include "game_maker.h"
+#include "png_decode.h"
+#include "png_encode.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include <zlib.h>
+
+#define LOG_ERR(FMT, ...) fprintf(stderr, "*** ERROR: " FMT "\n", ## __VA_ARGS__)
+#define LOG_ERR_MSG(MSG)  fprintf(stderr, "*** ERROR: " MSG "\n")
+
+// Texture atlas compositor
+//
+// Sprite and background patches that carry a PNG (GM_PATCH_SPRT_PNG() etc.)
+// are pasted into the texture pages of the archive they are applied to, at
+// the place the archive's TPAG record says. Each affected page is decoded,
+// gets all of its sprites copied in row by row and is encoded again. Pages
+// are independent of each other, so they are processed in parallel, and
+// with fewer pages than threads each page is encoded in parallel, too.
+
+struct gm_atlas_item {
+	size_t   patch;      // in the patches passed to gm_composite_patches()
+	size_t   txtr_index;
+	uint32_t x;
+	uint32_t y;
+	uint32_t width;
+	uint32_t height;
+};
+
+struct gm_atlas_page {
+	size_t   txtr_index;
+	size_t   first_item;
+	size_t   item_count;
+	uint8_t *data;
+	size_t   size;
+	uint32_t width;
+	uint32_t height;
+};
+
+struct gm_atlas_phase {
+	const struct gm_archive    *archive;
+	const struct gm_index      *txtr;
+	const struct gm_patch      *patches;
+	const struct gm_atlas_item *items;
+	struct gm_atlas_page       *pages;
+	size_t                      page_count;
+	size_t                      encode_threads; // per page
+
+	atomic_size_t next;
+	atomic_int    errnum;
+};
+
+bool gm_patch_has_pixels(const struct gm_patch *patch) {
+	return (patch->section == GM_SPRT || patch->section == GM_BGND) &&
+	       (patch->patch_src == GM_SRC_FILE || patch->src.data != NULL);
+}
+
+static const char *gm_pixel_patch_name(const struct gm_patch *patch) {
+	return patch->section == GM_SPRT ? patch->meta.sprt.name : patch->meta.bgnd.name;
+}
+
+static void gm_log_pixel_patch_error(const struct gm_patch *patch, const char *msg) {
+	if (patch->section == GM_SPRT) {
+		LOG_ERR("sprite %s, frame %" PRIuPTR ": %s", patch->meta.sprt.name, patch->index, msg);
+	}
+	else {
+		LOG_ERR("background %s: %s", patch->meta.bgnd.name, msg);
+	}
+}
+
+static int gm_atlas_item_cmp(const void *lhs, const void *rhs) {
+	const struct gm_atlas_item *a = lhs;
+	const struct gm_atlas_item *b = rhs;
+
+	if (a->txtr_index != b->txtr_index) {
+		return a->txtr_index < b->txtr_index ? -1 : 1;
+	}
+
+	// later patches are pasted over earlier ones
+	return a->patch < b->patch ? -1 : a->patch > b->patch ? 1 : 0;
+}
+
+// Finds the place of a pixel patch on its texture page.
+static int gm_resolve_pixel_patch(struct gm_index *index, const struct gm_index *txtr,
+                                  const struct gm_patch *patch, struct gm_atlas_item *item) {
+	const struct gm_index *section = gm_find_section(index, patch->section);
+	const char *name = gm_pixel_patch_name(patch);
+	size_t row = 0;
+
+	if (patch->section == GM_SPRT) {
+		const struct gm_sprt_meta *sprite = section ? gm_find_sprite(index, name) : NULL;
+		if (!sprite) {
+			LOG_ERR("can't find sprite %s in game archive", name);
+
+			errno = EINVAL;
+			return -1;
+		}
+
+		if (patch->index >= sprite->frame_count) {
+			LOG_ERR("sprite %s has no frame %" PRIuPTR " (%" PRIu32 " frames)",
+				name, patch->index, sprite->frame_count);
+
+			errno = EINVAL;
+			return -1;
+		}
+
+		row = section->frames[sprite->first_frame + patch->index];
+	}
+	else {
+		const struct gm_bgnd_meta *background = section ? gm_find_background(index, name) : NULL;
+		if (!background) {
+			LOG_ERR("can't find background %s in game archive", name);
+
+			errno = EINVAL;
+			return -1;
+		}
+
+		row = background->tpag_index;
+	}
+
+	const struct gm_tpag_table *tpag = section->tpag;
+	item->txtr_index = tpag->txtr_index[row];
+	item->x          = tpag->x[row];
+	item->y          = tpag->y[row];
+	item->width      = tpag->width[row];
+	item->height     = tpag->height[row];
+
+	if (item->txtr_index >= txtr->entry_count) {
+		LOG_ERR("%s %s refers to texture %" PRIuPTR ", but there are only %" PRIuPTR " textures",
+			patch->section == GM_SPRT ? "sprite" : "background", name, item->txtr_index, txtr->entry_count);
+
+		errno = EINVAL;
+		return -1;
+	}
+
+	const struct gm_txtr_meta *page = &txtr->meta.txtr[item->txtr_index];
+	if ((uint64_t)item->x + item->width  > page->width ||
+	    (uint64_t)item->y + item->height > page->height) {
+		LOG_ERR("%s %s (x=%" PRIu32 " y=%" PRIu32 " width=%" PRIu32 " height=%" PRIu32
+		        ") lies outside of texture %" PRIuPTR " (%" PRIu32 "x%" PRIu32 ")",
+			patch->section == GM_SPRT ? "sprite" : "background", name,
+			item->x, item->y, item->width, item->height,
+			item->txtr_index, page->width, page->height);
+
+		errno = EINVAL;
+		return -1;
+	}
+
+	return 0;
+}
+
+static int gm_read_whole_file(const char *filename, uint8_t **data, size_t *size) {
+	struct stat st;
+	uint8_t *buf = NULL;
+	int status = 0;
+
+#if defined(GM_WINDOWS)
+	int fd = open(filename, O_RDONLY | O_BINARY);
+#else
+	int fd = open(filename, O_RDONLY);
+#endif
+	if (fd < 0) {
+		goto error;
+	}
+
+	if (fstat(fd, &st) != 0) {
+		goto error;
+	}
+
+	if ((uintmax_t)st.st_size > SIZE_MAX) {
+		errno = EFBIG;
+		goto error;
+	}
+
+	buf = malloc(st.st_size > 0 ? (size_t)st.st_size : 1);
+	if (!buf) {
+		goto error;
+	}
+
+	if (gm_pread_all(fd, buf, (size_t)st.st_size, 0) != 0) {
+		goto error;
+	}
+
+	*data = buf;
+	*size = (size_t)st.st_size;
+	buf = NULL;
+
+	goto end;
+
+error:
+	status = -1;
+
+end:
+	{
+		int errnum = errno;
+		free(buf);
+		if (fd >= 0) {
+			close(fd);
+		}
+		errno = errnum;
+	}
+
+	return status;
+}
+
+// Decodes the PNG of a pixel patch and copies it into the page.
+static int gm_blit_pixel_patch(const struct gm_patch *patch, const struct gm_atlas_item *item, struct png_image *page) {
+	struct png_image sprite = { 0, 0, NULL };
+	uint8_t *filedata = NULL;
+	const uint8_t *data = patch->src.data;
+	size_t size = patch->size;
+	int status = 0;
+
+	if (patch->patch_src == GM_SRC_FILE) {
+		if (gm_read_whole_file(patch->src.filename, &filedata, &size) != 0) {
+			int errnum = errno;
+			LOG_ERR("%s: %s", patch->src.filename, strerror(errnum));
+			errno = errnum;
+			goto error;
+		}
+		data = filedata;
+	}
+
+	if (decode_png_mem(data, size, &sprite) != 0) {
+		int errnum = errno;
+		gm_log_pixel_patch_error(patch, strerror(errnum));
+		errno = errnum;
+		goto error;
+	}
+
+	if (sprite.width != item->width || sprite.height != item->height) {
+		char msg[128];
+		snprintf(msg, sizeof(msg), "image is %" PRIu32 "x%" PRIu32 ", but the game archive has room for %" PRIu32 "x%" PRIu32,
+		         sprite.width, sprite.height, item->width, item->height);
+		gm_log_pixel_patch_error(patch, msg);
+
+		errno = EINVAL;
+		goto error;
+	}
+
+	// rows are contiguous on both sides, so this is one memcpy() per row
+	const size_t stride      = (size_t)page->width * 4;
+	const size_t row_size    = (size_t)item->width * 4;
+	const uint8_t *src       = sprite.pixels;
+	uint8_t *dst             = page->pixels + (size_t)item->y * stride + (size_t)item->x * 4;
+	for (uint32_t y = 0; y < item->height; ++ y) {
+		memcpy(dst, src, row_size);
+		src += row_size;
+		dst += stride;
+	}
+
+	goto end;
+
+error:
+	status = -1;
+
+end:
+	{
+		int errnum = errno;
+		free_png_image(&sprite);
+		free(filedata);
+		errno = errnum;
+	}
+
+	return status;
+}
+
+static int gm_composite_page(const struct gm_atlas_phase *phase, struct gm_atlas_page *page) {
+	struct png_image image = { 0, 0, NULL };
+	int status = 0;
+
+	if (gm_decode_txtr(phase->archive, phase->txtr, page->txtr_index, &image) != 0) {
+		goto error;
+	}
+
+	for (size_t i = 0; i < page->item_count; ++ i) {
+		const struct gm_atlas_item *item = &phase->items[page->first_item + i];
+		if (gm_blit_pixel_patch(&phase->patches[item->patch], item, &image) != 0) {
+			goto error;
+		}
+	}
+
+	if (encode_png_mem(&image, Z_DEFAULT_COMPRESSION, phase->encode_threads, &page->data, &page->size) != 0) {
+		int errnum = errno;
+		LOG_ERR("texture %" PRIuPTR ": error encoding PNG: %s", page->txtr_index, strerror(errnum));
+		errno = errnum;
+		goto error;
+	}
+
+	page->width  = image.width;
+	page->height = image.height;
+
+	goto end;
+
+error:
+	status = -1;
+
+end:
+	{
+		int errnum = errno;
+		free_png_image(&image);
+		errno = errnum;
+	}
+
+	return status;
+}
+
+static void *gm_atlas_worker(void *arg) {
+	struct gm_atlas_phase *phase = arg;
+
+	while (atomic_load(&phase->errnum) == 0) {
+		size_t index = atomic_fetch_add(&phase->next, 1);
+		if (index >= phase->page_count) {
+			break;
+		}
+
+		if (gm_composite_page(phase, &phase->pages[index]) != 0) {
+			int expected = 0;
+			atomic_compare_exchange_strong(&phase->errnum, &expected, errno ? errno : EINVAL);
+		}
+	}
+
+	return NULL;
+}
+
+// Pastes all pixel patches (see gm_patch_has_pixels()) into their texture
+// pages. The SPRT, BGND and TXTR sections of index need to be loaded. On
+// success composite->patches is a copy of patches with a GM_TXTR patch for
+// every changed page appended, or NULL if there is nothing to composite.
+// Pages are re-encoded by up to threads threads, 0 = one per CPU.
+int gm_composite_patches(const struct gm_archive *archive, struct gm_index *index,
+                         const struct gm_patch *patches, size_t threads,
+                         struct gm_composite *composite) {
+	struct gm_atlas_phase phase;
+	struct gm_atlas_item *items = NULL;
+	struct gm_atlas_page *pages = NULL;
+	struct gm_patch *result     = NULL;
+	size_t patch_count = 0;
+	size_t item_count  = 0;
+	size_t page_count  = 0;
+	int status = 0;
+
+	memset(composite, 0, sizeof(*composite));
+	memset(&phase, 0, sizeof(phase));
+
+	for (; patches[patch_count].section != GM_END; ++ patch_count) {
+		if (gm_patch_has_pixels(&patches[patch_count])) {
+			++ item_count;
+		}
+	}
+
+	if (item_count == 0) {
+		return 0;
+	}
+
+	const struct gm_index *txtr = gm_find_section(index, GM_TXTR);
+	if (!txtr || !txtr->loaded) {
+		LOG_ERR_MSG("game archive has no texture section");
+
+		errno = EINVAL;
+		goto error;
+	}
+
+	items = calloc(item_count, sizeof(struct gm_atlas_item));
+	if (!items) {
+		goto error;
+	}
+
+	for (size_t i = 0, item = 0; i < patch_count; ++ i) {
+		if (gm_patch_has_pixels(&patches[i])) {
+			items[item].patch = i;
+			if (gm_resolve_pixel_patch(index, txtr, &patches[i], &items[item]) != 0) {
+				goto error;
+			}
+			++ item;
+		}
+	}
+
+	qsort(items, item_count, sizeof(struct gm_atlas_item), gm_atlas_item_cmp);
+
+	for (size_t i = 0; i < item_count; ++ i) {
+		if (i == 0 || items[i].txtr_index != items[i - 1].txtr_index) {
+			++ page_count;
+		}
+	}
+
+	// a page is either replaced as a whole or composited, not both
+	for (size_t i = 0; i < patch_count; ++ i) {
+		if (patches[i].section != GM_TXTR) {
+			continue;
+		}
+		for (size_t j = 0; j < item_count; ++ j) {
+			if (items[j].txtr_index == patches[i].index) {
+				LOG_ERR("texture %" PRIuPTR " is replaced, but also has sprites patched into it", patches[i].index);
+
+				errno = EINVAL;
+				goto error;
+			}
+		}
+	}
+
+	pages = calloc(page_count, sizeof(struct gm_atlas_page));
+	if (!pages) {
+		goto error;
+	}
+
+	for (size_t i = 0, page = 0; i < item_count; ++ i) {
+		if (i > 0 && items[i].txtr_index != items[i - 1].txtr_index) {
+			++ page;
+		}
+		if (pages[page].item_count == 0) {
+			pages[page].txtr_index = items[i].txtr_index;
+			pages[page].first_item = i;
+		}
+		++ pages[page].item_count;
+	}
+
+	phase.archive    = archive;
+	phase.txtr       = txtr;
+	phase.patches    = patches;
+	phase.items      = items;
+	phase.pages      = pages;
+	phase.page_count = page_count;
+
+	if (threads == 0) {
+		threads = gm_cpu_count();
+	}
+
+	// threads that don't get a page of their own help encoding
+	phase.encode_threads = threads > page_count ? threads / page_count : 1;
+
+	if (threads > page_count) {
+		threads = page_count;
+	}
+
+	atomic_init(&phase.next, 0);
+	atomic_init(&phase.errnum, 0);
+
+	gm_run_workers(gm_atlas_worker, &phase, threads);
+
+	int errnum = atomic_load(&phase.errnum);
+	if (errnum != 0) {
+		errno = errnum;
+		goto error;
+	}
+
+	result = calloc(patch_count + page_count + 1, sizeof(struct gm_patch));
+	if (!result) {
+		goto error;
+	}
+
+	memcpy(result, patches, patch_count * sizeof(struct gm_patch));
+	for (size_t i = 0; i < page_count; ++ i) {
+		struct gm_patch *patch = &result[patch_count + i];
+		patch->section         = GM_TXTR;
+		patch->index           = pages[i].txtr_index;
+		patch->type            = GM_PNG;
+		patch->patch_src       = GM_SRC_MEM;
+		patch->size            = pages[i].size;
+		patch->src.data        = pages[i].data;
+		patch->meta.txtr.width  = pages[i].width;
+		patch->meta.txtr.height = pages[i].height;
+	}
+	result[patch_count + page_count].section = GM_END;
+
+	composite->patches    = result;
+	composite->page_count = page_count;
+	composite->pages      = calloc(page_count, sizeof(uint8_t*));
+	if (!composite->pages) {
+		composite->patches = NULL;
+		goto error;
+	}
+
+	for (size_t i = 0; i < page_count; ++ i) {
+		composite->pages[i] = pages[i].data;
+		pages[i].data = NULL;
+	}
+	result = NULL;
+
+	goto end;
+
+error:
+	status = -1;
+
+end:
+	{
+		int errnum = errno;
+		if (pages) {
+			for (size_t i = 0; i < page_count; ++ i) {
+				free(pages[i].data);
+			}
+		}
+		free(pages);
+		free(items);
+		free(result);
+		errno = errnum;
+	}
+
+	return status;
+}
+
+void gm_free_composite(struct gm_composite *composite) {
+	if (composite->pages) {
+		for (size_t i = 0; i < composite->page_count; ++ i) {
+			free(composite->pages[i]);
+		}
+	}
+	free(composite->pages);
+	free(composite->patches);
+
+	composite->pages      = NULL;
+	composite->patches    = NULL;
+	composite->page_count = 0;
+}
@@ -0,0 +1,826 @@
+#include "game_maker.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <stdint.h>
+
+// Index cache file (<archive>.gmidx)
+//
+// All fields are little-endian and naturally aligned, so the file can be
+// used as it is read (or mapped):
+//
+//     header   56 bytes
+//     sections 32 bytes each
+//     entries  48 bytes each, all sections back to back
+//              (none for sections that weren't parsed, TPAG records
+//              are stored as entries too)
+//     frames   TPAG row of each sprite frame, 4 bytes each
+//     strings  NUL-terminated sprite/background names
+//
+// The cache is only used when the archive size, modification time and a
+// hash over all section headers match the ones stored in the header.
+
+#define GM_CACHE_MAGIC        "GMIX"
+#define GM_CACHE_VERSION      4
+#define GM_CACHE_HDR_SIZE     56
+#define GM_CACHE_SECTION_SIZE 32
+#define GM_CACHE_ENTRY_SIZE   48
+#define GM_CACHE_MAX_SIZE     (64 * 1024 * 1024)
+
+#define U32LE_FROM_BUF(BUF) ( \
+	 (uint32_t)((BUF)[0])        | \
+	((uint32_t)((BUF)[1]) <<  8) | \
+	((uint32_t)((BUF)[2]) << 16) | \
+	((uint32_t)((BUF)[3]) << 24))
+
+#define U64LE_FROM_BUF(BUF) ( \
+	(uint64_t)U32LE_FROM_BUF(BUF) | ((uint64_t)U32LE_FROM_BUF((BUF) + 4) << 32))
+
+#define WRITE_U32LE(BUF,N) { \
+	(BUF)[0] =  (uint32_t)(N)        & 0xFF; \
+	(BUF)[1] = ((uint32_t)(N) >>  8) & 0xFF; \
+	(BUF)[2] = ((uint32_t)(N) >> 16) & 0xFF; \
+	(BUF)[3] = ((uint32_t)(N) >> 24) & 0xFF; \
+}
+
+#define U16LE_FROM_BUF(BUF) ( \
+	 (uint32_t)((BUF)[0]) | \
+	((uint32_t)((BUF)[1]) << 8))
+
+#define WRITE_U16LE(BUF,N) { \
+	(BUF)[0] =  (uint32_t)(N)       & 0xFF; \
+	(BUF)[1] = ((uint32_t)(N) >> 8) & 0xFF; \
+}
+
+#define WRITE_U64LE(BUF,N) { \
+	WRITE_U32LE((BUF),     (uint64_t)(N) & 0xFFFFFFFF); \
+	WRITE_U32LE((BUF) + 4, (uint64_t)(N) >> 32); \
+}
+
+#define GM_FNV_OFFSET UINT64_C(0xcbf29ce484222325)
+#define GM_FNV_PRIME  UINT64_C(0x100000001b3)
+
+struct gm_cache_key {
+	uint64_t size;
+	int64_t  mtime;
+	uint32_t mtime_nsec;
+	uint64_t hash;
+};
+
+static uint64_t gm_fnv1a(uint64_t hash, const uint8_t *data, size_t size) {
+	for (size_t i = 0; i < size; ++ i) {
+		hash ^= data[i];
+		hash *= GM_FNV_PRIME;
+	}
+	return hash;
+}
+
+static void gm_cache_stat_key(const struct stat *st, struct gm_cache_key *key) {
+	key->size  = (uint64_t)st->st_size;
+	key->mtime = (int64_t)st->st_mtime;
+#if defined(__APPLE__)
+	key->mtime_nsec = (uint32_t)st->st_mtimespec.tv_nsec;
+#elif defined(__linux__)
+	key->mtime_nsec = (uint32_t)st->st_mtim.tv_nsec;
+#else
+	key->mtime_nsec = 0;
+#endif
+}
+
+// Hashes the FORM header and the headers of all sections, which is what
+// changes when anything in the TXTR/AUDO sections is resized.
+static int gm_archive_cache_key(const struct gm_archive *archive, struct gm_cache_key *key) {
+	struct stat st;
+
+	if (fstat(fileno(archive->fp), &st) != 0) {
+		return -1;
+	}
+
+	gm_cache_stat_key(&st, key);
+
+	if (key->size != archive->size) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	const uint64_t end_offset = (uint64_t)U32LE_FROM_BUF(archive->data + 4) + 8;
+	uint64_t hash = gm_fnv1a(GM_FNV_OFFSET, archive->data, 8);
+	uint64_t offset = 8;
+
+	while (offset < end_offset) {
+		if (offset + 8 > archive->size) {
+			errno = EINVAL;
+			return -1;
+		}
+
+		const uint8_t *hdr = archive->data + offset;
+		hash = gm_fnv1a(hash, hdr, 8);
+		offset += (uint64_t)U32LE_FROM_BUF(hdr + 4) + 8;
+	}
+
+	key->hash = hash;
+
+	return 0;
+}
+
+// The same hash as above, computed from the layout of a patched archive.
+static uint64_t gm_patched_index_hash(const struct gm_patched_index *patched) {
+	uint8_t hdr[8];
+
+	memcpy(hdr, "FORM", 4);
+	WRITE_U32LE(hdr + 4, gm_form_size(patched));
+	uint64_t hash = gm_fnv1a(GM_FNV_OFFSET, hdr, 8);
+
+	for (const struct gm_patched_index *section = patched; section->section != GM_END; ++ section) {
+		memcpy(hdr, gm_section_name(section->section), 4);
+		WRITE_U32LE(hdr + 4, section->size);
+		hash = gm_fnv1a(hash, hdr, 8);
+	}
+
+	return hash;
+}
+
+int gm_index_cache_name(char *buf, size_t size, const char *filename) {
+	if (GM_CONCAT(buf, size, filename, ".gmidx") != 0) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	return 0;
+}
+
+static const char *gm_entry_name(const struct gm_index *section, size_t index) {
+	switch (section->section) {
+	case GM_SPRT: return section->meta.sprt[index].name;
+	case GM_BGND: return section->meta.bgnd[index].name;
+	default:      return NULL;
+	}
+}
+
+static size_t gm_cache_entry_count(const struct gm_index *section) {
+	if (section->section == GM_TPAG) {
+		return section->tpag ? section->tpag->count : 0;
+	}
+	return section->entry_count;
+}
+
+static int gm_write_index_cache(const struct gm_index *index, const struct gm_cache_key *key, const char *filename) {
+	char cachename[PATH_MAX];
+	char tmpname[PATH_MAX];
+	uint8_t *buf = NULL;
+	FILE *fp = NULL;
+	int status = 0;
+
+	tmpname[0] = 0;
+
+	if (gm_index_cache_name(cachename, sizeof(cachename), filename) != 0 ||
+	    GM_CONCAT(tmpname, sizeof(tmpname), cachename, ".tmp") != 0) {
+		tmpname[0] = 0;
+		errno = ENAMETOOLONG;
+		goto error;
+	}
+
+	size_t section_count = 0;
+	size_t entry_count   = 0;
+	size_t frame_count   = 0;
+	size_t strings_size  = 0;
+	for (const struct gm_index *section = index; section->section != GM_END; ++ section) {
+		++ section_count;
+		entry_count += gm_cache_entry_count(section);
+		frame_count += section->frame_count;
+
+		for (size_t i = 0; i < section->entry_count; ++ i) {
+			const char *name = gm_entry_name(section, i);
+			if (name) {
+				strings_size += strlen(name) + 1;
+			}
+		}
+	}
+
+	const size_t size = GM_CACHE_HDR_SIZE +
+		section_count * GM_CACHE_SECTION_SIZE +
+		entry_count   * GM_CACHE_ENTRY_SIZE +
+		frame_count   * 4 +
+		strings_size;
+
+	if (size > GM_CACHE_MAX_SIZE) {
+		errno = EFBIG;
+		goto error;
+	}
+
+	buf = calloc(size, 1);
+	if (!buf) {
+		goto error;
+	}
+
+	uint8_t *ptr = buf;
+	memcpy(ptr, GM_CACHE_MAGIC, 4);
+	WRITE_U32LE(ptr +  4, GM_CACHE_VERSION);
+	WRITE_U64LE(ptr +  8, key->size);
+	WRITE_U64LE(ptr + 16, (uint64_t)key->mtime);
+	WRITE_U32LE(ptr + 24, key->mtime_nsec);
+	WRITE_U32LE(ptr + 28, section_count);
+	WRITE_U64LE(ptr + 32, key->hash);
+	WRITE_U32LE(ptr + 40, entry_count);
+	WRITE_U32LE(ptr + 44, strings_size);
+	WRITE_U32LE(ptr + 48, frame_count);
+
+	uint8_t *sections = buf + GM_CACHE_HDR_SIZE;
+	uint8_t *entries  = sections + section_count * GM_CACHE_SECTION_SIZE;
+	uint8_t *frames   = entries + entry_count * GM_CACHE_ENTRY_SIZE;
+	char    *strings  = (char*)(frames + frame_count * 4);
+	size_t first_entry   = 0;
+	size_t first_frame   = 0;
+	size_t string_offset = 0;
+
+	for (const struct gm_index *section = index; section->section != GM_END; ++ section) {
+		WRITE_U32LE(sections +  0, section->section);
+		WRITE_U32LE(sections +  4, gm_cache_entry_count(section));
+		WRITE_U64LE(sections +  8, section->offset);
+		WRITE_U64LE(sections + 16, section->size);
+		WRITE_U32LE(sections + 24, first_entry);
+		WRITE_U32LE(sections + 28, section->loaded ? 1 : 0);
+		sections += GM_CACHE_SECTION_SIZE;
+		first_entry += gm_cache_entry_count(section);
+
+		if (section->section == GM_TPAG && section->tpag) {
+			const struct gm_tpag_table *tpag = section->tpag;
+			for (size_t i = 0; i < tpag->count; ++ i) {
+				WRITE_U64LE(entries, tpag->offsets[i]);
+				for (size_t column = 0; column < GM_TPAG_COLUMNS; ++ column) {
+					WRITE_U16LE(entries + 24 + column * 2, tpag->x[column * tpag->count + i]);
+				}
+				entries += GM_CACHE_ENTRY_SIZE;
+			}
+		}
+
+		for (size_t i = 0; i < section->entry_count; ++ i) {
+			const char *name = gm_entry_name(section, i);
+
+			// only TXTR and AUDO entries have data of their own
+			if (section->offsets) {
+				WRITE_U64LE(entries +  0, section->offsets[i]);
+				WRITE_U64LE(entries +  8, section->sizes[i]);
+				WRITE_U32LE(entries + 16, section->types[i]);
+			}
+
+			switch (section->section) {
+			case GM_TXTR:
+				WRITE_U32LE(entries + 32, section->meta.txtr[i].width);
+				WRITE_U32LE(entries + 36, section->meta.txtr[i].height);
+				break;
+
+			case GM_SPRT:
+				// frames of all sections are stored back to back
+				WRITE_U32LE(entries + 24, first_frame + section->meta.sprt[i].first_frame);
+				WRITE_U32LE(entries + 28, section->meta.sprt[i].frame_count);
+				break;
+
+			case GM_BGND:
+				WRITE_U32LE(entries + 24, section->meta.bgnd[i].tpag_index);
+				break;
+
+			default:
+				break;
+			}
+
+			if (name) {
+				// 0 means no name
+				size_t length = strlen(name) + 1;
+				WRITE_U32LE(entries + 20, string_offset + 1);
+				memcpy(strings + string_offset, name, length);
+				string_offset += length;
+			}
+
+			entries += GM_CACHE_ENTRY_SIZE;
+		}
+
+		for (size_t i = 0; i < section->frame_count; ++ i) {
+			WRITE_U32LE(frames, section->frames[i]);
+			frames += 4;
+		}
+		first_frame += section->frame_count;
+	}
+
+	// write to a temp file first, so that readers never see half a cache
+	fp = fopen(tmpname, "wb");
+	if (!fp) {
+		goto error;
+	}
+
+	if (fwrite(buf, size, 1, fp) != 1) {
+		goto error;
+	}
+
+	{
+		int close_status = fclose(fp);
+		fp = NULL;
+		if (close_status != 0) {
+			goto error;
+		}
+	}
+
+#if defined(GM_WINDOWS)
+	unlink(cachename);
+#endif
+
+	if (rename(tmpname, cachename) != 0) {
+		goto error;
+	}
+
+	goto end;
+
+error:
+	status = -1;
+	{
+		int errnum = errno;
+		if (fp) {
+			fclose(fp);
+			fp = NULL;
+		}
+		if (tmpname[0]) {
+			unlink(tmpname);
+		}
+		errno = errnum;
+	}
+
+end:
+	free(buf);
+
+	return status;
+}
+
+static int gm_load_cached_tpag(struct gm_index *section, const uint8_t *records, size_t count, struct gm_arena *arena) {
+	struct gm_tpag_table *tpag = gm_new_tpag_table(count, arena);
+	if (!tpag) {
+		return -1;
+	}
+
+	for (size_t i = 0; i < count; ++ i) {
+		const uint8_t *record = records + i * GM_CACHE_ENTRY_SIZE;
+		const uint64_t offset = U64LE_FROM_BUF(record);
+		if (offset > UINT32_MAX) {
+			errno = EINVAL;
+			return -1;
+		}
+
+		tpag->offsets[i] = (uint32_t)offset;
+		if (i > 0 && tpag->offsets[i] <= tpag->offsets[i - 1]) {
+			tpag->sorted = false;
+		}
+
+		for (size_t column = 0; column < GM_TPAG_COLUMNS; ++ column) {
+			tpag->x[column * count + i] = U16LE_FROM_BUF(record + 24 + column * 2);
+		}
+	}
+
+	section->tpag = tpag;
+
+	return 0;
+}
+
+// The frames of all sprite sections are stored back to back, each section
+// gets the range its sprites use.
+static void gm_cached_frames(struct gm_index *section, uint32_t *all_frames, size_t frame_count) {
+	size_t begin = frame_count;
+	size_t end   = 0;
+	for (size_t i = 0; i < section->entry_count; ++ i) {
+		const struct gm_sprt_meta *sprite = &section->meta.sprt[i];
+		if (sprite->frame_count > 0) {
+			if (sprite->first_frame < begin) {
+				begin = sprite->first_frame;
+			}
+			if ((size_t)sprite->first_frame + sprite->frame_count > end) {
+				end = (size_t)sprite->first_frame + sprite->frame_count;
+			}
+		}
+	}
+
+	if (begin >= end) {
+		return;
+	}
+
+	for (size_t i = 0; i < section->entry_count; ++ i) {
+		struct gm_sprt_meta *sprite = &section->meta.sprt[i];
+		sprite->first_frame = sprite->frame_count > 0 ? sprite->first_frame - (uint32_t)begin : 0;
+	}
+	section->frames      = all_frames + begin;
+	section->frame_count = end - begin;
+}
+
+// Sprites and backgrounds need the TPAG records they refer to.
+static int gm_link_cached_tpag(struct gm_index *index) {
+	const struct gm_index *tpag = NULL;
+	for (const struct gm_index *section = index; section->section != GM_END; ++ section) {
+		if (section->section == GM_TPAG) {
+			tpag = section;
+			break;
+		}
+	}
+
+	for (struct gm_index *section = index; section->section != GM_END; ++ section) {
+		if ((section->section != GM_SPRT && section->section != GM_BGND) || !section->loaded) {
+			continue;
+		}
+
+		if (!tpag || !tpag->tpag) {
+			errno = EINVAL;
+			return -1;
+		}
+
+		for (size_t i = 0; i < section->entry_count; ++ i) {
+			if (section->section == GM_BGND && section->meta.bgnd[i].tpag_index >= tpag->tpag->count) {
+				errno = EINVAL;
+				return -1;
+			}
+		}
+
+		for (size_t i = 0; i < section->frame_count; ++ i) {
+			if (section->frames[i] >= tpag->tpag->count) {
+				errno = EINVAL;
+				return -1;
+			}
+		}
+
+		section->tpag = tpag->tpag;
+	}
+
+	return 0;
+}
+
+struct gm_index *gm_load_index_cache(const struct gm_archive *archive, const char *filename) {
+	char cachename[PATH_MAX];
+	struct gm_cache_key key;
+	struct gm_index *index = NULL;
+	struct gm_arena *arena = NULL;
+	uint8_t *buf = NULL;
+	FILE *fp = NULL;
+	struct stat st;
+
+	if (gm_index_cache_name(cachename, sizeof(cachename), filename) != 0) {
+		goto error;
+	}
+
+	fp = fopen(cachename, "rb");
+	if (!fp) {
+		goto error;
+	}
+
+	if (fstat(fileno(fp), &st) != 0) {
+		goto error;
+	}
+
+	if (st.st_size < GM_CACHE_HDR_SIZE || st.st_size > GM_CACHE_MAX_SIZE) {
+		errno = EINVAL;
+		goto error;
+	}
+
+	const size_t size = (size_t)st.st_size;
+	buf = malloc(size);
+	if (!buf) {
+		goto error;
+	}
+
+	if (fread(buf, size, 1, fp) != 1) {
+		errno = EIO;
+		goto error;
+	}
+
+	fclose(fp);
+	fp = NULL;
+
+	if (gm_archive_cache_key(archive, &key) != 0) {
+		goto error;
+	}
+
+	if (memcmp(buf, GM_CACHE_MAGIC, 4) != 0 ||
+	    U32LE_FROM_BUF(buf +  4) != GM_CACHE_VERSION ||
+	    U64LE_FROM_BUF(buf +  8) != key.size ||
+	    U64LE_FROM_BUF(buf + 16) != (uint64_t)key.mtime ||
+	    U32LE_FROM_BUF(buf + 24) != key.mtime_nsec ||
+	    U64LE_FROM_BUF(buf + 32) != key.hash) {
+		// stale or foreign cache
+		errno = EINVAL;
+		goto error;
+	}
+
+	const size_t section_count = U32LE_FROM_BUF(buf + 28);
+	const size_t entry_count   = U32LE_FROM_BUF(buf + 40);
+	const size_t strings_size  = U32LE_FROM_BUF(buf + 44);
+	const size_t frame_count   = U32LE_FROM_BUF(buf + 48);
+
+	if (size != GM_CACHE_HDR_SIZE +
+	            (uint64_t)section_count * GM_CACHE_SECTION_SIZE +
+	            (uint64_t)entry_count   * GM_CACHE_ENTRY_SIZE +
+	            (uint64_t)frame_count   * 4 +
+	            strings_size ||
+	    (strings_size > 0 && buf[size - 1] != 0)) {
+		errno = EINVAL;
+		goto error;
+	}
+
+	const uint8_t *sections = buf + GM_CACHE_HDR_SIZE;
+	const uint8_t *entries  = sections + section_count * GM_CACHE_SECTION_SIZE;
+	const uint8_t *frames   = entries + entry_count * GM_CACHE_ENTRY_SIZE;
+	const char    *strings  = (const char*)(frames + frame_count * 4);
+
+	// one block for everything, names point into a copy of the string table
+	arena = gm_arena_create(
+		(section_count + 1) * sizeof(struct gm_index) +
+		entry_count * (sizeof(struct gm_sprt_meta) + 3 * sizeof(uint32_t)) +
+		frame_count * sizeof(uint32_t) +
+		(entry_count * 4 + section_count * 16) * sizeof(size_t) + // name tables
+		strings_size + (section_count + 4) * 64);
+	if (!arena) {
+		goto error;
+	}
+
+	index = gm_arena_calloc(arena, section_count + 1, sizeof(struct gm_index));
+	if (!index) {
+		goto error;
+	}
+
+	char *names = gm_arena_alloc(arena, strings_size);
+	if (!names) {
+		goto error;
+	}
+	memcpy(names, strings, strings_size);
+
+	uint32_t *all_frames = gm_arena_calloc(arena, frame_count, sizeof(uint32_t));
+	if (!all_frames && frame_count > 0) {
+		goto error;
+	}
+	for (size_t i = 0; i < frame_count; ++ i) {
+		all_frames[i] = U32LE_FROM_BUF(frames + i * 4);
+	}
+
+	for (size_t i = 0; i < section_count; ++ i) {
+		const uint8_t *record = sections + i * GM_CACHE_SECTION_SIZE;
+		struct gm_index *section = &index[i];
+
+		const uint32_t type    = U32LE_FROM_BUF(record);
+		const size_t count     = U32LE_FROM_BUF(record + 4);
+		const uint64_t offset  = U64LE_FROM_BUF(record + 8);
+		const uint64_t sec_size = U64LE_FROM_BUF(record + 16);
+		const size_t first     = U32LE_FROM_BUF(record + 24);
+		const uint32_t loaded  = U32LE_FROM_BUF(record + 28);
+
+		if (type == GM_END || type > GM_GLOB || !gm_section_name((enum gm_section)type) ||
+		    offset > key.size || sec_size > key.size - offset ||
+		    first > entry_count || count > entry_count - first ||
+		    loaded > 1 || (!loaded && count > 0)) {
+			errno = EINVAL;
+			goto error;
+		}
+
+		section->section = (enum gm_section)type;
+		section->offset  = (off_t)offset;
+		section->size    = (size_t)sec_size;
+		section->loaded  = loaded != 0;
+		section->arena   = arena;
+
+		if (section->section == GM_TPAG) {
+			if (loaded && gm_load_cached_tpag(section, entries + first * GM_CACHE_ENTRY_SIZE, count, arena) != 0) {
+				goto error;
+			}
+			continue;
+		}
+
+		if (count == 0) {
+			continue;
+		}
+
+		if (gm_alloc_entries(section, count, arena) != 0) {
+			goto error;
+		}
+		section->entry_count = count;
+
+		for (size_t j = 0; j < count; ++ j) {
+			const uint8_t *erec = entries + (first + j) * GM_CACHE_ENTRY_SIZE;
+
+			const uint64_t entry_offset = U64LE_FROM_BUF(erec);
+			const uint64_t entry_size   = U64LE_FROM_BUF(erec + 8);
+			const uint32_t entry_type   = U32LE_FROM_BUF(erec + 16);
+			const uint32_t name         = U32LE_FROM_BUF(erec + 20);
+
+			if (entry_offset > key.size || entry_size > key.size - entry_offset ||
+			    entry_offset > UINT32_MAX || entry_size > UINT32_MAX ||
+			    entry_type > GM_OGG || name > strings_size) {
+				errno = EINVAL;
+				goto error;
+			}
+
+			if (section->offsets) {
+				section->offsets[j] = (uint32_t)entry_offset;
+				section->sizes[j]   = (uint32_t)entry_size;
+				section->types[j]   = (uint8_t)entry_type;
+			}
+
+			switch (section->section) {
+			case GM_TXTR:
+				section->meta.txtr[j].width  = U32LE_FROM_BUF(erec + 32);
+				section->meta.txtr[j].height = U32LE_FROM_BUF(erec + 36);
+				break;
+
+			case GM_SPRT:
+			{
+				struct gm_sprt_meta *sprite = &section->meta.sprt[j];
+				if (name == 0) {
+					errno = EINVAL;
+					goto error;
+				}
+				sprite->name        = names + name - 1;
+				sprite->first_frame = U32LE_FROM_BUF(erec + 24);
+				sprite->frame_count = U32LE_FROM_BUF(erec + 28);
+				if (sprite->first_frame > frame_count ||
+				    sprite->frame_count > frame_count - sprite->first_frame) {
+					errno = EINVAL;
+					goto error;
+				}
+				break;
+			}
+			case GM_BGND:
+				if (name == 0) {
+					errno = EINVAL;
+					goto error;
+				}
+				section->meta.bgnd[j].name       = names + name - 1;
+				section->meta.bgnd[j].tpag_index = U32LE_FROM_BUF(erec + 24);
+				break;
+
+			default:
+				break;
+			}
+		}
+
+		if (section->section == GM_SPRT) {
+			gm_cached_frames(section, all_frames, frame_count);
+		}
+
+		if ((section->section == GM_SPRT || section->section == GM_BGND) &&
+		    gm_build_name_table(section, arena) != 0) {
+			goto error;
+		}
+	}
+	index[section_count].section = GM_END;
+
+	if (gm_link_cached_tpag(index) != 0) {
+		goto error;
+	}
+	index[section_count].arena   = arena;
+
+	free(buf);
+
+	return index;
+
+error:
+	{
+		int errnum = errno;
+		if (fp) {
+			fclose(fp);
+		}
+		free(buf);
+		gm_arena_destroy(arena);
+		errno = errnum;
+	}
+
+	return NULL;
+}
+
+int gm_save_index_cache(const struct gm_index *index, const struct gm_archive *archive, const char *filename) {
+	struct gm_cache_key key;
+
+	if (gm_archive_cache_key(archive, &key) != 0) {
+		return -1;
+	}
+
+	return gm_write_index_cache(index, &key, filename);
+}
+
+// Stores the index of an archive that was just written from patched, so the
+// next run doesn't have to parse it again. filename must be closed already,
+// so that its modification time doesn't change anymore.
+int gm_save_patched_index_cache(const struct gm_patched_index *patched, const char *filename) {
+	struct gm_cache_key key;
+	struct stat st;
+	struct gm_index *index = NULL;
+	struct gm_arena *arena = NULL;
+	size_t count = 0;
+	int status = 0;
+
+	if (stat(filename, &st) != 0) {
+		goto error;
+	}
+
+	gm_cache_stat_key(&st, &key);
+	key.hash = gm_patched_index_hash(patched);
+
+	while (patched[count].section != GM_END) {
+		++ count;
+	}
+
+	arena = gm_arena_create(0);
+	if (!arena) {
+		goto error;
+	}
+
+	index = gm_arena_calloc(arena, count + 1, sizeof(struct gm_index));
+	if (!index) {
+		goto error;
+	}
+
+	// entries keep the metadata of the originals, only their location changed
+	// (everything but the offsets and sizes is borrowed from the original index)
+	for (size_t i = 0; i < count; ++ i) {
+		const struct gm_patched_index *section = &patched[i];
+
+		index[i].section     = section->section;
+		index[i].offset      = section->offset;
+		index[i].size        = section->size;
+		index[i].loaded      = section->index->loaded;
+		index[i].tpag        = section->index->tpag;
+		index[i].frames      = section->index->frames;
+		index[i].frame_count = section->index->frame_count;
+
+		index[i].entry_count = section->index->entry_count;
+		index[i].types       = section->index->types;
+		index[i].meta        = section->index->meta;
+
+		if (section->entry_count == 0) {
+			continue;
+		}
+
+		// the archive was written, so everything fits into 32 bits
+		index[i].offsets = gm_arena_calloc(arena, section->entry_count, sizeof(uint32_t));
+		index[i].sizes   = gm_arena_calloc(arena, section->entry_count, sizeof(uint32_t));
+		if (!index[i].offsets || !index[i].sizes) {
+			goto error;
+		}
+
+		for (size_t j = 0; j < section->entry_count; ++ j) {
+			index[i].offsets[j] = (uint32_t)section->offsets[j];
+			index[i].sizes[j]   = (uint32_t)section->sizes[j];
+		}
+	}
+	index[count].section = GM_END;
+
+	if (gm_write_index_cache(index, &key, filename) != 0) {
+		goto error;
+	}
+
+	goto end;
+
+error:
+	status = -1;
+
+end:
+	{
+		int errnum = errno;
+		gm_arena_destroy(arena);
+		errno = errnum;
+	}
+
+	return status;
+}
+
+void gm_remove_index_cache(const char *filename) {
+	char cachename[PATH_MAX];
+
+	if (gm_index_cache_name(cachename, sizeof(cachename), filename) == 0) {
+		unlink(cachename);
+	}
+}
+
+// Uses the cache next to filename if it matches the archive, otherwise parses
+// the archive and (re)writes the cache. Not being able to write the cache
+// (e.g. read-only installation directory) is not an error.
+struct gm_index *gm_read_archive_index_cached(const struct gm_archive *archive, const char *filename) {
+	struct gm_index *index = gm_load_index_cache(archive, filename);
+	if (index) {
+		return index;
+	}
+
+	index = gm_read_archive_index(archive);
+	if (!index) {
+		return NULL;
+	}
+
+	// With GM_ARCHIVE_LAZY only the headers were read. Cache at least the
+	// sections that all tools need, the others are parsed when used.
+	if (gm_load_sections(archive, index, (const enum gm_section[]){ GM_TXTR, GM_AUDO, GM_END }) != 0) {
+		int errnum = errno;
+		gm_free_index(index);
+		errno = errnum;
+		return NULL;
+	}
+
+	int errnum = errno;
+	gm_save_index_cache(index, archive, filename);
+	errno = errnum;
+
+	return index;
+}
@@ -0,0 +1,1158 @@
+// O_DIRECT (Linux)
+#if !defined(_GNU_SOURCE)
+#	define _GNU_SOURCE
+#endif
+
+#include "gm_io.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#if defined(_WIN16) || defined(_WIN32) || defined(_WIN64)
+#	define GM_IO_WINDOWS
+#	include <windows.h>
+#	include <io.h>
+#endif
+
+#if !defined(GM_IO_WINDOWS)
+#	include <pthread.h>
+#	define GM_IO_THREADS
+#endif
+
+#if defined(__linux__)
+#	include <sys/ioctl.h>
+#	include <sys/sendfile.h>
+#	include <sys/syscall.h>
+#	include <linux/fs.h>
+#	if defined(__NR_io_uring_setup) && defined(__has_include)
+#		if __has_include(<linux/io_uring.h>)
+#			define GM_IO_URING
+#			include <stdatomic.h>
+#			include <sys/mman.h>
+#			include <sys/uio.h>
+#			include <linux/io_uring.h>
+#		endif
+#	endif
+#endif
+
+#define LOG_ERR_MSG(MSG) fprintf(stderr, "*** ERROR: " MSG "\n")
+
+const char *gm_copy_method_name(enum gm_copy_method method) {
+	switch (method) {
+	case GM_COPY_NONE:       return "none";
+	case GM_COPY_CLONE:      return "reflink";
+	case GM_COPY_FILE_RANGE: return "copy_file_range";
+	case GM_COPY_URING:      return "io_uring";
+	case GM_COPY_SENDFILE:   return "sendfile";
+	case GM_COPY_READ_WRITE: return "read/write";
+	default:                 return NULL;
+	}
+}
+
+size_t gm_io_buffer_size(const struct gm_io_policy *policy, size_t default_size) {
+	return policy && policy->buffer_size > 0 ? policy->buffer_size : default_size;
+}
+
+// Tells the kernel how a file that is about to be copied will be read.
+void gm_io_advise(int fd, const struct gm_io_policy *policy) {
+#if defined(POSIX_FADV_SEQUENTIAL)
+	if (policy && (policy->flags & GM_IO_SEQUENTIAL)) {
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	}
+
+	if (policy && (policy->flags & GM_IO_WILLNEED)) {
+		posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+	}
+#else
+	(void)fd;
+	(void)policy;
+#endif
+}
+
+// With GM_IO_DONTNEED drops a file that was read or written once from the
+// page cache, so copying a huge archive doesn't evict everything else.
+// Dirty pages can't be dropped, so written data is flushed first.
+void gm_io_release(int fd, bool written, const struct gm_io_policy *policy) {
+	if (!policy || !(policy->flags & GM_IO_DONTNEED)) {
+		return;
+	}
+
+#if defined(POSIX_FADV_DONTNEED)
+	if (written) {
+		fdatasync(fd);
+	}
+
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+#else
+	(void)fd;
+	(void)written;
+#endif
+}
+
+// Parses one of the I/O options shared by the command line tools. Returns 1
+// if arg was such an option, 0 if not and -1 if its value is invalid.
+int gm_parse_io_option(const char *arg, struct gm_io_policy *policy) {
+	if (strncmp(arg, "--buffer-size=", 14) == 0) {
+		char *endptr = NULL;
+		unsigned long long size = strtoull(arg + 14, &endptr, 10);
+
+		if (endptr == arg + 14) {
+			return -1;
+		}
+
+		unsigned long long unit = 1;
+		switch (*endptr) {
+		case 'k': case 'K': unit = 1024;        ++ endptr; break;
+		case 'm': case 'M': unit = 1024 * 1024; ++ endptr; break;
+		}
+
+		// checked before multiplying, so big values can't wrap around
+		if (*endptr || size == 0 || size > (SIZE_MAX / 16) / unit) {
+			return -1;
+		}
+		size *= unit;
+
+		policy->buffer_size = size;
+	}
+	else if (strcmp(arg, "--no-fadvise") == 0) {
+		policy->flags &= ~(GM_IO_SEQUENTIAL | GM_IO_WILLNEED);
+	}
+	else if (strcmp(arg, "--willneed") == 0) {
+		policy->flags |= GM_IO_WILLNEED;
+	}
+	else if (strcmp(arg, "--dontneed") == 0) {
+		policy->flags |= GM_IO_DONTNEED;
+	}
+	else if (strcmp(arg, "--direct") == 0) {
+		policy->flags |= GM_IO_DIRECT;
+	}
+	else {
+		return 0;
+	}
+
+	return 1;
+}
+
+int gm_pread_all(int fd, void *buf, size_t size, off_t offset) {
+	uint8_t *ptr = buf;
+
+	while (size > 0) {
+#if defined(GM_IO_WINDOWS)
+		if (_lseeki64(fd, offset, SEEK_SET) < 0) {
+			return -1;
+		}
+		int count = _read(fd, ptr, size > INT_MAX ? INT_MAX : (unsigned int)size);
+#else
+		ssize_t count = pread(fd, ptr, size, offset);
+#endif
+		if (count < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+
+		if (count == 0) {
+			LOG_ERR_MSG("unexpected end of file while copying file data");
+
+			errno = EINVAL;
+			return -1;
+		}
+
+		ptr    += count;
+		offset += count;
+		size   -= count;
+	}
+
+	return 0;
+}
+
+int gm_pwrite_all(int fd, const void *buf, size_t size, off_t offset) {
+	const uint8_t *ptr = buf;
+
+	while (size > 0) {
+#if defined(GM_IO_WINDOWS)
+		if (_lseeki64(fd, offset, SEEK_SET) < 0) {
+			return -1;
+		}
+		int count = _write(fd, ptr, size > INT_MAX ? INT_MAX : (unsigned int)size);
+#else
+		ssize_t count = pwrite(fd, ptr, size, offset);
+#endif
+		if (count < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+
+		ptr    += count;
+		offset += count;
+		size   -= count;
+	}
+
+	return 0;
+}
+
+int gm_write_all(int fd, const void *buf, size_t size) {
+	const uint8_t *ptr = buf;
+
+	while (size > 0) {
+#if defined(GM_IO_WINDOWS)
+		int count = _write(fd, ptr, size > INT_MAX ? INT_MAX : (unsigned int)size);
+#else
+		ssize_t count = write(fd, ptr, size);
+#endif
+		if (count < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+
+		ptr  += count;
+		size -= count;
+	}
+
+	return 0;
+}
+
+static int gm_copy_read_write(int srcfd, off_t srcoff, int dstfd, off_t dstoff, size_t size, size_t bufsize) {
+	if (bufsize > size) {
+		bufsize = size;
+	}
+	uint8_t *buf = malloc(bufsize);
+
+	if (!buf) {
+		return -1;
+	}
+
+	while (size > 0) {
+		size_t chunk_size = size < bufsize ? size : bufsize;
+
+		if (gm_pread_all(srcfd, buf, chunk_size, srcoff) != 0 ||
+		    gm_pwrite_all(dstfd, buf, chunk_size, dstoff) != 0) {
+			int errnum = errno;
+			free(buf);
+			errno = errnum;
+			return -1;
+		}
+
+		srcoff += chunk_size;
+		dstoff += chunk_size;
+		size   -= chunk_size;
+	}
+
+	free(buf);
+
+	return 0;
+}
+
+#if defined(__linux__)
+// errors that mean "this mechanism can't be used for this pair of files"
+static bool gm_copy_unsupported(int errnum) {
+	return errnum == ENOSYS || errnum == EXDEV || errnum == EINVAL ||
+	       errnum == EOPNOTSUPP || errnum == ENOTTY || errnum == EBADF ||
+	       errnum == ETXTBSY || errnum == EPERM;
+}
+
+#if defined(SYS_copy_file_range)
+// returns 1 if copy_file_range isn't usable and nothing was copied
+static int gm_copy_file_range(int srcfd, off_t *srcoff, int dstfd, off_t *dstoff, size_t *size) {
+	bool first = true;
+
+	while (*size > 0) {
+		int64_t inoff  = *srcoff;
+		int64_t outoff = *dstoff;
+		ssize_t count = syscall(SYS_copy_file_range, srcfd, &inoff, dstfd, &outoff, *size, 0);
+
+		if (count < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return first && gm_copy_unsupported(errno) ? 1 : -1;
+		}
+
+		if (count == 0) {
+			// source is shorter than expected, let the fallback report it
+			return 1;
+		}
+
+		first = false;
+		*srcoff += count;
+		*dstoff += count;
+		*size   -= count;
+	}
+
+	return 0;
+}
+#endif
+
+// returns 1 if sendfile isn't usable and nothing was copied
+static int gm_copy_sendfile(int srcfd, off_t *srcoff, int dstfd, off_t *dstoff, size_t *size) {
+	bool first = true;
+
+	if (lseek(dstfd, *dstoff, SEEK_SET) < 0) {
+		return -1;
+	}
+
+	while (*size > 0) {
+		off_t inoff = *srcoff;
+		// sendfile() transfers at most 0x7ffff000 bytes per call
+		size_t chunk_size = *size < 0x40000000 ? *size : 0x40000000;
+		ssize_t count = sendfile(dstfd, srcfd, &inoff, chunk_size);
+
+		if (count < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return first && gm_copy_unsupported(errno) ? 1 : -1;
+		}
+
+		if (count == 0) {
+			return 1;
+		}
+
+		first = false;
+		*srcoff += count;
+		*dstoff += count;
+		*size   -= count;
+	}
+
+	return 0;
+}
+#endif
+
+#if defined(GM_IO_URING)
+// Pipelined copy through io_uring: a bounded set of buffers (of the policy
+// buffer size, 256 KiB by default) each cycles
+// through read from srcfd and write to dstfd, so reading the next buffers
+// overlaps with writing the previous ones. The ring is driven with raw
+// syscalls, no liburing needed.
+#define GM_URING_BUFFERS  8
+#define GM_URING_MIN_SIZE (1024 * 1024)
+
+struct gm_uring {
+	int fd;
+
+	uint8_t *sq_ring;
+	uint8_t *cq_ring;
+	size_t   sq_ring_size;
+	size_t   cq_ring_size;
+	struct io_uring_sqe *sqes;
+	size_t   sqes_size;
+
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	unsigned to_submit;
+};
+
+struct gm_uring_buffer {
+	uint8_t *data;
+	off_t    offset;  // relative to the start of the copied range
+	size_t   size;
+	size_t   done;    // bytes read or written so far
+	bool     writing;
+	struct iovec iov;
+};
+
+// -1 = not supported by this kernel (or blocked), 0 = unknown, 1 = works
+static atomic_int gm_uring_state = 0;
+
+static void gm_uring_close(struct gm_uring *ring) {
+	if (ring->sqes) {
+		munmap(ring->sqes, ring->sqes_size);
+	}
+
+	if (ring->cq_ring && ring->cq_ring != ring->sq_ring) {
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	}
+
+	if (ring->sq_ring) {
+		munmap(ring->sq_ring, ring->sq_ring_size);
+	}
+
+	if (ring->fd >= 0) {
+		close(ring->fd);
+	}
+}
+
+static int gm_uring_open(struct gm_uring *ring, unsigned entries) {
+	struct io_uring_params params;
+
+	memset(ring, 0, sizeof(*ring));
+	memset(&params, 0, sizeof(params));
+
+	ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+	if (ring->fd < 0) {
+		return -1;
+	}
+
+	ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	ring->cq_ring_size = params.cq_off.cqes  + params.cq_entries * sizeof(struct io_uring_cqe);
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_ring_size > ring->sq_ring_size) {
+			ring->sq_ring_size = ring->cq_ring_size;
+		}
+		ring->cq_ring_size = ring->sq_ring_size;
+	}
+
+	void *ptr = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ptr == MAP_FAILED) {
+		goto error;
+	}
+	ring->sq_ring = ptr;
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_ring = ring->sq_ring;
+	}
+	else {
+		ptr = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+		if (ptr == MAP_FAILED) {
+			goto error;
+		}
+		ring->cq_ring = ptr;
+	}
+
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	ptr = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ptr == MAP_FAILED) {
+		goto error;
+	}
+	ring->sqes = ptr;
+
+	ring->sq_tail  = (unsigned*)(ring->sq_ring + params.sq_off.tail);
+	ring->sq_mask  = (unsigned*)(ring->sq_ring + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned*)(ring->sq_ring + params.sq_off.array);
+	ring->cq_head  = (unsigned*)(ring->cq_ring + params.cq_off.head);
+	ring->cq_tail  = (unsigned*)(ring->cq_ring + params.cq_off.tail);
+	ring->cq_mask  = (unsigned*)(ring->cq_ring + params.cq_off.ring_mask);
+	ring->cqes     = (struct io_uring_cqe*)(ring->cq_ring + params.cq_off.cqes);
+
+	return 0;
+
+error:
+	{
+		int errnum = errno;
+		gm_uring_close(ring);
+		errno = errnum;
+	}
+	return -1;
+}
+
+// queues the next read or write of a buffer
+static void gm_uring_queue(struct gm_uring *ring, struct gm_uring_buffer *buffer, size_t index,
+                           int srcfd, off_t srcoff, int dstfd, off_t dstoff) {
+	const unsigned tail = *ring->sq_tail;
+	const unsigned slot = tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[slot];
+
+	buffer->iov.iov_base = buffer->data + buffer->done;
+	buffer->iov.iov_len  = buffer->size - buffer->done;
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode    = buffer->writing ? IORING_OP_WRITEV : IORING_OP_READV;
+	sqe->fd        = buffer->writing ? dstfd : srcfd;
+	sqe->off       = (buffer->writing ? dstoff : srcoff) + buffer->offset + buffer->done;
+	sqe->addr      = (uintptr_t)&buffer->iov;
+	sqe->len       = 1;
+	sqe->user_data = index;
+
+	ring->sq_array[slot] = slot;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	++ ring->to_submit;
+}
+
+// returns 1 if io_uring can't be used and nothing was copied
+static int gm_copy_uring(int srcfd, off_t srcoff, int dstfd, off_t dstoff, size_t size, size_t bufsize) {
+	struct gm_uring ring;
+	struct gm_uring_buffer *buffers = NULL;
+	uint8_t *memory = NULL;
+	size_t next = 0;
+	size_t inflight = 0;
+	size_t written = 0;
+	bool ring_failed = false;
+	int errnum = 0;
+
+	if (size < GM_URING_MIN_SIZE || atomic_load(&gm_uring_state) < 0) {
+		return 1;
+	}
+
+	if (gm_uring_open(&ring, GM_URING_BUFFERS) != 0) {
+		if (errno == ENOSYS || errno == EPERM || errno == EACCES || errno == EINVAL) {
+			atomic_store(&gm_uring_state, -1);
+			return 1;
+		}
+		return -1;
+	}
+
+	// the iovecs have to stay valid as long as the buffers, so they are on the heap, too
+	buffers = calloc(GM_URING_BUFFERS, sizeof(struct gm_uring_buffer));
+	memory  = malloc(GM_URING_BUFFERS * bufsize);
+	if (!buffers || !memory) {
+		errnum = errno;
+		goto end;
+	}
+
+	for (size_t i = 0; i < GM_URING_BUFFERS && next < size; ++ i) {
+		struct gm_uring_buffer *buffer = &buffers[i];
+		buffer->data    = memory + i * bufsize;
+		buffer->offset  = next;
+		buffer->size    = size - next < bufsize ? size - next : bufsize;
+		buffer->done    = 0;
+		buffer->writing = false;
+		next += buffer->size;
+
+		gm_uring_queue(&ring, buffer, i, srcfd, srcoff, dstfd, dstoff);
+		++ inflight;
+	}
+
+	while (inflight > 0) {
+		int count = syscall(__NR_io_uring_enter, ring.fd, ring.to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+		if (count < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			if (errno == EAGAIN || errno == EBUSY) {
+				// the completion queue is full, reap it before trying again
+				count = 0;
+			}
+			else if (ring_failed) {
+				// Requests might still be in flight and the kernel might still
+				// write into the buffers, so they are leaked below.
+				break;
+			}
+			else {
+				// stop queueing new requests and try once more to reap the
+				// ones that are in flight
+				ring_failed = true;
+				if (errnum == 0) {
+					errnum = errno;
+				}
+				continue;
+			}
+		}
+		ring.to_submit -= (unsigned)count < ring.to_submit ? (unsigned)count : ring.to_submit;
+
+		unsigned head = *ring.cq_head;
+		while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+			const struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+			const size_t index = cqe->user_data;
+			const int res = cqe->res;
+			struct gm_uring_buffer *buffer = &buffers[index];
+
+			++ head;
+			__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+
+			if (res < 0 && (res == -EINTR || res == -EAGAIN) && errnum == 0) {
+				gm_uring_queue(&ring, buffer, index, srcfd, srcoff, dstfd, dstoff);
+				continue;
+			}
+
+			if (res <= 0 || errnum != 0) {
+				if (errnum == 0) {
+					if (res == 0) {
+						LOG_ERR_MSG("unexpected end of file while copying file data");
+						errnum = EINVAL;
+					}
+					else {
+						errnum = -res;
+					}
+				}
+				-- inflight;
+				continue;
+			}
+
+			buffer->done += res;
+			if (buffer->done < buffer->size) {
+				gm_uring_queue(&ring, buffer, index, srcfd, srcoff, dstfd, dstoff);
+			}
+			else if (!buffer->writing) {
+				buffer->writing = true;
+				buffer->done    = 0;
+				gm_uring_queue(&ring, buffer, index, srcfd, srcoff, dstfd, dstoff);
+			}
+			else {
+				written += buffer->size;
+				if (next < size) {
+					buffer->offset  = next;
+					buffer->size    = size - next < bufsize ? size - next : bufsize;
+					buffer->done    = 0;
+					buffer->writing = false;
+					next += buffer->size;
+					gm_uring_queue(&ring, buffer, index, srcfd, srcoff, dstfd, dstoff);
+				}
+				else {
+					-- inflight;
+				}
+			}
+		}
+	}
+
+end:
+	gm_uring_close(&ring);
+	if (inflight == 0) {
+		free(memory);
+		free(buffers);
+	}
+
+	if (errnum != 0) {
+		// kernels without IORING_OP_READV/WRITEV or files that don't support it
+		if (written == 0 && (errnum == EINVAL || errnum == EOPNOTSUPP)) {
+			return 1;
+		}
+		errno = errnum;
+		return -1;
+	}
+
+	atomic_store(&gm_uring_state, 1);
+
+	return 0;
+}
+#endif
+
+static int gm_copy_fallback(int srcfd, off_t srcoff, int dstfd, off_t dstoff, size_t size, bool positional,
+                            const struct gm_io_policy *policy, enum gm_copy_method *method) {
+	if (size == 0) {
+		return 0;
+	}
+
+#if defined(__linux__)
+	int status;
+
+#if defined(SYS_copy_file_range)
+	status = gm_copy_file_range(srcfd, &srcoff, dstfd, &dstoff, &size);
+	if (status <= 0) {
+		if (method) *method = GM_COPY_FILE_RANGE;
+		return status;
+	}
+#endif
+
+#if defined(GM_IO_URING)
+	status = gm_copy_uring(srcfd, srcoff, dstfd, dstoff, size, gm_io_buffer_size(policy, 256 * 1024));
+	if (status <= 0) {
+		if (method) *method = GM_COPY_URING;
+		return status;
+	}
+#endif
+
+	// sendfile() writes at the file position of dstfd, which is shared
+	if (!positional) {
+		status = gm_copy_sendfile(srcfd, &srcoff, dstfd, &dstoff, &size);
+		if (status <= 0) {
+			if (method) *method = GM_COPY_SENDFILE;
+			return status;
+		}
+	}
+#else
+	(void)positional;
+#endif
+
+	if (method) *method = GM_COPY_READ_WRITE;
+	return gm_copy_read_write(srcfd, srcoff, dstfd, dstoff, size, gm_io_buffer_size(policy, GM_COPY_BUFFER_SIZE));
+}
+
+static int gm_copy_range_impl(int srcfd, off_t srcoff, int dstfd, off_t dstoff, size_t size, bool positional,
+                              const struct gm_io_policy *policy, enum gm_copy_method *method) {
+	if (method) {
+		*method = GM_COPY_NONE;
+	}
+
+	if (srcfd == dstfd) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (size == 0) {
+		return 0;
+	}
+
+#if defined(__linux__) && defined(FICLONERANGE)
+	// Extents can only be shared if both ranges have the same alignment
+	// relative to the filesystem block size. Clone the block aligned middle
+	// part and copy the unaligned head and tail.
+	struct stat st;
+	if (fstat(dstfd, &st) == 0 && st.st_blksize > 0) {
+		const off_t blksize = st.st_blksize;
+
+		if ((srcoff - dstoff) % blksize == 0) {
+			const off_t  head = (blksize - srcoff % blksize) % blksize;
+			const size_t body = (uint64_t)head < size ? (size - head) / blksize * blksize : 0;
+
+			if (body > 0) {
+				struct file_clone_range range = {
+					.src_fd      = srcfd,
+					.src_offset  = srcoff + head,
+					.src_length  = body,
+					.dest_offset = dstoff + head
+				};
+
+				if (ioctl(dstfd, FICLONERANGE, &range) == 0) {
+					const size_t tail = size - head - body;
+
+					if (gm_copy_fallback(srcfd, srcoff, dstfd, dstoff, head, positional, policy, NULL) != 0) {
+						return -1;
+					}
+
+					if (gm_copy_fallback(srcfd, srcoff + head + body, dstfd, dstoff + head + body, tail, positional, policy, NULL) != 0) {
+						return -1;
+					}
+
+					if (method) {
+						*method = GM_COPY_CLONE;
+					}
+
+					return 0;
+				}
+				else if (!gm_copy_unsupported(errno)) {
+					return -1;
+				}
+			}
+		}
+	}
+#endif
+
+	return gm_copy_fallback(srcfd, srcoff, dstfd, dstoff, size, positional, policy, method);
+}
+
+int gm_copy_range(int srcfd, off_t srcoff, int dstfd, off_t dstoff, size_t size,
+                  const struct gm_io_policy *policy, enum gm_copy_method *method) {
+	return gm_copy_range_impl(srcfd, srcoff, dstfd, dstoff, size, false, policy, method);
+}
+
+// Like gm_copy_range(), but never uses or changes the file position of the
+// descriptors, so several threads can copy into the same file at once.
+// (Not on Windows, where pread()/pwrite() are emulated with seeks.)
+int gm_pcopy_range(int srcfd, off_t srcoff, int dstfd, off_t dstoff, size_t size,
+                   const struct gm_io_policy *policy, enum gm_copy_method *method) {
+	return gm_copy_range_impl(srcfd, srcoff, dstfd, dstoff, size, true, policy, method);
+}
+
+// Copies to the current position of dstfd and advances it, so unlike
+// gm_copy_range() this works when dstfd is a pipe or socket.
+int gm_stream_range(int srcfd, off_t srcoff, int dstfd, size_t size,
+                    const struct gm_io_policy *policy, enum gm_copy_method *method) {
+	if (method) {
+		*method = GM_COPY_NONE;
+	}
+
+	if (size == 0) {
+		return 0;
+	}
+
+#if defined(__linux__)
+	bool first = true;
+
+#if defined(SYS_copy_file_range)
+	// only regular files, but lets the filesystem share extents
+	while (size > 0) {
+		int64_t inoff = srcoff;
+		ssize_t count = syscall(SYS_copy_file_range, srcfd, &inoff, dstfd, NULL, size, 0);
+
+		if (count < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (first && gm_copy_unsupported(errno)) {
+				break;
+			}
+			return -1;
+		}
+
+		if (count == 0) {
+			break;
+		}
+
+		first = false;
+		srcoff += count;
+		size   -= count;
+	}
+
+	if (size == 0) {
+		if (method) *method = GM_COPY_FILE_RANGE;
+		return 0;
+	}
+#endif
+
+	first = true;
+	while (size > 0) {
+		off_t inoff = srcoff;
+		size_t chunk_size = size < 0x40000000 ? size : 0x40000000;
+		ssize_t count = sendfile(dstfd, srcfd, &inoff, chunk_size);
+
+		if (count < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (first && gm_copy_unsupported(errno)) {
+				break;
+			}
+			return -1;
+		}
+
+		if (count == 0) {
+			break;
+		}
+
+		first = false;
+		srcoff += count;
+		size   -= count;
+	}
+
+	if (size == 0) {
+		if (method) *method = GM_COPY_SENDFILE;
+		return 0;
+	}
+#endif
+
+	if (method) *method = GM_COPY_READ_WRITE;
+
+	size_t bufsize = gm_io_buffer_size(policy, GM_COPY_BUFFER_SIZE);
+	if (bufsize > size) {
+		bufsize = size;
+	}
+
+	uint8_t *buf = malloc(bufsize);
+
+	if (!buf) {
+		return -1;
+	}
+
+	while (size > 0) {
+		size_t chunk_size = size < bufsize ? size : bufsize;
+
+		if (gm_pread_all(srcfd, buf, chunk_size, srcoff) != 0 ||
+		    gm_write_all(dstfd, buf, chunk_size) != 0) {
+			int errnum = errno;
+			free(buf);
+			errno = errnum;
+			return -1;
+		}
+
+		srcoff += chunk_size;
+		size   -= chunk_size;
+	}
+
+	free(buf);
+
+	return 0;
+}
+
+static void *gm_aligned_alloc(size_t size) {
+#if defined(GM_IO_WINDOWS)
+	return _aligned_malloc(size, GM_IO_DIRECT_ALIGN);
+#else
+	void *ptr = NULL;
+	int errnum = posix_memalign(&ptr, GM_IO_DIRECT_ALIGN, size);
+	if (errnum != 0) {
+		errno = errnum;
+		return NULL;
+	}
+	return ptr;
+#endif
+}
+
+static void gm_aligned_free(void *ptr) {
+#if defined(GM_IO_WINDOWS)
+	_aligned_free(ptr);
+#else
+	free(ptr);
+#endif
+}
+
+// If fd was opened with O_DIRECT everything goes through the (aligned)
+// buffer and only whole multiples of GM_IO_DIRECT_ALIGN are written until
+// the stream is finished. Other files (e.g. pipes) are written as usual,
+// even with GM_IO_DIRECT.
+int gm_stream_open(struct gm_stream *stream, int fd, const struct gm_io_policy *policy) {
+	size_t capacity = gm_io_buffer_size(policy, GM_STREAM_BUFFER_SIZE);
+
+	stream->fd     = fd;
+	stream->pos    = 0;
+	stream->used   = 0;
+	stream->direct = false;
+	stream->policy = policy;
+
+#if defined(O_DIRECT)
+	if (policy && (policy->flags & GM_IO_DIRECT)) {
+		const int flags = fcntl(fd, F_GETFL);
+		stream->direct = flags != -1 && (flags & O_DIRECT) != 0;
+	}
+#endif
+
+	if (stream->direct) {
+		capacity = (capacity + GM_IO_DIRECT_ALIGN - 1) / GM_IO_DIRECT_ALIGN * GM_IO_DIRECT_ALIGN;
+	}
+
+	stream->capacity = capacity;
+	stream->buf = gm_aligned_alloc(capacity);
+	if (!stream->buf) {
+		return -1;
+	}
+
+	return 0;
+}
+
+void gm_stream_close(struct gm_stream *stream) {
+	gm_aligned_free(stream->buf);
+	stream->buf      = NULL;
+	stream->capacity = 0;
+	stream->used     = 0;
+}
+
+int gm_stream_flush(struct gm_stream *stream) {
+	size_t size = stream->used;
+
+	if (stream->direct) {
+		size -= size % GM_IO_DIRECT_ALIGN;
+	}
+
+	if (size > 0) {
+		if (gm_write_all(stream->fd, stream->buf, size) != 0) {
+			return -1;
+		}
+		memmove(stream->buf, stream->buf + size, stream->used - size);
+		stream->used -= size;
+	}
+
+	return 0;
+}
+
+// Writes out everything that is still buffered. An O_DIRECT stream is padded
+// to the alignment and then truncated to its real size.
+int gm_stream_finish(struct gm_stream *stream) {
+	if (!stream->direct) {
+		return gm_stream_flush(stream);
+	}
+
+	const off_t size = stream->pos;
+	const size_t padding = (GM_IO_DIRECT_ALIGN - stream->used % GM_IO_DIRECT_ALIGN) % GM_IO_DIRECT_ALIGN;
+
+	memset(stream->buf + stream->used, 0, padding);
+	stream->used += padding;
+
+	if (gm_stream_flush(stream) != 0) {
+		return -1;
+	}
+
+	return padding > 0 ? gm_truncate(stream->fd, size) : 0;
+}
+
+int gm_stream_write(struct gm_stream *stream, const void *data, size_t size) {
+	const uint8_t *ptr = data;
+
+	if (!stream->direct && size > stream->capacity - stream->used) {
+		if (gm_stream_flush(stream) != 0) {
+			return -1;
+		}
+
+		if (size > stream->capacity) {
+			if (gm_write_all(stream->fd, data, size) != 0) {
+				return -1;
+			}
+			stream->pos += size;
+			return 0;
+		}
+	}
+
+	while (size > 0) {
+		if (stream->used == stream->capacity && gm_stream_flush(stream) != 0) {
+			return -1;
+		}
+
+		size_t chunk_size = stream->capacity - stream->used;
+		if (chunk_size > size) {
+			chunk_size = size;
+		}
+
+		memcpy(stream->buf + stream->used, ptr, chunk_size);
+		stream->used += chunk_size;
+		stream->pos  += chunk_size;
+		ptr  += chunk_size;
+		size -= chunk_size;
+	}
+
+	return 0;
+}
+
+int gm_stream_zero(struct gm_stream *stream, size_t size) {
+	while (size > 0) {
+		if (stream->used == stream->capacity && gm_stream_flush(stream) != 0) {
+			return -1;
+		}
+
+		size_t chunk_size = stream->capacity - stream->used;
+		if (chunk_size > size) {
+			chunk_size = size;
+		}
+
+		memset(stream->buf + stream->used, 0, chunk_size);
+		stream->used += chunk_size;
+		stream->pos  += chunk_size;
+		size -= chunk_size;
+	}
+
+	return 0;
+}
+
+int gm_stream_copy(struct gm_stream *stream, int srcfd, off_t srcoff, size_t size) {
+	if (stream->direct) {
+		// the kernel can't be asked to copy into an O_DIRECT file
+		while (size > 0) {
+			if (stream->used == stream->capacity && gm_stream_flush(stream) != 0) {
+				return -1;
+			}
+
+			size_t chunk_size = stream->capacity - stream->used;
+			if (chunk_size > size) {
+				chunk_size = size;
+			}
+
+			if (gm_pread_all(srcfd, stream->buf + stream->used, chunk_size, srcoff) != 0) {
+				return -1;
+			}
+
+			stream->used += chunk_size;
+			stream->pos  += chunk_size;
+			srcoff += chunk_size;
+			size   -= chunk_size;
+		}
+
+		return 0;
+	}
+
+	if (gm_stream_flush(stream) != 0) {
+		return -1;
+	}
+
+	if (gm_stream_range(srcfd, srcoff, stream->fd, size, stream->policy, NULL) != 0) {
+		return -1;
+	}
+
+	stream->pos += size;
+
+	return 0;
+}
+
+// Like memmove() inside of one file: overlapping ranges are copied in the
+// direction that doesn't overwrite data before it is read.
+int gm_move_range(int fd, off_t srcoff, off_t dstoff, size_t size, const struct gm_io_policy *policy) {
+	if (srcoff == dstoff || size == 0) {
+		return 0;
+	}
+
+	size_t bufsize = gm_io_buffer_size(policy, GM_COPY_BUFFER_SIZE);
+	if (bufsize > size) {
+		bufsize = size;
+	}
+	uint8_t *buf = malloc(bufsize);
+
+	if (!buf) {
+		return -1;
+	}
+
+	const bool backwards = dstoff > srcoff;
+	size_t remaining = size;
+
+	while (remaining > 0) {
+		size_t chunk_size = remaining < bufsize ? remaining : bufsize;
+		off_t  chunk_offset = backwards ? (off_t)(remaining - chunk_size) : (off_t)(size - remaining);
+
+		if (gm_pread_all(fd, buf, chunk_size, srcoff + chunk_offset) != 0 ||
+		    gm_pwrite_all(fd, buf, chunk_size, dstoff + chunk_offset) != 0) {
+			int errnum = errno;
+			free(buf);
+			errno = errnum;
+			return -1;
+		}
+
+		remaining -= chunk_size;
+	}
+
+	free(buf);
+
+	return 0;
+}
+
+// Reserves disk space for a file that is about to be filled out of order
+// and sets its size. Failing to reserve space is not an error.
+int gm_preallocate(int fd, off_t size) {
+#if defined(__linux__)
+	int errnum = posix_fallocate(fd, 0, size);
+	if (errnum != 0 && errnum != EINVAL && errnum != EOPNOTSUPP && errnum != ENOSYS) {
+		errno = errnum;
+		return -1;
+	}
+#endif
+
+	return gm_truncate(fd, size);
+}
+
+size_t gm_cpu_count(void) {
+#if defined(GM_IO_WINDOWS)
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwNumberOfProcessors > 0 ? info.dwNumberOfProcessors : 1;
+#elif defined(_SC_NPROCESSORS_ONLN)
+	long count = sysconf(_SC_NPROCESSORS_ONLN);
+	return count > 0 ? (size_t)count : 1;
+#else
+	return 1;
+#endif
+}
+
+// Runs worker on the calling thread and on up to threads - 1 additional ones
+// and waits for all of them to finish.
+void gm_run_workers(void *(*worker)(void *arg), void *arg, size_t threads) {
+#if defined(GM_IO_THREADS)
+	pthread_t *workers = threads > 1 ? calloc(threads - 1, sizeof(pthread_t)) : NULL;
+	size_t started = 0;
+
+	if (workers) {
+		for (; started < threads - 1; ++ started) {
+			if (pthread_create(&workers[started], NULL, worker, arg) != 0) {
+				// carry on with what we've got
+				break;
+			}
+		}
+	}
+
+	worker(arg);
+
+	for (size_t i = 0; i < started; ++ i) {
+		pthread_join(workers[i], NULL);
+	}
+	free(workers);
+#else
+	(void)threads;
+	worker(arg);
+#endif
+}
+
+int gm_truncate(int fd, off_t size) {
+#if defined(GM_IO_WINDOWS)
+	int errnum = _chsize_s(fd, size);
+	if (errnum != 0) {
+		errno = errnum;
+		return -1;
+	}
+	return 0;
+#else
+	return ftruncate(fd, size);
+#endif
+}
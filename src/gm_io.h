@@ -0,0 +1,89 @@
+#ifndef GM_IO_H
+#define GM_IO_H
+#pragma once
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum gm_copy_method {
+	GM_COPY_NONE = 0,
+	GM_COPY_CLONE,
+	GM_COPY_FILE_RANGE,
+	GM_COPY_URING,
+	GM_COPY_SENDFILE,
+	GM_COPY_READ_WRITE
+};
+
+#define GM_COPY_BUFFER_SIZE   (1024 * 1024)
+#define GM_STREAM_BUFFER_SIZE (64 * 1024)
+#define GM_IO_DIRECT_ALIGN    4096
+
+enum gm_io_flags {
+	GM_IO_SEQUENTIAL = 1 << 0, // the source is read front to back once
+	GM_IO_WILLNEED   = 1 << 1, // prefetch the whole source
+	GM_IO_DONTNEED   = 1 << 2, // drop source and output from the page cache when done
+	GM_IO_DIRECT     = 1 << 3  // write new archives with O_DIRECT
+};
+
+// How files are read and written. A NULL policy means the defaults.
+struct gm_io_policy {
+	size_t buffer_size; // for copies through userspace, 0 = default
+	int    flags;
+};
+
+#define GM_IO_POLICY_INIT { 0, GM_IO_SEQUENTIAL }
+
+// command line options parsed by gm_parse_io_option()
+#define GM_IO_OPTIONS_USAGE "[--buffer-size=N[K|M]] [--no-fadvise] [--willneed] [--dontneed] [--direct]"
+
+// Forward-only output to a file descriptor, which may be a pipe or socket.
+// Small writes are collected in buf, bulk data is handed to the kernel.
+struct gm_stream {
+	int      fd;
+	off_t    pos;
+	size_t   used;
+	size_t   capacity;
+	uint8_t *buf;
+	bool     direct;
+
+	const struct gm_io_policy *policy;
+};
+
+size_t      gm_io_buffer_size(const struct gm_io_policy *policy, size_t default_size);
+void        gm_io_advise(int fd, const struct gm_io_policy *policy);
+void        gm_io_release(int fd, bool written, const struct gm_io_policy *policy);
+int         gm_parse_io_option(const char *arg, struct gm_io_policy *policy);
+int         gm_copy_range(int srcfd, off_t srcoff, int dstfd, off_t dstoff, size_t size,
+                          const struct gm_io_policy *policy, enum gm_copy_method *method);
+int         gm_pcopy_range(int srcfd, off_t srcoff, int dstfd, off_t dstoff, size_t size,
+                           const struct gm_io_policy *policy, enum gm_copy_method *method);
+const char *gm_copy_method_name(enum gm_copy_method method);
+int         gm_move_range(int fd, off_t srcoff, off_t dstoff, size_t size, const struct gm_io_policy *policy);
+int         gm_truncate(int fd, off_t size);
+int         gm_preallocate(int fd, off_t size);
+size_t      gm_cpu_count(void);
+void        gm_run_workers(void *(*worker)(void *arg), void *arg, size_t threads);
+int         gm_pread_all(int fd, void *buf, size_t size, off_t offset);
+int         gm_pwrite_all(int fd, const void *buf, size_t size, off_t offset);
+int         gm_write_all(int fd, const void *buf, size_t size);
+int         gm_stream_range(int srcfd, off_t srcoff, int dstfd, size_t size,
+                            const struct gm_io_policy *policy, enum gm_copy_method *method);
+int         gm_stream_open(struct gm_stream *stream, int fd, const struct gm_io_policy *policy);
+void        gm_stream_close(struct gm_stream *stream);
+int         gm_stream_write(struct gm_stream *stream, const void *data, size_t size);
+int         gm_stream_zero(struct gm_stream *stream, size_t size);
+int         gm_stream_copy(struct gm_stream *stream, int srcfd, off_t srcoff, size_t size);
+int         gm_stream_flush(struct gm_stream *stream);
+int         gm_stream_finish(struct gm_stream *stream);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,216 @@
+#include "game_maker.h"
+#include "png_info.h"
+#include "png_decode.h"
+#include "png_encode.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define LOG_ERR(FMT, ...) fprintf(stderr, "*** ERROR: " FMT "\n", ## __VA_ARGS__)
+#define LOG_ERR_MSG(MSG)  fprintf(stderr, "*** ERROR: " MSG "\n")
+
+// Texture optimizer
+//
+// Every PNG in TXTR with 8 bit samples is decoded and encoded again as small
+// as possible (see optimize_png_mem()). Pages that get smaller are turned
+// into GM_TXTR patches, so the archive is rewritten by the normal patch
+// planner.
+
+struct gm_optimize_phase {
+	const struct gm_archive *archive;
+	const struct gm_index   *txtr;
+	struct gm_optimized     *optimized;
+	bool                     reduce;
+	size_t                   encode_threads; // per page
+
+	atomic_size_t next;
+	atomic_int    errnum;
+};
+
+static int gm_optimize_page(const struct gm_optimize_phase *phase, size_t index) {
+	struct gm_txtr_optimization *page = &phase->optimized->pages[index];
+	struct png_image image = { 0, 0, NULL };
+	struct png_info info;
+	uint8_t *data = NULL;
+	size_t size = 0;
+	int status = 0;
+
+	page->old_size = page->new_size = phase->txtr->sizes[index];
+
+	if (phase->txtr->types[index] != GM_PNG) {
+		return 0;
+	}
+
+	// decode_png_mem() narrows 16 bit samples to 8 bits, so only pages with
+	// 8 bit samples can be encoded again without losing anything
+	if (parse_png_header_mem(phase->archive->data + phase->txtr->offsets[index], page->old_size, &info) == 0 &&
+	    info.bitdepth != 8) {
+		return 0;
+	}
+
+	if (gm_decode_txtr(phase->archive, phase->txtr, index, &image) != 0) {
+		goto error;
+	}
+
+	if (optimize_png_mem(&image, phase->reduce, phase->encode_threads, &data, &size) != 0) {
+		int errnum = errno;
+		LOG_ERR("texture %" PRIuPTR ": error encoding PNG: %s", index, strerror(errnum));
+		errno = errnum;
+		goto error;
+	}
+
+	if (size < page->old_size) {
+		page->new_size = size;
+		page->data     = data;
+		page->width    = image.width;
+		page->height   = image.height;
+		data = NULL;
+	}
+
+	goto end;
+
+error:
+	status = -1;
+
+end:
+	{
+		int errnum = errno;
+		free(data);
+		free_png_image(&image);
+		errno = errnum;
+	}
+
+	return status;
+}
+
+static void *gm_optimize_worker(void *arg) {
+	struct gm_optimize_phase *phase = arg;
+
+	while (atomic_load(&phase->errnum) == 0) {
+		size_t index = atomic_fetch_add(&phase->next, 1);
+		if (index >= phase->optimized->page_count) {
+			break;
+		}
+
+		if (gm_optimize_page(phase, index) != 0) {
+			int expected = 0;
+			atomic_compare_exchange_strong(&phase->errnum, &expected, errno ? errno : EINVAL);
+		}
+	}
+
+	return NULL;
+}
+
+// Re-encodes all textures of the loaded TXTR section of index, using up to
+// threads threads (0 = one per CPU). With reduce textures may be stored
+// with fewer channels or as palette images when that loses nothing.
+// optimized->pages has the outcome for every texture and
+// optimized->patches replaces the ones that got smaller.
+int gm_optimize_textures(const struct gm_archive *archive, struct gm_index *index, bool reduce,
+                         size_t threads, struct gm_optimized *optimized) {
+	struct gm_optimize_phase phase;
+	int status = 0;
+
+	memset(optimized, 0, sizeof(*optimized));
+	memset(&phase, 0, sizeof(phase));
+
+	const struct gm_index *txtr = gm_find_section(index, GM_TXTR);
+	if (!txtr || !txtr->loaded) {
+		LOG_ERR_MSG("game archive has no texture section");
+
+		errno = EINVAL;
+		goto error;
+	}
+
+	optimized->page_count = txtr->entry_count;
+	optimized->pages = calloc(txtr->entry_count + 1, sizeof(struct gm_txtr_optimization));
+	if (!optimized->pages) {
+		goto error;
+	}
+
+	phase.archive   = archive;
+	phase.txtr      = txtr;
+	phase.optimized = optimized;
+	phase.reduce    = reduce;
+
+	if (threads == 0) {
+		threads = gm_cpu_count();
+	}
+
+	// threads that don't get a page of their own help encoding
+	phase.encode_threads = threads > txtr->entry_count && txtr->entry_count > 0 ? threads / txtr->entry_count : 1;
+
+	if (threads > txtr->entry_count) {
+		threads = txtr->entry_count > 0 ? txtr->entry_count : 1;
+	}
+
+	atomic_init(&phase.next, 0);
+	atomic_init(&phase.errnum, 0);
+
+	gm_run_workers(gm_optimize_worker, &phase, threads);
+
+	int errnum = atomic_load(&phase.errnum);
+	if (errnum != 0) {
+		errno = errnum;
+		goto error;
+	}
+
+	size_t patch_count = 0;
+	for (size_t i = 0; i < optimized->page_count; ++ i) {
+		if (optimized->pages[i].data) {
+			++ patch_count;
+		}
+	}
+
+	optimized->patches = calloc(patch_count + 1, sizeof(struct gm_patch));
+	if (!optimized->patches) {
+		goto error;
+	}
+
+	struct gm_patch *patch = optimized->patches;
+	for (size_t i = 0; i < optimized->page_count; ++ i) {
+		const struct gm_txtr_optimization *page = &optimized->pages[i];
+		if (page->data) {
+			patch->section          = GM_TXTR;
+			patch->index            = i;
+			patch->type             = GM_PNG;
+			patch->patch_src        = GM_SRC_MEM;
+			patch->size             = page->new_size;
+			patch->src.data         = page->data;
+			patch->meta.txtr.width  = page->width;
+			patch->meta.txtr.height = page->height;
+			++ patch;
+		}
+	}
+	patch->section = GM_END;
+
+	goto end;
+
+error:
+	status = -1;
+	{
+		int errnum = errno;
+		gm_free_optimized(optimized);
+		errno = errnum;
+	}
+
+end:
+	return status;
+}
+
+void gm_free_optimized(struct gm_optimized *optimized) {
+	if (optimized->pages) {
+		for (size_t i = 0; i < optimized->page_count; ++ i) {
+			free(optimized->pages[i].data);
+		}
+	}
+	free(optimized->pages);
+	free(optimized->patches);
+
+	optimized->pages      = NULL;
+	optimized->patches    = NULL;
+	optimized->page_count = 0;
+}
@@ -1,40 +1,69 @@
 #include "game_maker.h"
 
 #include <stdio.h>
+#include <string.h>
 
 int main(int argc, char *argv[]) {
 	int status = 0;
-	FILE *game = NULL;
+	struct gm_archive *game = NULL;
 	struct gm_index *index = NULL;
 	const char *outdir = ".";
 	const char *gamename = NULL;
+	struct gm_io_policy io = GM_IO_POLICY_INIT;
+	int flags = GM_ARCHIVE_LAZY;
+	int argind = 1;
 
-	if (argc < 2) {
-		fprintf(stderr, "*** usage: %s archive [outdir]\n", argc < 1 ? "gmdump" : argv[0]);
+	for (; argind < argc && strncmp(argv[argind], "--", 2) == 0; ++ argind) {
+		if (strcmp(argv[argind], "--verify") == 0) {
+			flags |= GM_ARCHIVE_VERIFY_PNG;
+			continue;
+		}
+
+		if (strcmp(argv[argind], "--serial") == 0) {
+			flags |= GM_ARCHIVE_SERIAL;
+			continue;
+		}
+
+		int io_option = gm_parse_io_option(argv[argind], &io);
+		if (io_option == 0) {
+			fprintf(stderr, "*** ERROR: unknown option: %s\n", argv[argind]);
+			goto error;
+		}
+		else if (io_option < 0) {
+			fprintf(stderr, "*** ERROR: illegal value: %s\n", argv[argind]);
+			goto error;
+		}
+	}
+
+	if (argc - argind < 1) {
+		fprintf(stderr, "*** usage: %s [--verify] [--serial] " GM_IO_OPTIONS_USAGE " archive [outdir]\n", argc < 1 ? "gmdump" : argv[0]);
 		goto error;
 	}
 
-	if (argc > 2) {
-		outdir = argv[2];
+	if (argc - argind > 1) {
+		outdir = argv[argind + 1];
 	}
 
-	gamename = argv[1];
+	gamename = argv[argind];
 
 	printf("Reading archive...\n");
-	game = fopen(gamename, "rb");
+	game = gm_open_archive(gamename, flags, &io);
 	if (!game) {
 		perror(gamename);
 		goto error;
 	}
 
-	index = gm_read_index(game);
+	// verifying means not trusting a cache either
+	index = flags & GM_ARCHIVE_VERIFY_PNG ?
+		gm_read_archive_index(game) :
+		gm_read_archive_index_cached(game, gamename);
 	if (!index) {
 		perror(gamename);
 		goto error;
 	}
 
 	printf("Dumping files...\n");
-	if (gm_dump_files(index, game, outdir) != 0) {
+	if (gm_dump_archive_files(index, game, outdir) != 0) {
 		perror(gamename);
 		goto error;
 	}
@@ -48,7 +77,7 @@ error:
 
 end:
 	if (game) {
-		fclose(game);
+		gm_close_archive(game);
 		game = NULL;
 	}
 
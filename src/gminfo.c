@@ -1,8 +1,34 @@
 #include "game_maker.h"
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Number of TPAG regions on each texture page.
+static size_t *gm_count_regions(const struct gm_index *index, size_t txtr_count) {
+	size_t *regions = calloc(txtr_count + 1, sizeof(size_t));
+	if (!regions) {
+		return NULL;
+	}
+
+	for (; index->section != GM_END; ++ index) {
+		if (index->section == GM_TPAG && index->tpag) {
+			const struct gm_tpag_table *tpag = index->tpag;
+			for (size_t row = 0; row < tpag->count; ++ row) {
+				if (tpag->txtr_index[row] < txtr_count) {
+					++ regions[tpag->txtr_index[row]];
+				}
+			}
+		}
+	}
+
+	return regions;
+}
+
+static int gm_print_info(const struct gm_index *index, FILE *out) {
+	const struct gm_index *start = index;
+	size_t *regions = NULL;
 
-static void gm_print_info(const struct gm_index *index, FILE *out) {
 	fprintf(out, "Offset       Size             Type      Index Info\n");
 	for (; index->section != GM_END; ++ index) {
 		fprintf(out, "0x%010" PRIXPTR " 0x%010" PRIXPTR " --- %-9s -----",
@@ -13,19 +39,27 @@ static void gm_print_info(const struct gm_index *index, FILE *out) {
 		switch (index->section) {
 			case GM_AUDO:
 			case GM_TXTR:
+				if (index->section == GM_TXTR) {
+					free(regions);
+					regions = gm_count_regions(start, index->entry_count);
+					if (!regions) {
+						return -1;
+					}
+				}
+
 				fprintf(out, " %" PRIuPTR " entries\n", index->entry_count);
 				for (size_t entry_index = 0; entry_index < index->entry_count; ++ entry_index) {
-					const struct gm_entry *entry = &index->entries[entry_index];
-					fprintf(out, "0x%010" PRIXPTR " 0x%010" PRIXPTR "     %-9s %5" PRIuPTR,
-						(size_t)entry->offset,
-						entry->size,
-						gm_typename(entry->type),
+					fprintf(out, "0x%010" PRIX32 " 0x%010" PRIX32 "     %-9s %5" PRIuPTR,
+						index->offsets[entry_index],
+						index->sizes[entry_index],
+						gm_typename(index->types[entry_index]),
 						entry_index);
 
 					if (index->section == GM_TXTR) {
-						fprintf(out, " %4" PRIuPTR " x %-4" PRIuPTR,
-							entry->meta.txtr.width,
-							entry->meta.txtr.height);
+						fprintf(out, " %4" PRIu32 " x %-4" PRIu32 " %5" PRIuPTR " regions",
+							index->meta.txtr[entry_index].width,
+							index->meta.txtr[entry_index].height,
+							regions[entry_index]);
 					}
 					fprintf(out, "\n");
 				}
@@ -36,34 +70,124 @@ static void gm_print_info(const struct gm_index *index, FILE *out) {
 				break;
 		}
 	}
+
+	free(regions);
+
+	return 0;
+}
+
+static int gm_print_sprite(struct gm_index *index, const char *name, FILE *out) {
+	const struct gm_sprt_meta *sprite = gm_find_sprite(index, name);
+	if (!sprite) {
+		fprintf(stderr, "*** ERROR: sprite not found: %s\n", name);
+		return -1;
+	}
+
+	const struct gm_index *section = gm_find_section(index, GM_SPRT);
+	const struct gm_tpag_table *tpag = section->tpag;
+
+	fprintf(out, "Name    %s\n", sprite->name);
+	fprintf(out, "Frames  %" PRIu32 "\n", sprite->frame_count);
+	fprintf(out, "Frame Texture     X     Y Width Height\n");
+	for (size_t frame = 0; frame < sprite->frame_count; ++ frame) {
+		const size_t row = section->frames[sprite->first_frame + frame];
+		fprintf(out, "%5" PRIuPTR " %7u %5u %5u %5u %6u\n",
+			frame,
+			tpag->txtr_index[row],
+			tpag->x[row],
+			tpag->y[row],
+			tpag->width[row],
+			tpag->height[row]);
+	}
+
+	return 0;
 }
 
 int main(int argc, char *argv[]) {
 	int status = 0;
-	FILE *game = NULL;
+	struct gm_archive *game = NULL;
 	struct gm_index *index = NULL;
 	const char *gamename = NULL;
+	const char *sprite = NULL;
+	struct gm_io_policy io = GM_IO_POLICY_INIT;
+	int flags = GM_ARCHIVE_LAZY;
+	int argind = 1;
+
+	for (; argind < argc && strncmp(argv[argind], "--", 2) == 0; ++ argind) {
+		if (strcmp(argv[argind], "--verify") == 0) {
+			flags |= GM_ARCHIVE_VERIFY_PNG;
+			continue;
+		}
 
-	if (argc < 2) {
-		fprintf(stderr, "*** usage: %s archive\n", argc < 1 ? "gminfo" : argv[0]);
+		if (strcmp(argv[argind], "--serial") == 0) {
+			flags |= GM_ARCHIVE_SERIAL;
+			continue;
+		}
+
+		if (strcmp(argv[argind], "--sprite") == 0) {
+			if (argind + 1 >= argc) {
+				fprintf(stderr, "*** ERROR: missing value: %s\n", argv[argind]);
+				goto error;
+			}
+			sprite = argv[++ argind];
+			continue;
+		}
+
+		int io_option = gm_parse_io_option(argv[argind], &io);
+		if (io_option == 0) {
+			fprintf(stderr, "*** ERROR: unknown option: %s\n", argv[argind]);
+			goto error;
+		}
+		else if (io_option < 0) {
+			fprintf(stderr, "*** ERROR: illegal value: %s\n", argv[argind]);
+			goto error;
+		}
+	}
+
+	if (argc - argind < 1) {
+		fprintf(stderr, "*** usage: %s [--verify] [--serial] [--sprite NAME] " GM_IO_OPTIONS_USAGE " archive\n", argc < 1 ? "gminfo" : argv[0]);
 		goto error;
 	}
 
-	gamename = argv[1];
+	gamename = argv[argind];
 
-	game = fopen(gamename, "rb");
+	game = gm_open_archive(gamename, flags, &io);
 	if (!game) {
 		perror(gamename);
 		goto error;
 	}
 
-	index = gm_read_index(game);
+	// verifying means not trusting a cache either
+	index = flags & GM_ARCHIVE_VERIFY_PNG ?
+		gm_read_archive_index(game) :
+		gm_read_archive_index_cached(game, gamename);
 	if (!index) {
 		perror(gamename);
 		goto error;
 	}
 
-	gm_print_info(index, stdout);
+	if (sprite) {
+		if (gm_load_sections(game, index, (const enum gm_section[]){ GM_SPRT, GM_END }) != 0) {
+			perror(gamename);
+			goto error;
+		}
+
+		if (gm_print_sprite(index, sprite, stdout) != 0) {
+			goto error;
+		}
+
+		goto end;
+	}
+
+	if (gm_load_sections(game, index, (const enum gm_section[]){ GM_TPAG, GM_TXTR, GM_AUDO, GM_END }) != 0) {
+		perror(gamename);
+		goto error;
+	}
+
+	if (gm_print_info(index, stdout) != 0) {
+		perror(gamename);
+		goto error;
+	}
 
 	goto end;
 
@@ -72,7 +196,7 @@ error:
 
 end:
 	if (game) {
-		fclose(game);
+		gm_close_archive(game);
 		game = NULL;
 	}
 
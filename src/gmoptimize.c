@@ -0,0 +1,155 @@
+#include "game_maker.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef GM_WINDOWS
+#	include <io.h>
+#	include <fcntl.h>
+#endif
+
+static void gm_print_optimized(const struct gm_optimized *optimized, FILE *out) {
+	size_t old_total = 0;
+	size_t new_total = 0;
+
+	fprintf(out, "Texture   Old Size   New Size      Saved\n");
+	for (size_t index = 0; index < optimized->page_count; ++ index) {
+		const struct gm_txtr_optimization *page = &optimized->pages[index];
+		fprintf(out, "%7" PRIuPTR " %10" PRIuPTR " %10" PRIuPTR " %10" PRIuPTR "%s\n",
+			index, page->old_size, page->new_size, page->old_size - page->new_size,
+			page->data ? "" : " (kept)");
+
+		old_total += page->old_size;
+		new_total += page->new_size;
+	}
+
+	fprintf(out, "  Total %10" PRIuPTR " %10" PRIuPTR " %10" PRIuPTR "\n",
+		old_total, new_total, old_total - new_total);
+}
+
+int main(int argc, char *argv[]) {
+	int status = 0;
+	struct gm_archive *game = NULL;
+	struct gm_index *index = NULL;
+	struct gm_optimized optimized = { NULL, NULL, 0 };
+	const char *gamename = NULL;
+	struct gm_patch_options options = GM_PATCH_OPTIONS_INIT;
+	struct gm_io_policy io = GM_IO_POLICY_INIT;
+	bool reduce = true;
+	int argind = 1;
+
+	options.io = &io;
+
+	for (; argind < argc && strncmp(argv[argind], "--", 2) == 0; ++ argind) {
+		int option = gm_parse_io_option(argv[argind], &io);
+		if (option == 0) {
+			option = gm_parse_patch_option(argv[argind], &options);
+		}
+
+		if (option < 0) {
+			fprintf(stderr, "*** ERROR: illegal value: %s\n", argv[argind]);
+			goto error;
+		}
+		else if (option > 0) {
+			continue;
+		}
+
+		if (strcmp(argv[argind], "--no-reduce") == 0) {
+			reduce = false;
+		}
+		else {
+			fprintf(stderr, "*** ERROR: unknown option: %s\n", argv[argind]);
+			goto error;
+		}
+	}
+
+	if (argc - argind < 1) {
+		fprintf(stderr, "*** usage: %s " GM_PATCH_OPTIONS_USAGE " [--no-reduce] " GM_IO_OPTIONS_USAGE " archive\n",
+			argc < 1 ? "gmoptimize" : argv[0]);
+		goto error;
+	}
+
+	gamename = argv[argind];
+
+#ifdef GM_WINDOWS
+	if (options.mode == GM_PATCH_MODE_STREAM) {
+		_setmode(_fileno(stdout), _O_BINARY);
+	}
+#endif
+
+	// the archive itself (or the plan) might be written to stdout
+	FILE *report = options.mode == GM_PATCH_MODE_COPY || options.mode == GM_PATCH_MODE_IN_PLACE ? stdout : stderr;
+
+	game = gm_open_archive(gamename, GM_ARCHIVE_LAZY, &io);
+	if (!game) {
+		perror(gamename);
+		goto error;
+	}
+
+	index = gm_read_archive_index_cached(game, gamename);
+	if (!index) {
+		perror(gamename);
+		goto error;
+	}
+
+	if (gm_load_sections(game, index, (const enum gm_section[]){ GM_TXTR, GM_END }) != 0) {
+		perror(gamename);
+		goto error;
+	}
+
+	if (gm_optimize_textures(game, index, reduce, options.threads, &optimized) != 0) {
+		fprintf(stderr, "*** ERROR: Error optimizing textures: %s\n", strerror(errno));
+		goto error;
+	}
+
+	// patching opens the archive again
+	gm_close_archive(game);
+	game = NULL;
+
+	gm_free_index(index);
+	index = NULL;
+
+	gm_print_optimized(&optimized, report);
+
+	if (optimized.patches[0].section == GM_END && options.mode != GM_PATCH_MODE_STREAM) {
+		fprintf(report, "No texture got any smaller, the archive stays as it is.\n");
+		goto end;
+	}
+
+	if (gm_patch_archive(gamename, optimized.patches, &options) != 0) {
+		fprintf(stderr, "*** ERROR: Error patching archive: %s\n", strerror(errno));
+		goto error;
+	}
+
+	if (options.mode != GM_PATCH_MODE_PLAN) {
+		fprintf(report, "Successfully optimized game.\n");
+	}
+
+	goto end;
+
+error:
+	status = 1;
+
+end:
+	if (game) {
+		gm_close_archive(game);
+		game = NULL;
+	}
+
+	if (index) {
+		gm_free_index(index);
+		index = NULL;
+	}
+
+	gm_free_optimized(&optimized);
+
+#ifdef GM_WINDOWS
+	printf("Press ENTER to continue...");
+	getchar();
+#endif
+
+	return status;
+}
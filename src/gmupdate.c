@@ -1,32 +1,72 @@
 #include "game_maker.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <unistd.h>
+
+#ifdef GM_WINDOWS
+#	include <io.h>
+#	include <fcntl.h>
+#endif
 
 int main(int argc, char *argv[]) {
 	int status = 0;
 	const char *indir = ".";
 	const char *gamename = NULL;
+	struct gm_patch_options options = GM_PATCH_OPTIONS_INIT;
+	struct gm_io_policy io = GM_IO_POLICY_INIT;
+	int argind = 1;
+
+	options.io = &io;
+
+	for (; argind < argc && strncmp(argv[argind], "--", 2) == 0; ++ argind) {
+		int option = gm_parse_io_option(argv[argind], &io);
+		if (option == 0) {
+			option = gm_parse_patch_option(argv[argind], &options);
+		}
+
+		if (option < 0) {
+			fprintf(stderr, "*** ERROR: illegal value: %s\n", argv[argind]);
+			goto error;
+		}
+		else if (option > 0) {
+			continue;
+		}
+
+		fprintf(stderr, "*** ERROR: unknown option: %s\n", argv[argind]);
+		goto error;
+	}
 
-	if (argc < 2) {
-		fprintf(stderr, "*** usage: %s archive [dir]\n", argc < 1 ? "gmupdate" : argv[0]);
+	if (argc - argind < 1) {
+		fprintf(stderr, "*** usage: %s " GM_PATCH_OPTIONS_USAGE " " GM_IO_OPTIONS_USAGE " archive [dir]\n",
+			argc < 1 ? "gmupdate" : argv[0]);
 		goto error;
 	}
 
-	if (argc > 2) {
-		indir = argv[2];
+	if (argc - argind > 1) {
+		indir = argv[argind + 1];
 	}
 
-	gamename = argv[1];
+	gamename = argv[argind];
+
+#ifdef GM_WINDOWS
+	if (options.mode == GM_PATCH_MODE_STREAM) {
+		_setmode(_fileno(stdout), _O_BINARY);
+	}
+#endif
 
 	// patch the archive
-	if (gm_patch_archive_from_dir(gamename, indir) != 0) {
+	if (gm_patch_archive_from_dir(gamename, indir, &options) != 0) {
 		fprintf(stderr, "*** ERROR: Error patching archive: %s\n", strerror(errno));
 		goto error;
 	}
 	
-	printf("Successfully pached game.\n");
+	// the archive itself (or the plan) might be written to stdout
+	if (options.mode != GM_PATCH_MODE_PLAN) {
+		fprintf(options.mode == GM_PATCH_MODE_STREAM ? stderr : stdout, "Successfully pached game.\n");
+	}
 
 	goto end;
 
@@ -0,0 +1,111 @@
+#include "gm_io.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+// Tests of the output stream: files that weren't opened with O_DIRECT (like
+// a pipe to stdout) must get exactly the data written to them, even with
+// GM_IO_DIRECT.
+
+#define TEST_SIZE 7713
+
+static int test_stream(const char *name, int fd, const struct gm_io_policy *policy) {
+	struct gm_stream stream;
+
+	if (gm_stream_open(&stream, fd, policy) != 0) {
+		fprintf(stderr, "%s: error opening stream: %s\n", name, strerror(errno));
+		return -1;
+	}
+
+	if (stream.direct) {
+		fprintf(stderr, "%s: stream uses O_DIRECT alignment for a file that wasn't opened with O_DIRECT\n", name);
+		gm_stream_close(&stream);
+		return -1;
+	}
+
+	uint8_t data[TEST_SIZE];
+	for (size_t i = 0; i < sizeof(data); ++ i) {
+		data[i] = (uint8_t)(i * 7 + 1);
+	}
+
+	int status = 0;
+	if (gm_stream_write(&stream, data, sizeof(data)) != 0 || gm_stream_finish(&stream) != 0) {
+		fprintf(stderr, "%s: error writing stream: %s\n", name, strerror(errno));
+		status = -1;
+	}
+
+	gm_stream_close(&stream);
+
+	return status;
+}
+
+static int test_pipe(const struct gm_io_policy *policy) {
+	const char *name = policy->flags & GM_IO_DIRECT ? "pipe with GM_IO_DIRECT" : "pipe";
+	uint8_t buffer[TEST_SIZE * 2];
+	size_t size = 0;
+	int fds[2];
+
+	// TEST_SIZE fits into the pipe buffer, so nobody has to read concurrently
+	if (pipe(fds) != 0) {
+		perror(name);
+		return -1;
+	}
+
+	if (test_stream(name, fds[1], policy) != 0) {
+		close(fds[0]);
+		close(fds[1]);
+		return -1;
+	}
+	close(fds[1]);
+
+	for (;;) {
+		ssize_t count = read(fds[0], buffer + size, sizeof(buffer) - size);
+		if (count < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror(name);
+			close(fds[0]);
+			return -1;
+		}
+		if (count == 0 || (size += count) == sizeof(buffer)) {
+			break;
+		}
+	}
+	close(fds[0]);
+
+	if (size != TEST_SIZE) {
+		fprintf(stderr, "%s: read %" PRIuPTR " bytes, expected %d\n", name, size, TEST_SIZE);
+		return -1;
+	}
+
+	for (size_t i = 0; i < size; ++ i) {
+		if (buffer[i] != (uint8_t)(i * 7 + 1)) {
+			fprintf(stderr, "%s: wrong data at offset %" PRIuPTR "\n", name, i);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+int main(void) {
+	struct gm_io_policy policy = GM_IO_POLICY_INIT;
+	size_t failed = 0;
+
+	if (test_pipe(&policy) != 0) {
+		++ failed;
+	}
+
+	policy.flags |= GM_IO_DIRECT;
+	if (test_pipe(&policy) != 0) {
+		++ failed;
+	}
+
+	printf("2 stream tests, %" PRIuPTR " failed\n", failed);
+
+	return failed ? 1 : 0;
+}
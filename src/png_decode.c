@@ -0,0 +1,683 @@
+#include "png_decode.h"
+#include "png_info.h"
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+
+#define ZLIB_CONST
+#include <zlib.h>
+
+// Sub, Average and Paeth depend on the pixel to the left, so only the
+// channels of one pixel can be reconstructed at once. Up works on whole
+// vectors.
+#if defined(__SSE2__) || defined(_M_X64)
+#	include <emmintrin.h>
+#	define PNG_SSE2
+#elif defined(__ARM_NEON)
+#	include <arm_neon.h>
+#	define PNG_NEON
+#endif
+
+#define PNG_U32BE(BUF) ( \
+	((uint32_t)((BUF)[0]) << 24) | \
+	((uint32_t)((BUF)[1]) << 16) | \
+	((uint32_t)((BUF)[2]) <<  8) | \
+	 (uint32_t)((BUF)[3]))
+
+#define PNG_U16BE(BUF) ( \
+	((uint32_t)((BUF)[0]) << 8) | \
+	 (uint32_t)((BUF)[1]))
+
+// See: http://www.libpng.org/pub/png/spec/1.2/PNG-Filters.html
+
+enum png_filter {
+	PNG_FILTER_NONE  = 0,
+	PNG_FILTER_SUB   = 1,
+	PNG_FILTER_UP    = 2,
+	PNG_FILTER_AVG   = 3,
+	PNG_FILTER_PAETH = 4
+};
+
+struct png_pass {
+	uint32_t x;
+	uint32_t y;
+	uint32_t dx;
+	uint32_t dy;
+};
+
+static const struct png_pass PNG_PROGRESSIVE[] = {
+	{ 0, 0, 1, 1 }
+};
+
+static const struct png_pass PNG_ADAM7[] = {
+	{ 0, 0, 8, 8 },
+	{ 4, 0, 8, 8 },
+	{ 0, 4, 4, 8 },
+	{ 2, 0, 4, 4 },
+	{ 0, 2, 2, 4 },
+	{ 1, 0, 2, 2 },
+	{ 0, 1, 1, 2 }
+};
+
+struct png_decoder {
+	z_stream        zs;
+	const uint8_t  *data;
+	size_t          size;
+	size_t          next_chunk; // the IDAT chunk that is inflated next
+	struct png_info info;
+	unsigned        channels;
+	unsigned        bpp;        // bytes per pixel, but at least 1
+	bool            has_key;
+	uint32_t        key[3];     // tRNS of grayscale and RGB images
+	size_t          palette_size;
+	uint8_t         palette[256 * 4];
+};
+
+static void png_unfilter_sub(uint8_t *row, size_t size, unsigned bpp) {
+	for (size_t i = bpp; i < size; ++ i) {
+		row[i] += row[i - bpp];
+	}
+}
+
+static void png_unfilter_up(uint8_t *row, const uint8_t *prev, size_t size) {
+	for (size_t i = 0; i < size; ++ i) {
+		row[i] += prev[i];
+	}
+}
+
+static void png_unfilter_avg(uint8_t *row, const uint8_t *prev, size_t size, unsigned bpp) {
+	for (size_t i = 0; i < bpp && i < size; ++ i) {
+		row[i] += prev[i] >> 1;
+	}
+
+	for (size_t i = bpp; i < size; ++ i) {
+		row[i] += ((unsigned)row[i - bpp] + prev[i]) >> 1;
+	}
+}
+
+static void png_unfilter_paeth(uint8_t *row, const uint8_t *prev, size_t size, unsigned bpp) {
+	for (size_t i = 0; i < bpp && i < size; ++ i) {
+		row[i] += prev[i];
+	}
+
+	for (size_t i = bpp; i < size; ++ i) {
+		const int a = row[i - bpp];
+		const int b = prev[i];
+		const int c = prev[i - bpp];
+		const int pa = abs(b - c);
+		const int pb = abs(a - c);
+		const int pc = abs(a + b - 2 * c);
+
+		row[i] += pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+	}
+}
+
+#if defined(PNG_SSE2)
+
+#define PNG_SIMD
+
+static inline __m128i png_load_pixel(const uint8_t *ptr, unsigned bpp) {
+	uint32_t value = 0;
+	memcpy(&value, ptr, bpp);
+	return _mm_cvtsi32_si128((int)value);
+}
+
+static inline void png_store_pixel(uint8_t *ptr, __m128i pixel, unsigned bpp) {
+	const uint32_t value = (uint32_t)_mm_cvtsi128_si32(pixel);
+	memcpy(ptr, &value, bpp);
+}
+
+static void png_unfilter_up_simd(uint8_t *row, const uint8_t *prev, size_t size) {
+	size_t i = 0;
+
+	for (; i + 16 <= size; i += 16) {
+		const __m128i x = _mm_loadu_si128((const __m128i*)(row + i));
+		const __m128i b = _mm_loadu_si128((const __m128i*)(prev + i));
+		_mm_storeu_si128((__m128i*)(row + i), _mm_add_epi8(x, b));
+	}
+
+	png_unfilter_up(row + i, prev + i, size - i);
+}
+
+static inline void png_unfilter_sub_simd(uint8_t *row, size_t size, unsigned bpp) {
+	__m128i a = _mm_setzero_si128();
+
+	for (size_t i = 0; i < size; i += bpp) {
+		a = _mm_add_epi8(png_load_pixel(row + i, bpp), a);
+		png_store_pixel(row + i, a, bpp);
+	}
+}
+
+static inline void png_unfilter_avg_simd(uint8_t *row, const uint8_t *prev, size_t size, unsigned bpp) {
+	const __m128i ones = _mm_set1_epi8(1);
+	__m128i a = _mm_setzero_si128();
+
+	for (size_t i = 0; i < size; i += bpp) {
+		const __m128i b = png_load_pixel(prev + i, bpp);
+		// _mm_avg_epu8() rounds up, the filter rounds down
+		const __m128i avg = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), ones));
+		a = _mm_add_epi8(png_load_pixel(row + i, bpp), avg);
+		png_store_pixel(row + i, a, bpp);
+	}
+}
+
+static inline __m128i png_abs_epi16(__m128i x) {
+	return _mm_max_epi16(x, _mm_sub_epi16(_mm_setzero_si128(), x));
+}
+
+static inline __m128i png_select(__m128i mask, __m128i a, __m128i b) {
+	return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+// The predictor is calculated in 16-bit lanes, where a + b - c can't overflow.
+static inline void png_unfilter_paeth_simd(uint8_t *row, const uint8_t *prev, size_t size, unsigned bpp) {
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i mask = _mm_set1_epi16(0xFF);
+	__m128i a = zero;
+	__m128i c = zero;
+
+	for (size_t i = 0; i < size; i += bpp) {
+		const __m128i b = _mm_unpacklo_epi8(png_load_pixel(prev + i, bpp), zero);
+		const __m128i x = _mm_unpacklo_epi8(png_load_pixel(row  + i, bpp), zero);
+
+		// pa = |b - c|, pb = |a - c|, pc = |a + b - 2c|
+		__m128i pa = _mm_sub_epi16(b, c);
+		__m128i pb = _mm_sub_epi16(a, c);
+		__m128i pc = png_abs_epi16(_mm_add_epi16(pa, pb));
+		pa = png_abs_epi16(pa);
+		pb = png_abs_epi16(pb);
+
+		const __m128i smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+		const __m128i nearest  = png_select(_mm_cmpeq_epi16(smallest, pa), a,
+		                         png_select(_mm_cmpeq_epi16(smallest, pb), b, c));
+
+		a = _mm_and_si128(_mm_add_epi16(x, nearest), mask);
+		png_store_pixel(row + i, _mm_packus_epi16(a, a), bpp);
+		c = b;
+	}
+}
+
+#elif defined(PNG_NEON)
+
+#define PNG_SIMD
+
+static inline uint8x8_t png_load_pixel(const uint8_t *ptr, unsigned bpp) {
+	uint32_t value = 0;
+	memcpy(&value, ptr, bpp);
+	return vreinterpret_u8_u32(vdup_n_u32(value));
+}
+
+static inline void png_store_pixel(uint8_t *ptr, uint8x8_t pixel, unsigned bpp) {
+	const uint32_t value = vget_lane_u32(vreinterpret_u32_u8(pixel), 0);
+	memcpy(ptr, &value, bpp);
+}
+
+static void png_unfilter_up_simd(uint8_t *row, const uint8_t *prev, size_t size) {
+	size_t i = 0;
+
+	for (; i + 16 <= size; i += 16) {
+		vst1q_u8(row + i, vaddq_u8(vld1q_u8(row + i), vld1q_u8(prev + i)));
+	}
+
+	png_unfilter_up(row + i, prev + i, size - i);
+}
+
+static inline void png_unfilter_sub_simd(uint8_t *row, size_t size, unsigned bpp) {
+	uint8x8_t a = vdup_n_u8(0);
+
+	for (size_t i = 0; i < size; i += bpp) {
+		a = vadd_u8(png_load_pixel(row + i, bpp), a);
+		png_store_pixel(row + i, a, bpp);
+	}
+}
+
+static inline void png_unfilter_avg_simd(uint8_t *row, const uint8_t *prev, size_t size, unsigned bpp) {
+	uint8x8_t a = vdup_n_u8(0);
+
+	for (size_t i = 0; i < size; i += bpp) {
+		// vhadd_u8() rounds down, just like the filter
+		a = vadd_u8(png_load_pixel(row + i, bpp), vhadd_u8(a, png_load_pixel(prev + i, bpp)));
+		png_store_pixel(row + i, a, bpp);
+	}
+}
+
+// pc is narrowed with saturation, which doesn't change any of the comparisons
+// because pa and pb are at most 255.
+static inline void png_unfilter_paeth_simd(uint8_t *row, const uint8_t *prev, size_t size, unsigned bpp) {
+	uint8x8_t a = vdup_n_u8(0);
+	uint8x8_t c = vdup_n_u8(0);
+
+	for (size_t i = 0; i < size; i += bpp) {
+		const uint8x8_t b = png_load_pixel(prev + i, bpp);
+
+		const uint8x8_t pa = vabd_u8(b, c);
+		const uint8x8_t pb = vabd_u8(a, c);
+		const uint8x8_t pc = vqmovn_u16(vabdq_u16(vaddl_u8(a, b), vaddl_u8(c, c)));
+
+		const uint8x8_t use_a = vand_u8(vcle_u8(pa, pb), vcle_u8(pa, pc));
+		const uint8x8_t use_b = vcle_u8(pb, pc);
+
+		a = vadd_u8(png_load_pixel(row + i, bpp), vbsl_u8(use_a, a, vbsl_u8(use_b, b, c)));
+		png_store_pixel(row + i, a, bpp);
+		c = b;
+	}
+}
+
+#endif
+
+// prev is the previous reconstructed row of the same pass, zeros for the
+// first one.
+static int png_unfilter(uint8_t filter, uint8_t *row, const uint8_t *prev, size_t size, unsigned bpp) {
+#if defined(PNG_SIMD)
+	// specialized for RGB and RGBA with 8 bits per channel
+	switch (filter) {
+		case PNG_FILTER_NONE:
+			return 0;
+
+		case PNG_FILTER_SUB:
+			if (bpp == 4) png_unfilter_sub_simd(row, size, 4);
+			else if (bpp == 3) png_unfilter_sub_simd(row, size, 3);
+			else png_unfilter_sub(row, size, bpp);
+			return 0;
+
+		case PNG_FILTER_UP:
+			png_unfilter_up_simd(row, prev, size);
+			return 0;
+
+		case PNG_FILTER_AVG:
+			if (bpp == 4) png_unfilter_avg_simd(row, prev, size, 4);
+			else if (bpp == 3) png_unfilter_avg_simd(row, prev, size, 3);
+			else png_unfilter_avg(row, prev, size, bpp);
+			return 0;
+
+		case PNG_FILTER_PAETH:
+			if (bpp == 4) png_unfilter_paeth_simd(row, prev, size, 4);
+			else if (bpp == 3) png_unfilter_paeth_simd(row, prev, size, 3);
+			else png_unfilter_paeth(row, prev, size, bpp);
+			return 0;
+	}
+#else
+	switch (filter) {
+		case PNG_FILTER_NONE:
+			return 0;
+
+		case PNG_FILTER_SUB:
+			png_unfilter_sub(row, size, bpp);
+			return 0;
+
+		case PNG_FILTER_UP:
+			png_unfilter_up(row, prev, size);
+			return 0;
+
+		case PNG_FILTER_AVG:
+			png_unfilter_avg(row, prev, size, bpp);
+			return 0;
+
+		case PNG_FILTER_PAETH:
+			png_unfilter_paeth(row, prev, size, bpp);
+			return 0;
+	}
+#endif
+
+	errno = EINVAL;
+	return -1;
+}
+
+static inline uint32_t png_sample(const uint8_t *row, size_t index, unsigned depth) {
+	switch (depth) {
+		case 16:
+			return PNG_U16BE(row + index * 2);
+
+		case 8:
+			return row[index];
+
+		default:
+		{
+			const size_t bit = index * depth;
+			return (row[bit / 8] >> (8 - depth - bit % 8)) & ((1u << depth) - 1);
+		}
+	}
+}
+
+// Converts count pixels of an unfiltered row to RGBA, step bytes apart.
+static void png_expand_row(const struct png_decoder *dec, const uint8_t *row, size_t count, uint8_t *out, size_t step) {
+	const unsigned depth    = dec->info.bitdepth;
+	const unsigned channels = dec->channels;
+	const unsigned shift    = depth == 16 ? 8 : 0;
+
+	for (size_t i = 0; i < count; ++ i, out += step) {
+		uint32_t s[4];
+		for (unsigned channel = 0; channel < channels; ++ channel) {
+			s[channel] = png_sample(row, i * channels + channel, depth);
+		}
+
+		switch (dec->info.colortype) {
+			case 0:
+				// scale 1, 2 and 4 bit values to the full range
+				out[0] = out[1] = out[2] = depth < 8 ? s[0] * (255 / ((1u << depth) - 1)) : s[0] >> shift;
+				out[3] = dec->has_key && s[0] == dec->key[0] ? 0 : 255;
+				break;
+
+			case 2:
+				out[0] = s[0] >> shift;
+				out[1] = s[1] >> shift;
+				out[2] = s[2] >> shift;
+				out[3] = dec->has_key && s[0] == dec->key[0] && s[1] == dec->key[1] && s[2] == dec->key[2] ? 0 : 255;
+				break;
+
+			case 3:
+				memcpy(out, dec->palette + s[0] * 4, 4);
+				break;
+
+			case 4:
+				out[0] = out[1] = out[2] = s[0] >> shift;
+				out[3] = s[1] >> shift;
+				break;
+
+			case 6:
+				out[0] = s[0] >> shift;
+				out[1] = s[1] >> shift;
+				out[2] = s[2] >> shift;
+				out[3] = s[3] >> shift;
+				break;
+		}
+	}
+}
+
+static int png_check_format(struct png_decoder *dec) {
+	const unsigned depth = dec->info.bitdepth;
+
+	switch (dec->info.colortype) {
+		case 0: dec->channels = 1; break;
+		case 2: dec->channels = 3; break;
+		case 3: dec->channels = 1; break;
+		case 4: dec->channels = 2; break;
+		case 6: dec->channels = 4; break;
+	}
+
+	if ((dec->info.colortype == 3 && depth > 8) ||
+	    (dec->info.colortype != 0 && dec->info.colortype != 3 && depth < 8)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	dec->bpp = dec->channels * depth < 8 ? 1 : dec->channels * depth / 8;
+
+	return 0;
+}
+
+// The chunk layout was already checked by parse_png_info_mem().
+static int png_read_chunks(struct png_decoder *dec) {
+	const uint8_t *data = dec->data;
+
+	for (size_t index = 0; index < 256; ++ index) {
+		memcpy(dec->palette + index * 4, "\0\0\0\xFF", 4);
+	}
+
+	for (size_t offset = PNG_HEAD_SIZE; offset + 12 <= dec->size; ) {
+		const uint32_t length = PNG_U32BE(data + offset);
+		const uint8_t *magic  = data + offset + 4;
+		const uint8_t *body   = data + offset + 8;
+
+		if (memcmp(magic, "IDAT", 4) == 0) {
+			if (dec->next_chunk == 0) {
+				dec->next_chunk = offset;
+			}
+		}
+		else if (memcmp(magic, "PLTE", 4) == 0) {
+			if (length % 3 != 0 || length > 256 * 3) {
+				errno = EINVAL;
+				return -1;
+			}
+
+			dec->palette_size = length / 3;
+			for (size_t index = 0; index < dec->palette_size; ++ index) {
+				memcpy(dec->palette + index * 4, body + index * 3, 3);
+			}
+		}
+		else if (memcmp(magic, "tRNS", 4) == 0) {
+			if (dec->info.colortype == 3) {
+				for (size_t index = 0; index < length && index < 256; ++ index) {
+					dec->palette[index * 4 + 3] = body[index];
+				}
+			}
+			else if (dec->info.colortype == 0 && length >= 2) {
+				dec->has_key = true;
+				dec->key[0]  = PNG_U16BE(body);
+			}
+			else if (dec->info.colortype == 2 && length >= 6) {
+				dec->has_key = true;
+				dec->key[0]  = PNG_U16BE(body);
+				dec->key[1]  = PNG_U16BE(body + 2);
+				dec->key[2]  = PNG_U16BE(body + 4);
+			}
+		}
+		else if (memcmp(magic, "IEND", 4) == 0) {
+			break;
+		}
+
+		offset += (size_t)length + 12;
+	}
+
+	if (dec->next_chunk == 0 || (dec->info.colortype == 3 && dec->palette_size == 0)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return 0;
+}
+
+// Hands the next non-empty IDAT chunk to zlib. They are inflated right where
+// they are, so a PNG in a mapped file is never copied.
+static int png_next_idat(struct png_decoder *dec) {
+	while (dec->next_chunk + 12 <= dec->size && memcmp(dec->data + dec->next_chunk + 4, "IDAT", 4) == 0) {
+		const uint32_t length = PNG_U32BE(dec->data + dec->next_chunk);
+
+		dec->zs.next_in  = dec->data + dec->next_chunk + 8;
+		dec->zs.avail_in = length;
+		dec->next_chunk += (size_t)length + 12;
+
+		if (length > 0) {
+			return 0;
+		}
+	}
+
+	// the image data ends before the image does
+	errno = EINVAL;
+	return -1;
+}
+
+static int png_inflate(struct png_decoder *dec, uint8_t *out, size_t size) {
+	while (size > 0) {
+		if (dec->zs.avail_in == 0 && png_next_idat(dec) != 0) {
+			return -1;
+		}
+
+		const uInt avail = size > UINT_MAX ? UINT_MAX : (uInt)size;
+		dec->zs.next_out  = out;
+		dec->zs.avail_out = avail;
+
+		const int status = inflate(&dec->zs, Z_SYNC_FLUSH);
+		const size_t count = avail - dec->zs.avail_out;
+		out  += count;
+		size -= count;
+
+		if (status == Z_STREAM_END) {
+			if (size > 0) {
+				errno = EINVAL;
+				return -1;
+			}
+			break;
+		}
+
+		// Z_BUF_ERROR only means that the current IDAT chunk is used up
+		if (status != Z_OK && status != Z_BUF_ERROR) {
+			errno = status == Z_MEM_ERROR ? ENOMEM : EINVAL;
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static size_t png_row_size(const struct png_decoder *dec, size_t width) {
+	return (width * dec->channels * dec->info.bitdepth + 7) / 8;
+}
+
+// 8-bit RGBA is what TXTR sections contain, those rows are inflated and
+// unfiltered right in the output.
+static int png_decode_rgba8(struct png_decoder *dec, struct png_image *image, const uint8_t *zeros) {
+	const size_t stride = (size_t)image->width * 4;
+	const uint8_t *prev = zeros;
+	uint8_t *row = image->pixels;
+
+	for (uint32_t y = 0; y < image->height; ++ y) {
+		uint8_t filter = 0;
+
+		if (png_inflate(dec, &filter, 1) != 0 ||
+		    png_inflate(dec, row, stride) != 0 ||
+		    png_unfilter(filter, row, prev, stride, 4) != 0) {
+			return -1;
+		}
+
+		prev = row;
+		row += stride;
+	}
+
+	return 0;
+}
+
+// rows has space for two rows of the full image width, including the filter
+// type byte.
+static int png_decode_pass(struct png_decoder *dec, struct png_image *image, const struct png_pass *pass, uint8_t *rows) {
+	const size_t width  = image->width;
+	const size_t height = image->height;
+	const size_t pass_width  = width  > pass->x ? (width  - pass->x + pass->dx - 1) / pass->dx : 0;
+	const size_t pass_height = height > pass->y ? (height - pass->y + pass->dy - 1) / pass->dy : 0;
+
+	// empty passes have no filter type bytes either
+	if (pass_width == 0 || pass_height == 0) {
+		return 0;
+	}
+
+	const size_t size = png_row_size(dec, pass_width);
+	uint8_t *prev = rows;
+	uint8_t *cur  = rows + png_row_size(dec, width) + 1;
+
+	memset(prev, 0, size + 1);
+
+	for (size_t y = 0; y < pass_height; ++ y) {
+		if (png_inflate(dec, cur, size + 1) != 0 ||
+		    png_unfilter(cur[0], cur + 1, prev + 1, size, dec->bpp) != 0) {
+			return -1;
+		}
+
+		uint8_t *out = image->pixels + ((pass->y + y * pass->dy) * width + pass->x) * 4;
+		png_expand_row(dec, cur + 1, pass_width, out, (size_t)pass->dx * 4);
+
+		uint8_t *tmp = prev;
+		prev = cur;
+		cur  = tmp;
+	}
+
+	return 0;
+}
+
+// Decodes any PNG to 8-bit RGBA. 16-bit channels are cut down to their high
+// byte, transparency from tRNS chunks is applied, CRCs aren't checked.
+int decode_png_mem(const uint8_t *data, size_t size, struct png_image *image) {
+	struct png_decoder dec;
+	uint8_t *pixels = NULL;
+	uint8_t *rows = NULL;
+	bool inflating = false;
+	int status = 0;
+
+	memset(&dec, 0, sizeof(dec));
+	dec.data = data;
+
+	if (parse_png_info_mem(data, size, &dec.info) != 0) {
+		goto error;
+	}
+	dec.size = dec.info.filesize;
+
+	if (png_check_format(&dec) != 0 || png_read_chunks(&dec) != 0) {
+		goto error;
+	}
+
+	const size_t width  = dec.info.width;
+	const size_t height = dec.info.height;
+
+	if ((width  != 0 && height > SIZE_MAX / 4 / width) ||
+	    (width > (SIZE_MAX - 8) / 64)) {
+		errno = ENOMEM;
+		goto error;
+	}
+
+	pixels = malloc(width * height * 4 > 0 ? width * height * 4 : 1);
+	if (!pixels) {
+		goto error;
+	}
+
+	const size_t row_size = png_row_size(&dec, width);
+	rows = calloc(2, row_size + 1);
+	if (!rows) {
+		goto error;
+	}
+
+	if (inflateInit(&dec.zs) != Z_OK) {
+		errno = ENOMEM;
+		goto error;
+	}
+	inflating = true;
+
+	struct png_image result = { dec.info.width, dec.info.height, pixels };
+
+	if (dec.info.colortype == 6 && dec.info.bitdepth == 8 && dec.info.interlace == 0) {
+		if (png_decode_rgba8(&dec, &result, rows) != 0) {
+			goto error;
+		}
+	}
+	else {
+		const struct png_pass *passes = dec.info.interlace ? PNG_ADAM7 : PNG_PROGRESSIVE;
+		const size_t pass_count = dec.info.interlace ?
+			sizeof(PNG_ADAM7) / sizeof(PNG_ADAM7[0]) :
+			sizeof(PNG_PROGRESSIVE) / sizeof(PNG_PROGRESSIVE[0]);
+
+		for (size_t index = 0; index < pass_count; ++ index) {
+			if (png_decode_pass(&dec, &result, &passes[index], rows) != 0) {
+				goto error;
+			}
+		}
+	}
+
+	*image = result;
+	pixels = NULL;
+
+	goto end;
+
+error:
+	status = -1;
+
+end:
+	{
+		int errnum = errno;
+		if (inflating) {
+			inflateEnd(&dec.zs);
+		}
+		free(rows);
+		free(pixels);
+		errno = errnum;
+	}
+
+	return status;
+}
+
+void free_png_image(struct png_image *image) {
+	if (image) {
+		free(image->pixels);
+		image->pixels = NULL;
+	}
+}
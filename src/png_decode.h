@@ -0,0 +1,26 @@
+#ifndef PNG_DECODE_H
+#define PNG_DECODE_H
+#pragma once
+
+#include <stddef.h>
+#include <inttypes.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// 8-bit RGBA, rows top to bottom without any padding in between.
+struct png_image {
+	uint32_t width;
+	uint32_t height;
+	uint8_t *pixels;
+};
+
+int  decode_png_mem(const uint8_t *data, size_t size, struct png_image *image);
+void free_png_image(struct png_image *image);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
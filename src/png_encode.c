@@ -0,0 +1,675 @@
+#include "png_encode.h"
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <stdatomic.h>
+
+#include "gm_io.h"
+
+#define ZLIB_CONST
+#include <zlib.h>
+
+// compressed image data per IDAT chunk
+#define PNG_IDAT_SIZE (1024 * 1024)
+
+// filtered image data compressed as a unit, see encode_png_mem()
+#define PNG_DEFLATE_BLOCK_SIZE (128 * 1024)
+#define PNG_DEFLATE_WINDOW     (32 * 1024)
+
+#define PNG_WRITE_U32BE(BUF,N) { \
+	(BUF)[0] = ((uint32_t)(N) >> 24) & 0xFF; \
+	(BUF)[1] = ((uint32_t)(N) >> 16) & 0xFF; \
+	(BUF)[2] = ((uint32_t)(N) >>  8) & 0xFF; \
+	(BUF)[3] =  (uint32_t)(N)        & 0xFF; \
+}
+
+enum png_color_type {
+	PNG_GRAY       = 0,
+	PNG_RGB        = 2,
+	PNG_PALETTE    = 3,
+	PNG_GRAY_ALPHA = 4,
+	PNG_RGBA       = 6
+};
+
+// Scanlines in one of the formats PNG can store, 8 bits per sample.
+struct png_raw {
+	uint32_t       width;
+	uint32_t       height;
+	uint8_t        color_type;
+	size_t         bpp;          // bytes per pixel
+	const uint8_t *pixels;       // rows of width * bpp bytes without padding
+	const uint8_t *palette;      // PNG_PALETTE: RGBA, entries that aren't opaque first
+	size_t         palette_size;
+};
+
+enum png_filter {
+	PNG_FILTER_NONE  = 0,
+	PNG_FILTER_SUB   = 1,
+	PNG_FILTER_UP    = 2,
+	PNG_FILTER_AVG   = 3,
+	PNG_FILTER_PAETH = 4
+};
+
+static inline unsigned png_predict(enum png_filter filter, unsigned a, unsigned b, unsigned c) {
+	switch (filter) {
+		case PNG_FILTER_SUB:
+			return a;
+
+		case PNG_FILTER_UP:
+			return b;
+
+		case PNG_FILTER_AVG:
+			return (a + b) >> 1;
+
+		case PNG_FILTER_PAETH:
+		{
+			const int pa = abs((int)b - (int)c);
+			const int pb = abs((int)a - (int)c);
+			const int pc = abs((int)a + (int)b - 2 * (int)c);
+			return pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+		}
+
+		default:
+			return 0;
+	}
+}
+
+// Filters a row of pixels with bpp bytes each into out (filter type byte
+// first) and returns the sum of the filtered bytes taken as signed values.
+static inline uint64_t png_filter_row(enum png_filter filter, const uint8_t *row, const uint8_t *prev,
+                                      size_t size, size_t bpp, uint8_t *out) {
+	uint64_t sum = 0;
+
+	out[0] = filter;
+	for (size_t i = 0; i < size; ++ i) {
+		const unsigned a = i >= bpp ? row[i - bpp]  : 0;
+		const unsigned c = i >= bpp ? prev[i - bpp] : 0;
+		const uint8_t value = (uint8_t)(row[i] - png_predict(filter, a, prev[i], c));
+
+		out[i + 1] = value;
+		sum += value < 128 ? value : 256 - value;
+	}
+
+	return sum;
+}
+
+// Uses the filter with the smallest sum of absolute values, like libpng.
+// best and other both have space for a filtered row, the filtered row ends
+// up in best.
+static void png_filter_best(const uint8_t *row, const uint8_t *prev, size_t size, size_t bpp,
+                            uint8_t *best, uint8_t *other) {
+	uint64_t min_sum = png_filter_row(PNG_FILTER_NONE, row, prev, size, bpp, best);
+
+	static const enum png_filter filters[] = { PNG_FILTER_SUB, PNG_FILTER_UP, PNG_FILTER_AVG, PNG_FILTER_PAETH };
+	for (size_t index = 0; index < sizeof(filters) / sizeof(filters[0]); ++ index) {
+		const uint64_t sum = png_filter_row(filters[index], row, prev, size, bpp, other);
+		if (sum < min_sum) {
+			min_sum = sum;
+			memcpy(best, other, size + 1);
+		}
+	}
+}
+
+static uint8_t *png_write_chunk(uint8_t *ptr, const char *magic, const uint8_t *body, size_t size) {
+	PNG_WRITE_U32BE(ptr, size);
+	memcpy(ptr + 4, magic, 4);
+	if (size > 0 && body != ptr + 8) {
+		memmove(ptr + 8, body, size);
+	}
+
+	const uLong crc = crc32(crc32(0, ptr + 4, 4), ptr + 8, (uInt)size);
+	PNG_WRITE_U32BE(ptr + 8 + size, crc);
+
+	return ptr + 12 + size;
+}
+
+// The same header zlib's deflate() writes for these settings.
+static unsigned png_zlib_header(int level) {
+	const unsigned flags =
+		level == Z_DEFAULT_COMPRESSION ? 2 :
+		level < 2  ? 0 :
+		level < 6  ? 1 :
+		level == 6 ? 2 : 3;
+	const unsigned header = (Z_DEFLATED + (7 << 4)) << 8 | flags << 6;
+
+	return header + 31 - header % 31;
+}
+
+struct png_deflate_block {
+	uint8_t *data;
+	size_t   size;
+	uLong    adler; // of the uncompressed block
+};
+
+struct png_encode_phase {
+	const struct png_raw *raw;
+	int      level;
+	bool     adaptive; // pick a filter per row, otherwise don't filter at all
+	size_t   stride;
+	uint8_t *filtered;
+	size_t   filtered_size;
+
+	size_t rows_per_job;
+	size_t filter_jobs;
+
+	struct png_deflate_block *blocks;
+	size_t block_count;
+
+	atomic_size_t next;
+	atomic_int    errnum;
+};
+
+static void png_phase_error(struct png_encode_phase *phase, int errnum) {
+	int expected = 0;
+	atomic_compare_exchange_strong(&phase->errnum, &expected, errnum ? errnum : EINVAL);
+}
+
+static void *png_filter_worker(void *arg) {
+	struct png_encode_phase *phase = arg;
+	const size_t stride = phase->stride;
+	const size_t bpp    = phase->raw->bpp;
+	const uint8_t *pixels = phase->raw->pixels;
+
+	// filtered rows for the filters that don't win
+	uint8_t *other = malloc(stride + 1);
+	uint8_t *zeros = calloc(1, stride);
+	if (!other || !zeros) {
+		png_phase_error(phase, errno);
+	}
+
+	while (atomic_load(&phase->errnum) == 0) {
+		const size_t job = atomic_fetch_add(&phase->next, 1);
+		if (job >= phase->filter_jobs) {
+			break;
+		}
+
+		const size_t first = job * phase->rows_per_job;
+		const size_t end   = first + phase->rows_per_job < phase->raw->height ?
+		                     first + phase->rows_per_job : phase->raw->height;
+		for (size_t y = first; y < end; ++ y) {
+			const uint8_t *row  = pixels + y * stride;
+			const uint8_t *prev = y > 0 ? row - stride : zeros;
+			uint8_t *out = phase->filtered + y * (stride + 1);
+			if (phase->adaptive) {
+				png_filter_best(row, prev, stride, bpp, out, other);
+			}
+			else {
+				png_filter_row(PNG_FILTER_NONE, row, prev, stride, bpp, out);
+			}
+		}
+	}
+
+	free(zeros);
+	free(other);
+
+	return NULL;
+}
+
+// Compresses one block of the filtered image as raw deflate data. The block
+// is primed with the 32 KiB in front of it and ends with a sync flush (or
+// the final block), so the blocks can simply be concatenated.
+static int png_deflate_block(const struct png_encode_phase *phase, size_t index) {
+	struct png_deflate_block *block = &phase->blocks[index];
+	const size_t offset = index * PNG_DEFLATE_BLOCK_SIZE;
+	const size_t length = phase->filtered_size - offset < PNG_DEFLATE_BLOCK_SIZE ?
+	                      phase->filtered_size - offset : PNG_DEFLATE_BLOCK_SIZE;
+	const bool last = offset + length == phase->filtered_size;
+	const uint8_t *input = phase->filtered + offset;
+	z_stream zs;
+	int status = 0;
+
+	memset(&zs, 0, sizeof(zs));
+	int zstatus = deflateInit2(&zs, phase->level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+	if (zstatus != Z_OK) {
+		errno = zstatus == Z_MEM_ERROR ? ENOMEM : EINVAL;
+		return -1;
+	}
+
+	if (offset > 0) {
+		const size_t dict_size = offset < PNG_DEFLATE_WINDOW ? offset : PNG_DEFLATE_WINDOW;
+		if (deflateSetDictionary(&zs, input - dict_size, (uInt)dict_size) != Z_OK) {
+			errno = EINVAL;
+			goto error;
+		}
+	}
+
+	// room for the sync flush marker (an empty stored block)
+	size_t capacity = deflateBound(&zs, length) + 16;
+	block->data = malloc(capacity);
+	if (!block->data) {
+		goto error;
+	}
+
+	zs.next_in  = input;
+	zs.avail_in = (uInt)length;
+
+	for (;;) {
+		zs.next_out  = block->data + block->size;
+		zs.avail_out = (uInt)(capacity - block->size);
+
+		zstatus = deflate(&zs, last ? Z_FINISH : Z_SYNC_FLUSH);
+		if (zstatus == Z_STREAM_ERROR) {
+			errno = EINVAL;
+			goto error;
+		}
+
+		block->size = capacity - zs.avail_out;
+		if (last ? zstatus == Z_STREAM_END : zs.avail_in == 0 && zs.avail_out > 0) {
+			break;
+		}
+
+		uint8_t *data = realloc(block->data, capacity * 2);
+		if (!data) {
+			goto error;
+		}
+		block->data = data;
+		capacity *= 2;
+	}
+
+	block->adler = adler32(adler32(0, NULL, 0), input, (uInt)length);
+
+	goto end;
+
+error:
+	status = -1;
+
+end:
+	{
+		int errnum = errno;
+		deflateEnd(&zs);
+		errno = errnum;
+	}
+
+	return status;
+}
+
+static void *png_deflate_worker(void *arg) {
+	struct png_encode_phase *phase = arg;
+
+	while (atomic_load(&phase->errnum) == 0) {
+		const size_t index = atomic_fetch_add(&phase->next, 1);
+		if (index >= phase->block_count) {
+			break;
+		}
+
+		if (png_deflate_block(phase, index) != 0) {
+			png_phase_error(phase, errno);
+		}
+	}
+
+	return NULL;
+}
+
+static int png_run_phase(struct png_encode_phase *phase, void *(*worker)(void*), size_t jobs, size_t threads) {
+	atomic_store(&phase->next, 0);
+	gm_run_workers(worker, phase, threads < jobs ? threads : jobs);
+
+	const int errnum = atomic_load(&phase->errnum);
+	if (errnum != 0) {
+		errno = errnum;
+		return -1;
+	}
+
+	return 0;
+}
+
+// Like pigz the filtered image is cut into blocks of 128 KiB that are
+// filtered and compressed by up to threads threads (0 = one per CPU) and
+// then joined into one zlib stream. The output only depends on the pixels
+// and the settings, not on the number of threads.
+static int png_encode_raw(const struct png_raw *raw, int level, bool adaptive, size_t threads,
+                          uint8_t **data, size_t *size) {
+	struct png_encode_phase phase;
+	uint8_t *out = NULL;
+	int status = 0;
+
+	memset(&phase, 0, sizeof(phase));
+	atomic_init(&phase.next, 0);
+	atomic_init(&phase.errnum, 0);
+
+	const size_t width  = raw->width;
+	const size_t height = raw->height;
+
+	if (width == 0 || height == 0 || width > INT32_MAX || height > INT32_MAX) {
+		errno = EINVAL;
+		goto error;
+	}
+
+	if (width > (SIZE_MAX - 1) / 8 || height > SIZE_MAX / (width * raw->bpp + 1)) {
+		errno = ENOMEM;
+		goto error;
+	}
+
+	if (threads == 0) {
+		threads = gm_cpu_count();
+	}
+
+	phase.raw           = raw;
+	phase.level         = level;
+	phase.adaptive      = adaptive;
+	phase.stride        = width * raw->bpp;
+	phase.filtered_size = height * (phase.stride + 1);
+	phase.rows_per_job  = PNG_DEFLATE_BLOCK_SIZE / (phase.stride + 1) + 1;
+	phase.filter_jobs   = (height + phase.rows_per_job - 1) / phase.rows_per_job;
+	phase.block_count   = (phase.filtered_size + PNG_DEFLATE_BLOCK_SIZE - 1) / PNG_DEFLATE_BLOCK_SIZE;
+
+	phase.filtered = malloc(phase.filtered_size);
+	phase.blocks   = calloc(phase.block_count, sizeof(struct png_deflate_block));
+	if (!phase.filtered || !phase.blocks) {
+		goto error;
+	}
+
+	if (png_run_phase(&phase, png_filter_worker,  phase.filter_jobs, threads) != 0 ||
+	    png_run_phase(&phase, png_deflate_worker, phase.block_count, threads) != 0) {
+		goto error;
+	}
+
+	size_t zsize = 2 + 4;
+	for (size_t i = 0; i < phase.block_count; ++ i) {
+		zsize += phase.blocks[i].size;
+	}
+
+	size_t trns_size = 0;
+	if (raw->color_type == PNG_PALETTE) {
+		while (trns_size < raw->palette_size && raw->palette[trns_size * 4 + 3] != 0xFF) {
+			++ trns_size;
+		}
+	}
+
+	const size_t chunk_count = (zsize + PNG_IDAT_SIZE - 1) / PNG_IDAT_SIZE;
+	const size_t palette_chunks_size = raw->color_type != PNG_PALETTE ? 0 :
+		12 + raw->palette_size * 3 + (trns_size > 0 ? 12 + trns_size : 0);
+	const size_t out_size = 8 + 25 + palette_chunks_size + chunk_count * 12 + zsize + 12;
+
+	out = malloc(out_size);
+	if (!out) {
+		goto error;
+	}
+
+	uint8_t ihdr[13];
+	PNG_WRITE_U32BE(ihdr,     width);
+	PNG_WRITE_U32BE(ihdr + 4, height);
+	ihdr[8]  = 8; // bit depth
+	ihdr[9]  = raw->color_type;
+	ihdr[10] = 0; // deflate
+	ihdr[11] = 0; // adaptive filtering
+	ihdr[12] = 0; // not interlaced
+
+	memcpy(out, "\x89PNG\r\n\x1a\n", 8);
+	uint8_t *ptr = png_write_chunk(out + 8, "IHDR", ihdr, sizeof(ihdr));
+
+	if (raw->color_type == PNG_PALETTE) {
+		for (size_t i = 0; i < raw->palette_size; ++ i) {
+			memcpy(ptr + 8 + i * 3, raw->palette + i * 4, 3);
+		}
+		ptr = png_write_chunk(ptr, "PLTE", ptr + 8, raw->palette_size * 3);
+
+		if (trns_size > 0) {
+			for (size_t i = 0; i < trns_size; ++ i) {
+				ptr[8 + i] = raw->palette[i * 4 + 3];
+			}
+			ptr = png_write_chunk(ptr, "tRNS", ptr + 8, trns_size);
+		}
+	}
+
+	// the zlib stream is assembled where it ends up if there's only one
+	// IDAT chunk, otherwise the chunks are cut from the front, which only
+	// moves data towards the start of the buffer
+	uint8_t *zstream = ptr + 8 + (chunk_count - 1) * 12;
+	uint8_t *zptr = zstream;
+	const unsigned header = png_zlib_header(level);
+	zptr[0] = header >> 8;
+	zptr[1] = header & 0xFF;
+	zptr += 2;
+
+	uLong adler = adler32(0, NULL, 0);
+	size_t total = 0;
+	for (size_t i = 0; i < phase.block_count; ++ i) {
+		const size_t length = phase.filtered_size - total < PNG_DEFLATE_BLOCK_SIZE ?
+		                      phase.filtered_size - total : PNG_DEFLATE_BLOCK_SIZE;
+		memcpy(zptr, phase.blocks[i].data, phase.blocks[i].size);
+		zptr  += phase.blocks[i].size;
+		adler  = adler32_combine(adler, phase.blocks[i].adler, (z_off_t)length);
+		total += length;
+	}
+	PNG_WRITE_U32BE(zptr, adler);
+
+	for (size_t offset = 0; offset < zsize; offset += PNG_IDAT_SIZE) {
+		const size_t length = zsize - offset < PNG_IDAT_SIZE ? zsize - offset : PNG_IDAT_SIZE;
+		ptr = png_write_chunk(ptr, "IDAT", zstream + offset, length);
+	}
+
+	ptr = png_write_chunk(ptr, "IEND", NULL, 0);
+
+	*size = (size_t)(ptr - out);
+	*data = out;
+	out = NULL;
+
+	goto end;
+
+error:
+	status = -1;
+
+end:
+	{
+		int errnum = errno;
+		if (phase.blocks) {
+			for (size_t i = 0; i < phase.block_count; ++ i) {
+				free(phase.blocks[i].data);
+			}
+		}
+		free(phase.blocks);
+		free(phase.filtered);
+		free(out);
+		errno = errnum;
+	}
+
+	return status;
+}
+
+// Encodes 8-bit RGBA pixels as an RGBA PNG with the given zlib compression
+// level (Z_DEFAULT_COMPRESSION = -1, 0-9), see png_encode_raw() about
+// threads. *data has to be freed by the caller.
+int encode_png_mem(const struct png_image *image, int level, size_t threads, uint8_t **data, size_t *size) {
+	const struct png_raw raw = {
+		.width      = image->width,
+		.height     = image->height,
+		.color_type = PNG_RGBA,
+		.bpp        = 4,
+		.pixels     = image->pixels
+	};
+
+	return png_encode_raw(&raw, level, true, threads, data, size);
+}
+
+#define PNG_COLOR_SLOTS 1024
+
+// Distinct colors of an image, as long as there are at most 256.
+struct png_colors {
+	size_t   count;                  // 257 = too many
+	uint32_t keys[PNG_COLOR_SLOTS];  // RGBA bytes as they are in memory
+	uint16_t slots[PNG_COLOR_SLOTS]; // palette index + 1, 0 = empty
+	uint8_t  palette[256 * 4];
+};
+
+static inline size_t png_color_slot(const struct png_colors *colors, uint32_t key) {
+	size_t slot = (uint32_t)(key * UINT32_C(2654435761)) >> 22;
+	while (colors->slots[slot] != 0 && colors->keys[slot] != key) {
+		slot = (slot + 1) & (PNG_COLOR_SLOTS - 1);
+	}
+	return slot;
+}
+
+// Collects the colors of the image into a palette with the colors that
+// aren't opaque first, so tRNS can leave out the rest.
+static void png_collect_colors(const struct png_image *image, struct png_colors *colors) {
+	const size_t count = (size_t)image->width * image->height;
+	size_t opaque = 0;
+
+	memset(colors, 0, sizeof(*colors));
+
+	for (size_t i = 0; i < count; ++ i) {
+		uint32_t key;
+		memcpy(&key, image->pixels + i * 4, 4);
+
+		const size_t slot = png_color_slot(colors, key);
+		if (colors->slots[slot] == 0) {
+			if (colors->count == 256) {
+				colors->count = 257;
+				return;
+			}
+			colors->keys[slot]  = key;
+			colors->slots[slot] = (uint16_t)++ colors->count;
+			if (image->pixels[i * 4 + 3] == 0xFF) {
+				++ opaque;
+			}
+		}
+	}
+
+	size_t next_transparent = 0;
+	size_t next_opaque = colors->count - opaque;
+	for (size_t slot = 0; slot < PNG_COLOR_SLOTS; ++ slot) {
+		if (colors->slots[slot] != 0) {
+			uint8_t *entry = (uint8_t*)&colors->keys[slot];
+			const size_t index = entry[3] == 0xFF ? next_opaque ++ : next_transparent ++;
+			memcpy(colors->palette + index * 4, entry, 4);
+			colors->slots[slot] = (uint16_t)(index + 1);
+		}
+	}
+}
+
+// Picks the smallest of the lossless ways to store the image: with fewer
+// channels if it is gray or opaque and/or as a palette image if it has at
+// most 256 colors. Every candidate is compressed at level 9, once with a
+// filter picked per row and once unfiltered (usually better for palette
+// images). If reduce is false the image stays RGBA. *data has to be freed
+// by the caller.
+int optimize_png_mem(const struct png_image *image, bool reduce, size_t threads, uint8_t **data, size_t *size) {
+	struct png_colors *colors = NULL;
+	struct png_raw candidates[2];
+	uint8_t *buffers[2] = { NULL, NULL };
+	size_t candidate_count = 0;
+	uint8_t *best = NULL;
+	size_t best_size = 0;
+	int status = 0;
+
+	const size_t count = (size_t)image->width * image->height;
+
+	candidates[0].width        = image->width;
+	candidates[0].height       = image->height;
+	candidates[0].color_type   = PNG_RGBA;
+	candidates[0].bpp          = 4;
+	candidates[0].pixels       = image->pixels;
+	candidates[0].palette      = NULL;
+	candidates[0].palette_size = 0;
+	candidate_count = 1;
+
+	if (reduce) {
+		bool opaque = true;
+		bool gray   = true;
+		for (size_t i = 0; i < count && (opaque || gray); ++ i) {
+			const uint8_t *pixel = image->pixels + i * 4;
+			opaque = opaque && pixel[3] == 0xFF;
+			gray   = gray && pixel[0] == pixel[1] && pixel[1] == pixel[2];
+		}
+
+		if (gray || opaque) {
+			struct png_raw *raw = &candidates[0];
+			raw->color_type = gray ? (opaque ? PNG_GRAY : PNG_GRAY_ALPHA) : PNG_RGB;
+			raw->bpp        = gray ? (opaque ? 1 : 2) : 3;
+
+			uint8_t *pixels = buffers[0] = malloc(count * raw->bpp);
+			if (!pixels) {
+				goto error;
+			}
+
+			for (size_t i = 0; i < count; ++ i) {
+				const uint8_t *pixel = image->pixels + i * 4;
+				if (gray) {
+					*pixels ++ = pixel[0];
+				}
+				else {
+					memcpy(pixels, pixel, 3);
+					pixels += 3;
+				}
+				if (raw->bpp == 2) {
+					*pixels ++ = pixel[3];
+				}
+			}
+			raw->pixels = buffers[0];
+		}
+
+		colors = malloc(sizeof(struct png_colors));
+		if (!colors) {
+			goto error;
+		}
+
+		png_collect_colors(image, colors);
+
+		if (colors->count <= 256) {
+			struct png_raw *raw = &candidates[candidate_count ++];
+			raw->width        = image->width;
+			raw->height       = image->height;
+			raw->color_type   = PNG_PALETTE;
+			raw->bpp          = 1;
+			raw->palette      = colors->palette;
+			raw->palette_size = colors->count;
+
+			uint8_t *pixels = buffers[1] = malloc(count);
+			if (!pixels) {
+				goto error;
+			}
+
+			for (size_t i = 0; i < count; ++ i) {
+				uint32_t key;
+				memcpy(&key, image->pixels + i * 4, 4);
+				pixels[i] = (uint8_t)(colors->slots[png_color_slot(colors, key)] - 1);
+			}
+			raw->pixels = pixels;
+		}
+	}
+
+	for (size_t i = 0; i < candidate_count; ++ i) {
+		for (int adaptive = 1; adaptive >= 0; -- adaptive) {
+			uint8_t *candidate = NULL;
+			size_t candidate_size = 0;
+
+			if (png_encode_raw(&candidates[i], 9, adaptive, threads, &candidate, &candidate_size) != 0) {
+				goto error;
+			}
+
+			if (!best || candidate_size < best_size) {
+				free(best);
+				best      = candidate;
+				best_size = candidate_size;
+			}
+			else {
+				free(candidate);
+			}
+		}
+	}
+
+	*data = best;
+	*size = best_size;
+	best  = NULL;
+
+	goto end;
+
+error:
+	status = -1;
+
+end:
+	{
+		int errnum = errno;
+		free(best);
+		free(buffers[0]);
+		free(buffers[1]);
+		free(colors);
+		errno = errnum;
+	}
+
+	return status;
+}
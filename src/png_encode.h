@@ -0,0 +1,22 @@
+#ifndef PNG_ENCODE_H
+#define PNG_ENCODE_H
+#pragma once
+
+#include <stddef.h>
+#include <inttypes.h>
+#include <stdbool.h>
+
+#include "png_decode.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int encode_png_mem(const struct png_image *image, int level, size_t threads, uint8_t **data, size_t *size);
+int optimize_png_mem(const struct png_image *image, bool reduce, size_t threads, uint8_t **data, size_t *size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
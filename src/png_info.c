@@ -107,6 +107,8 @@
 #define PNG_IHDR_SIZE 25
 #define PNG_IEND_SIZE 12
 #define PNG_CHUNK_HEADER_SIZE 8
+#define PNG_IEND_CHUNK "\0\0\0\0IEND\xAE\x42\x60\x82"
+#define PNG_MAX_PADDING 4096
 
 // See: http://www.libpng.org/pub/png/spec/1.2/PNG-Structure.html
 
@@ -139,71 +141,92 @@ struct png_ihdr_chunk {
 };
 #pragma pack(pop)
 
-int parse_png_info(FILE *file, struct png_info *info) {
-	size_t filesize = 0;
-	char signature[PNG_SIGNATURE_SIZE];
+static int png_check_ihdr(struct png_ihdr_chunk *ihdr) {
+	ihdr->size   = be32toh(ihdr->size);
+	ihdr->width  = be32toh(ihdr->width);
+	ihdr->height = be32toh(ihdr->height);
+	ihdr->crc    = be32toh(ihdr->crc);
 
-	if (fread(signature, PNG_SIGNATURE_SIZE, 1, file) != 1) {
+	if (ihdr->size != 13) {
+		errno = EINVAL;
 		return -1;
 	}
 
-	if (memcmp(signature, PNG_SIGNATURE, PNG_SIGNATURE_SIZE) != 0) {
+	if (memcmp(ihdr->magic, "IHDR", 4) != 0) {
 		errno = EINVAL;
 		return -1;
 	}
 
-	struct png_ihdr_chunk ihdr;
-
-	if (fread(&ihdr, PNG_IHDR_SIZE, 1, file) != 1) {
+	if (ihdr->width > INT32_MAX || ihdr->height > INT32_MAX) {
+		errno = EINVAL;
 		return -1;
 	}
-
-	ihdr.size   = be32toh(ihdr.size);
-	ihdr.width  = be32toh(ihdr.width);
-	ihdr.height = be32toh(ihdr.height);
-	ihdr.crc    = be32toh(ihdr.crc);
-
-	if (ihdr.size != 13) {
+	
+	if (ihdr->bitdepth != 1 && ihdr->bitdepth != 2 &&
+		ihdr->bitdepth != 4 && ihdr->bitdepth != 8 &&
+		ihdr->bitdepth != 16) {
 		errno = EINVAL;
 		return -1;
 	}
-
-	if (memcmp(ihdr.magic, "IHDR", 4) != 0) {
+	
+	if (ihdr->colortype != 0 && ihdr->colortype != 2 &&
+		ihdr->colortype != 3 && ihdr->colortype != 4 &&
+		ihdr->colortype != 6) {
 		errno = EINVAL;
 		return -1;
 	}
 
-	filesize = PNG_SIGNATURE_SIZE + PNG_IHDR_SIZE;
-	
-	if (ihdr.width > INT32_MAX || ihdr.height > INT32_MAX) {
+	if (ihdr->compression != 0 || ihdr->filter != 0) {
 		errno = EINVAL;
 		return -1;
 	}
 	
-	if (ihdr.bitdepth != 1 && ihdr.bitdepth != 2 &&
-		ihdr.bitdepth != 4 && ihdr.bitdepth != 8 &&
-		ihdr.bitdepth != 16) {
+	if (ihdr->interlace != 0 && ihdr->interlace != 1) {
 		errno = EINVAL;
 		return -1;
 	}
-	
-	if (ihdr.colortype != 0 && ihdr.colortype != 2 &&
-		ihdr.colortype != 3 && ihdr.colortype != 4 &&
-		ihdr.colortype != 6) {
-		errno = EINVAL;
+
+	return 0;
+}
+
+static void png_fill_info(struct png_info *info, size_t filesize, const struct png_ihdr_chunk *ihdr) {
+	if (info) {
+		info->filesize    = filesize;
+		info->width       = ihdr->width;
+		info->height      = ihdr->height;
+		info->bitdepth    = ihdr->bitdepth;
+		info->colortype   = ihdr->colortype;
+		info->compression = ihdr->compression;
+		info->filter      = ihdr->filter;
+		info->interlace   = ihdr->interlace;
+	}
+}
+
+int parse_png_info(FILE *file, struct png_info *info) {
+	size_t filesize = 0;
+	char signature[PNG_SIGNATURE_SIZE];
+
+	if (fread(signature, PNG_SIGNATURE_SIZE, 1, file) != 1) {
 		return -1;
 	}
 
-	if (ihdr.compression != 0 || ihdr.filter != 0) {
+	if (memcmp(signature, PNG_SIGNATURE, PNG_SIGNATURE_SIZE) != 0) {
 		errno = EINVAL;
 		return -1;
 	}
-	
-	if (ihdr.interlace != 0 && ihdr.interlace != 1) {
-		errno = EINVAL;
+
+	struct png_ihdr_chunk ihdr;
+
+	if (fread(&ihdr, PNG_IHDR_SIZE, 1, file) != 1) {
+		return -1;
+	}
+
+	if (png_check_ihdr(&ihdr) != 0) {
 		return -1;
 	}
 
+	filesize = PNG_SIGNATURE_SIZE + PNG_IHDR_SIZE;
+
 	for (;;) {
 		struct png_chunk_header chunk_header;
 
@@ -231,21 +254,135 @@ int parse_png_info(FILE *file, struct png_info *info) {
 		}
 
 		if (memcmp(chunk_header.magic, "IEND", 4) == 0) {
+			break;
+		}
+	}
+
+	png_fill_info(info, filesize, &ihdr);
+
+	return 0;
+}
+
+int parse_png_info_mem(const uint8_t *data, size_t size, struct png_info *info) {
+	if (size < PNG_SIGNATURE_SIZE + PNG_IHDR_SIZE) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (memcmp(data, PNG_SIGNATURE, PNG_SIGNATURE_SIZE) != 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	struct png_ihdr_chunk ihdr;
+	memcpy(&ihdr, data + PNG_SIGNATURE_SIZE, PNG_IHDR_SIZE);
+
+	if (png_check_ihdr(&ihdr) != 0) {
+		return -1;
+	}
+
+	size_t filesize = PNG_SIGNATURE_SIZE + PNG_IHDR_SIZE;
+
+	for (;;) {
+		struct png_chunk_header chunk_header;
+
+		// 12 = sizeof(size + magic + crc)
+		if (size - filesize < 12) {
 			errno = EINVAL;
+			return -1;
+		}
+
+		memcpy(&chunk_header, data + filesize, PNG_CHUNK_HEADER_SIZE);
+		chunk_header.size = be32toh(chunk_header.size);
+
+		if (!IS_PNG_CHUNK_MAGIC(chunk_header.magic)) {
+			errno = EINVAL;
+			return -1;
+		}
+
+		if (chunk_header.size > size - filesize - 12) {
+			errno = EINVAL;
+			return -1;
+		}
+		filesize += chunk_header.size + 12;
+
+		if (memcmp(chunk_header.magic, "IEND", 4) == 0) {
 			break;
 		}
 	}
 
-	if (info) {
-		info->filesize    = filesize;
-		info->width       = ihdr.width;
-		info->height      = ihdr.height;
-		info->bitdepth    = ihdr.bitdepth;
-		info->colortype   = ihdr.colortype;
-		info->compression = ihdr.compression;
-		info->filter      = ihdr.filter;
-		info->interlace   = ihdr.interlace;
+	png_fill_info(info, filesize, &ihdr);
+
+	return 0;
+}
+
+// Like parse_png_info_mem(), but instead of walking all chunks this only
+// checks the header and searches the IEND chunk backwards from the end of
+// data. Use it when data ends with the PNG plus maybe a few padding bytes.
+int parse_png_header_mem(const uint8_t *data, size_t size, struct png_info *info) {
+	if (size < PNG_SIGNATURE_SIZE + PNG_IHDR_SIZE + PNG_IEND_SIZE) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (memcmp(data, PNG_SIGNATURE, PNG_SIGNATURE_SIZE) != 0) {
+		errno = EINVAL;
+		return -1;
 	}
 
+	struct png_ihdr_chunk ihdr;
+	memcpy(&ihdr, data + PNG_SIGNATURE_SIZE, PNG_IHDR_SIZE);
+
+	if (png_check_ihdr(&ihdr) != 0) {
+		return -1;
+	}
+
+	const size_t min_end = PNG_SIGNATURE_SIZE + PNG_IHDR_SIZE + PNG_IEND_SIZE;
+	const size_t max_pad = size - min_end < PNG_MAX_PADDING ? size - min_end : PNG_MAX_PADDING;
+
+	for (size_t end = size; end >= size - max_pad; -- end) {
+		if (memcmp(data + end - PNG_IEND_SIZE, PNG_IEND_CHUNK, PNG_IEND_SIZE) == 0) {
+			png_fill_info(info, end, &ihdr);
+			return 0;
+		}
+
+		// padding is zero, so a non-zero byte means there is no IEND near the end
+		if (data[end - 1] != 0) {
+			break;
+		}
+	}
+
+	errno = EINVAL;
+	return -1;
+}
+
+// Inspects a PNG file of filesize bytes by its first PNG_HEAD_SIZE bytes
+// (head) and its last PNG_TAIL_SIZE bytes (tail) only, so the chunks in
+// between don't need to be read. Fails if the file doesn't end with IEND.
+int parse_png_head_tail(const uint8_t *head, const uint8_t *tail, size_t filesize, struct png_info *info) {
+	if (filesize < PNG_HEAD_SIZE + PNG_TAIL_SIZE) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (memcmp(head, PNG_SIGNATURE, PNG_SIGNATURE_SIZE) != 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	struct png_ihdr_chunk ihdr;
+	memcpy(&ihdr, head + PNG_SIGNATURE_SIZE, PNG_IHDR_SIZE);
+
+	if (png_check_ihdr(&ihdr) != 0) {
+		return -1;
+	}
+
+	if (memcmp(tail, PNG_IEND_CHUNK, PNG_IEND_SIZE) != 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	png_fill_info(info, filesize, &ihdr);
+
 	return 0;
 }
@@ -20,7 +20,14 @@ struct png_info {
 	uint8_t  interlace;
 };
 
+// A PNG starts with its signature and the IHDR chunk and ends with IEND.
+#define PNG_HEAD_SIZE 33
+#define PNG_TAIL_SIZE 12
+
 int parse_png_info(FILE *file, struct png_info *info);
+int parse_png_info_mem(const uint8_t *data, size_t size, struct png_info *info);
+int parse_png_header_mem(const uint8_t *data, size_t size, struct png_info *info);
+int parse_png_head_tail(const uint8_t *head, const uint8_t *tail, size_t filesize, struct png_info *info);
 
 #ifdef __cplusplus
 }
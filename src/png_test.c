@@ -0,0 +1,719 @@
+#include "png_decode.h"
+#include "png_encode.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <zlib.h>
+
+// Tests of the PNG decoder and encoder: reference PNGs of all formats have
+// to decode to the expected pixels and every PNG given on the command line
+// is decoded, encoded again and decoded once more, which has to give the
+// same pixels. The encoder has to produce the same bytes no matter how many
+// threads it uses and optimized PNGs have to decode to the original pixels.
+
+static const size_t thread_counts[] = { 2, 3, 4, 8 };
+
+static int read_file(const char *filename, uint8_t **data, size_t *size) {
+	FILE *fp = fopen(filename, "rb");
+	uint8_t *buffer = NULL;
+	long length = 0;
+
+	if (!fp) {
+		return -1;
+	}
+
+	if (fseek(fp, 0, SEEK_END) != 0 || (length = ftell(fp)) < 0 || fseek(fp, 0, SEEK_SET) != 0) {
+		goto error;
+	}
+
+	buffer = malloc(length > 0 ? (size_t)length : 1);
+	if (!buffer) {
+		goto error;
+	}
+
+	if (fread(buffer, 1, length, fp) != (size_t)length) {
+		if (!ferror(fp)) {
+			errno = EINVAL;
+		}
+		goto error;
+	}
+
+	fclose(fp);
+	*data = buffer;
+	*size = length;
+
+	return 0;
+
+error:
+	{
+		int errnum = errno;
+		free(buffer);
+		fclose(fp);
+		errno = errnum;
+	}
+	return -1;
+}
+
+static int test_round_trip(const char *name, const struct png_image *image) {
+	struct png_image decoded = { 0, 0, NULL };
+	uint8_t *data = NULL;
+	size_t size = 0;
+	int status = 0;
+
+	if (encode_png_mem(image, -1, 1, &data, &size) != 0) {
+		fprintf(stderr, "%s: error encoding PNG: %s\n", name, strerror(errno));
+		goto error;
+	}
+
+	if (decode_png_mem(data, size, &decoded) != 0) {
+		fprintf(stderr, "%s: error decoding encoded PNG: %s\n", name, strerror(errno));
+		goto error;
+	}
+
+	if (decoded.width != image->width || decoded.height != image->height ||
+	    memcmp(decoded.pixels, image->pixels, (size_t)image->width * image->height * 4) != 0) {
+		fprintf(stderr, "%s: pixels differ after round trip\n", name);
+		goto error;
+	}
+
+	for (size_t i = 0; i < sizeof(thread_counts) / sizeof(thread_counts[0]); ++ i) {
+		uint8_t *other = NULL;
+		size_t other_size = 0;
+
+		if (encode_png_mem(image, -1, thread_counts[i], &other, &other_size) != 0) {
+			fprintf(stderr, "%s: error encoding PNG with %" PRIuPTR " threads: %s\n", name, thread_counts[i], strerror(errno));
+			goto error;
+		}
+
+		const bool same = other_size == size && memcmp(other, data, size) == 0;
+		free(other);
+
+		if (!same) {
+			fprintf(stderr, "%s: output with %" PRIuPTR " threads differs from output with 1 thread\n", name, thread_counts[i]);
+			goto error;
+		}
+	}
+
+	goto end;
+
+error:
+	status = -1;
+
+end:
+	free(data);
+	free_png_image(&decoded);
+
+	return status;
+}
+
+// big enough to be deflated in several blocks
+static int test_synthetic(void) {
+	struct png_image image = { 512, 384, NULL };
+	const size_t size = (size_t)image.width * image.height * 4;
+	uint32_t state = 1;
+
+	image.pixels = malloc(size);
+	if (!image.pixels) {
+		perror("synthetic image");
+		return -1;
+	}
+
+	for (size_t i = 0; i < size; ++ i) {
+		const size_t x = (i / 4) % image.width;
+		const size_t y = (i / 4) / image.width;
+
+		state = state * 1103515245 + 12345;
+		image.pixels[i] = (x / 32 + y / 32) % 2 ? (uint8_t)(state >> 16) : (uint8_t)(x * (i % 4 + 1) + y);
+	}
+
+	int status = test_round_trip("synthetic image", &image);
+	free_png_image(&image);
+
+	return status;
+}
+
+// Reference PNGs in every format the decoder supports. They are written here
+// with plain zlib and the filters exactly as the PNG specification defines
+// them, and the expected pixels are derived from the samples, so these
+// don't check the decoder against itself. Rows cycle through all filter
+// types, which covers the SIMD kernels for 3 and 4 bytes per pixel, too.
+
+struct test_format {
+	const char *name;
+	uint8_t     colortype;
+	uint8_t     bitdepth;
+	uint8_t     interlace;
+	bool        transparency; // with tRNS chunk
+	uint32_t    width;
+	uint32_t    height;
+};
+
+static const struct test_format test_formats[] = {
+	{ "gray 1 bit",                  0,  1, 0, false, 67, 29 },
+	{ "gray 2 bit with tRNS",        0,  2, 0, true,  67, 29 },
+	{ "gray 4 bit",                  0,  4, 0, false, 67, 29 },
+	{ "gray 8 bit with tRNS",        0,  8, 0, true,  67, 29 },
+	{ "gray 16 bit with tRNS",       0, 16, 0, true,  67, 29 },
+	{ "RGB 8 bit",                   2,  8, 0, false, 67, 29 },
+	{ "RGB 8 bit with tRNS",         2,  8, 0, true,  67, 29 },
+	{ "RGB 16 bit with tRNS",        2, 16, 0, true,  67, 29 },
+	{ "palette 1 bit",               3,  1, 0, false, 67, 29 },
+	{ "palette 2 bit with tRNS",     3,  2, 0, true,  67, 29 },
+	{ "palette 4 bit with tRNS",     3,  4, 0, true,  67, 29 },
+	{ "palette 8 bit with tRNS",     3,  8, 0, true,  67, 29 },
+	{ "gray+alpha 8 bit",            4,  8, 0, false, 67, 29 },
+	{ "gray+alpha 16 bit",           4, 16, 0, false, 67, 29 },
+	{ "RGBA 8 bit",                  6,  8, 0, false, 67, 29 },
+	{ "RGBA 16 bit",                 6, 16, 0, false, 67, 29 },
+	{ "gray 1 bit Adam7",            0,  1, 1, false, 67, 29 },
+	{ "RGB 8 bit Adam7",             2,  8, 1, false, 67, 29 },
+	{ "palette 4 bit Adam7 with tRNS", 3, 4, 1, true, 67, 29 },
+	{ "gray+alpha 16 bit Adam7",     4, 16, 1, false, 67, 29 },
+	{ "RGBA 8 bit Adam7",            6,  8, 1, false, 67, 29 },
+	{ "RGBA 8 bit Adam7 3x2",        6,  8, 1, false,  3,  2 },
+	{ "RGBA 8 bit 1x1",              6,  8, 0, false,  1,  1 },
+};
+
+// x, y, x step and y step of the passes
+static const uint8_t test_passes[2][7][4] = {
+	{ { 0, 0, 1, 1 } },
+	{ { 0, 0, 8, 8 }, { 4, 0, 8, 8 }, { 0, 4, 4, 8 }, { 2, 0, 4, 4 }, { 0, 2, 2, 4 }, { 1, 0, 2, 2 }, { 0, 1, 1, 2 } },
+};
+
+struct test_buffer {
+	uint8_t *data;
+	size_t   size;
+	size_t   capacity;
+	bool     failed;
+};
+
+static void test_append(struct test_buffer *buffer, const void *data, size_t size) {
+	if (buffer->failed) {
+		return;
+	}
+
+	if (size > buffer->capacity - buffer->size) {
+		size_t capacity = buffer->capacity ? buffer->capacity : 1024;
+		while (size > capacity - buffer->size) {
+			capacity *= 2;
+		}
+
+		uint8_t *ptr = realloc(buffer->data, capacity);
+		if (!ptr) {
+			buffer->failed = true;
+			return;
+		}
+		buffer->data     = ptr;
+		buffer->capacity = capacity;
+	}
+
+	memcpy(buffer->data + buffer->size, data, size);
+	buffer->size += size;
+}
+
+static void test_put_u32be(uint8_t *ptr, uint32_t value) {
+	ptr[0] = value >> 24;
+	ptr[1] = value >> 16;
+	ptr[2] = value >>  8;
+	ptr[3] = value;
+}
+
+static void test_append_chunk(struct test_buffer *buffer, const char *type, const uint8_t *body, size_t length) {
+	uint8_t head[8];
+	uint8_t tail[4];
+
+	// zlib's crc32() returns 0 for a NULL buffer
+	body = body ? body : (const uint8_t*)"";
+
+	test_put_u32be(head, length);
+	memcpy(head + 4, type, 4);
+	test_put_u32be(tail, crc32(crc32(0, head + 4, 4), body, length));
+
+	test_append(buffer, head, sizeof(head));
+	test_append(buffer, body, length);
+	test_append(buffer, tail, sizeof(tail));
+}
+
+static void test_put_sample(uint8_t *row, size_t index, unsigned depth, uint16_t value) {
+	if (depth == 16) {
+		row[index * 2]     = value >> 8;
+		row[index * 2 + 1] = value;
+	}
+	else if (depth == 8) {
+		row[index] = value;
+	}
+	else {
+		const size_t bit = index * depth;
+		row[bit / 8] |= value << (8 - depth - bit % 8);
+	}
+}
+
+static uint8_t test_paeth(int a, int b, int c) {
+	const int p  = a + b - c;
+	const int pa = abs(p - a);
+	const int pb = abs(p - b);
+	const int pc = abs(p - c);
+
+	return pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+}
+
+static void test_filter_row(uint8_t filter, const uint8_t *row, const uint8_t *prev, size_t size, size_t bpp, uint8_t *out) {
+	for (size_t i = 0; i < size; ++ i) {
+		const int a = i >= bpp ? row[i - bpp]  : 0;
+		const int b = prev[i];
+		const int c = i >= bpp ? prev[i - bpp] : 0;
+
+		switch (filter) {
+			case 0: out[i] = row[i];                       break;
+			case 1: out[i] = row[i] - a;                   break;
+			case 2: out[i] = row[i] - b;                   break;
+			case 3: out[i] = row[i] - (a + b) / 2;         break;
+			case 4: out[i] = row[i] - test_paeth(a, b, c); break;
+		}
+	}
+}
+
+static uint32_t test_random(uint32_t *state) {
+	*state = *state * 1103515245 + 12345;
+	return *state >> 8;
+}
+
+static int test_format(const struct test_format *format, uint32_t seed) {
+	static const unsigned channel_counts[] = { 1, 0, 3, 1, 2, 0, 4 };
+	const unsigned channels = channel_counts[format->colortype];
+	const unsigned depth    = format->bitdepth;
+	const uint32_t width    = format->width;
+	const uint32_t height   = format->height;
+	const size_t   bpp      = channels * depth < 8 ? 1 : channels * depth / 8;
+	const uint32_t maxval   = (1u << depth) - 1;
+
+	struct test_buffer raw = { NULL, 0, 0, false };
+	struct test_buffer png = { NULL, 0, 0, false };
+	struct png_image decoded = { 0, 0, NULL };
+	uint8_t palette[256 * 3];
+	uint8_t trns[256];
+	size_t palette_size = 0;
+	size_t trns_size    = 0;
+	uint16_t key[3]     = { 0, 0, 0 };
+	uint16_t *samples   = NULL;
+	uint8_t *expected   = NULL;
+	uint8_t *rows       = NULL;
+	uint8_t *filtered   = NULL;
+	uint8_t *compressed = NULL;
+	int status = 0;
+
+	samples  = calloc((size_t)width * height * channels, sizeof(uint16_t));
+	expected = calloc((size_t)width * height, 4);
+	// the current and the previous row of a pass plus the filtered row
+	const size_t row_size = ((size_t)width * channels * depth + 7) / 8;
+	rows     = calloc(2, row_size + 1);
+	filtered = calloc(1, row_size + 1);
+	if (!samples || !expected || !rows || !filtered) {
+		perror(format->name);
+		goto error;
+	}
+
+	if (format->colortype == 3) {
+		palette_size = maxval + 1 < 200 ? maxval + 1 : 200;
+		for (size_t i = 0; i < palette_size * 3; ++ i) {
+			palette[i] = test_random(&seed);
+		}
+
+		// shorter than the palette, the remaining entries are opaque
+		trns_size = format->transparency ? palette_size / 2 + 1 : 0;
+		for (size_t i = 0; i < trns_size; ++ i) {
+			trns[i] = test_random(&seed);
+		}
+	}
+
+	for (size_t pixel = 0; pixel < (size_t)width * height; ++ pixel) {
+		uint16_t *sample = samples + pixel * channels;
+
+		for (unsigned channel = 0; channel < channels; ++ channel) {
+			sample[channel] = format->colortype == 3 ? test_random(&seed) % palette_size : test_random(&seed) & maxval;
+		}
+
+		// every third pixel has the transparent color
+		if (format->transparency && format->colortype != 3) {
+			if (pixel == 0) {
+				memcpy(key, sample, channels * sizeof(uint16_t));
+			}
+			else if (pixel % 3 == 0) {
+				memcpy(sample, key, channels * sizeof(uint16_t));
+			}
+		}
+	}
+
+	// 1, 2 and 4 bit gray is scaled to the full range, 16 bit samples keep
+	// their high byte
+	for (size_t pixel = 0; pixel < (size_t)width * height; ++ pixel) {
+		const uint16_t *sample = samples + pixel * channels;
+		uint8_t *out = expected + pixel * 4;
+
+		switch (format->colortype) {
+			case 0:
+				out[0] = out[1] = out[2] = depth == 16 ? sample[0] >> 8 : sample[0] * 255 / maxval;
+				out[3] = format->transparency && sample[0] == key[0] ? 0 : 255;
+				break;
+
+			case 2:
+				for (unsigned channel = 0; channel < 3; ++ channel) {
+					out[channel] = depth == 16 ? sample[channel] >> 8 : sample[channel];
+				}
+				out[3] = format->transparency && memcmp(sample, key, sizeof(key)) == 0 ? 0 : 255;
+				break;
+
+			case 3:
+				memcpy(out, palette + sample[0] * 3, 3);
+				out[3] = sample[0] < trns_size ? trns[sample[0]] : 255;
+				break;
+
+			case 4:
+				out[0] = out[1] = out[2] = depth == 16 ? sample[0] >> 8 : sample[0];
+				out[3] = depth == 16 ? sample[1] >> 8 : sample[1];
+				break;
+
+			case 6:
+				for (unsigned channel = 0; channel < 4; ++ channel) {
+					out[channel] = depth == 16 ? sample[channel] >> 8 : sample[channel];
+				}
+				break;
+		}
+	}
+
+	// filtered rows of all passes, each one starts with its own zero row
+	const size_t pass_count = format->interlace ? 7 : 1;
+	size_t filter = 0;
+	for (size_t pass = 0; pass < pass_count; ++ pass) {
+		const uint8_t *p = test_passes[format->interlace][pass];
+		uint8_t *row  = rows;
+		uint8_t *prev = rows + row_size + 1;
+
+		memset(prev, 0, row_size + 1);
+		for (uint32_t y = p[1]; y < height; y += p[3]) {
+			size_t count = 0;
+
+			memset(row, 0, row_size + 1);
+			for (uint32_t x = p[0]; x < width; x += p[2], ++ count) {
+				const uint16_t *sample = samples + ((size_t)y * width + x) * channels;
+				for (unsigned channel = 0; channel < channels; ++ channel) {
+					test_put_sample(row, count * channels + channel, depth, sample[channel]);
+				}
+			}
+
+			if (count == 0) {
+				break;
+			}
+
+			const size_t size = (count * channels * depth + 7) / 8;
+			const uint8_t type = filter ++ % 5;
+			test_filter_row(type, row, prev, size, bpp, filtered);
+			test_append(&raw, &type, 1);
+			test_append(&raw, filtered, size);
+
+			uint8_t *tmp = prev;
+			prev = row;
+			row  = tmp;
+		}
+	}
+
+	uLongf compressed_size = compressBound(raw.size);
+	compressed = malloc(compressed_size);
+	if (raw.failed || !compressed || compress(compressed, &compressed_size, raw.data, raw.size) != Z_OK) {
+		fprintf(stderr, "%s: error compressing image data\n", format->name);
+		goto error;
+	}
+
+	uint8_t ihdr[13];
+	test_put_u32be(ihdr, width);
+	test_put_u32be(ihdr + 4, height);
+	ihdr[8]  = depth;
+	ihdr[9]  = format->colortype;
+	ihdr[10] = 0;
+	ihdr[11] = 0;
+	ihdr[12] = format->interlace;
+
+	test_append(&png, "\x89PNG\r\n\x1a\n", 8);
+	test_append_chunk(&png, "IHDR", ihdr, sizeof(ihdr));
+	if (format->colortype == 3) {
+		test_append_chunk(&png, "PLTE", palette, palette_size * 3);
+	}
+
+	if (trns_size > 0) {
+		test_append_chunk(&png, "tRNS", trns, trns_size);
+	}
+	else if (format->transparency) {
+		uint8_t body[6];
+		for (unsigned channel = 0; channel < channels; ++ channel) {
+			body[channel * 2]     = key[channel] >> 8;
+			body[channel * 2 + 1] = key[channel];
+		}
+		test_append_chunk(&png, "tRNS", body, channels * 2);
+	}
+
+	// split in two, the decoder has to continue with the next IDAT chunk
+	test_append_chunk(&png, "IDAT", compressed, compressed_size / 2);
+	test_append_chunk(&png, "IDAT", compressed + compressed_size / 2, compressed_size - compressed_size / 2);
+	test_append_chunk(&png, "IEND", NULL, 0);
+
+	if (png.failed) {
+		perror(format->name);
+		goto error;
+	}
+
+	if (decode_png_mem(png.data, png.size, &decoded) != 0) {
+		fprintf(stderr, "%s: error decoding PNG: %s\n", format->name, strerror(errno));
+		goto error;
+	}
+
+	if (decoded.width != width || decoded.height != height) {
+		fprintf(stderr, "%s: decoded size is %" PRIu32 "x%" PRIu32 ", expected %" PRIu32 "x%" PRIu32 "\n",
+			format->name, decoded.width, decoded.height, width, height);
+		goto error;
+	}
+
+	for (size_t pixel = 0; pixel < (size_t)width * height; ++ pixel) {
+		if (memcmp(decoded.pixels + pixel * 4, expected + pixel * 4, 4) != 0) {
+			const uint8_t *got  = decoded.pixels + pixel * 4;
+			const uint8_t *want = expected + pixel * 4;
+			fprintf(stderr, "%s: pixel %" PRIuPTR ",%" PRIuPTR " is %u,%u,%u,%u, expected %u,%u,%u,%u\n",
+				format->name, pixel % width, pixel / width,
+				got[0], got[1], got[2], got[3], want[0], want[1], want[2], want[3]);
+			goto error;
+		}
+	}
+
+	goto end;
+
+error:
+	status = -1;
+
+end:
+	free(samples);
+	free(expected);
+	free(rows);
+	free(filtered);
+	free(compressed);
+	free(raw.data);
+	free(png.data);
+	free_png_image(&decoded);
+
+	return status;
+}
+
+// Images for optimize_png_mem() that each end up with another color type:
+// 0 = gray, 2 = RGB, 3 = palette, 4 = gray+alpha, 6 = RGBA.
+enum test_optimize_kind {
+	TEST_GRAY,
+	TEST_ALMOST_GRAY,
+	TEST_GRAY_ALPHA,
+	TEST_RGB,
+	TEST_PALETTE,
+	TEST_COLORS_256,
+	TEST_COLORS_257
+};
+
+struct test_optimization {
+	const char *name;
+	enum test_optimize_kind kind;
+	bool    reduce;
+	uint8_t colortype; // expected
+};
+
+static const struct test_optimization test_optimizations[] = {
+	{ "optimized gray",                      TEST_GRAY,        true,  0 },
+	{ "optimized gray except one pixel",     TEST_ALMOST_GRAY, true,  2 },
+	{ "optimized gray+alpha",                TEST_GRAY_ALPHA,  true,  4 },
+	{ "optimized RGB",                       TEST_RGB,         true,  2 },
+	{ "optimized palette with transparency", TEST_PALETTE,     true,  3 },
+	{ "optimized 256 colors",                TEST_COLORS_256,  true,  3 },
+	{ "optimized 257 colors",                TEST_COLORS_257,  true,  6 },
+	{ "optimized palette without reduction", TEST_PALETTE,     false, 6 },
+};
+
+// Returns the body of the first chunk of that type, NULL if there is none.
+static const uint8_t *test_find_chunk(const uint8_t *data, size_t size, const char *type, uint32_t *length) {
+	for (size_t offset = 8; offset + 12 <= size; ) {
+		const uint32_t chunk_length = (uint32_t)data[offset] << 24 | (uint32_t)data[offset + 1] << 16 |
+		                              (uint32_t)data[offset + 2] << 8 | data[offset + 3];
+		if (memcmp(data + offset + 4, type, 4) == 0) {
+			*length = chunk_length;
+			return data + offset + 8;
+		}
+		offset += (size_t)chunk_length + 12;
+	}
+	return NULL;
+}
+
+static int test_optimize(const struct test_optimization *test, uint32_t seed) {
+	struct png_image image = { 64, 64, NULL };
+	struct png_image decoded = { 0, 0, NULL };
+	const size_t count = (size_t)image.width * image.height;
+	uint8_t colors[257 * 4];
+	uint8_t *data = NULL;
+	size_t size = 0;
+	int status = 0;
+
+	image.pixels = malloc(count * 4);
+	if (!image.pixels) {
+		perror(test->name);
+		goto error;
+	}
+
+	// the red channel makes all colors of the table distinct, the first 16
+	// of the palette are translucent, so its tRNS chunk is shorter than PLTE
+	const size_t color_count = test->kind == TEST_COLORS_257 ? 257 : test->kind == TEST_COLORS_256 ? 256 : 40;
+	for (size_t i = 0; i < color_count; ++ i) {
+		colors[i * 4]     = i < 256 ? (uint8_t)i : 0;
+		colors[i * 4 + 1] = test_random(&seed);
+		colors[i * 4 + 2] = i < 256 ? test_random(&seed) : 1;
+		colors[i * 4 + 3] = test->kind == TEST_PALETTE && i >= 16 ? 255 : test_random(&seed);
+	}
+
+	for (size_t i = 0; i < count; ++ i) {
+		uint8_t *pixel = image.pixels + i * 4;
+		const uint32_t value = test_random(&seed);
+
+		switch (test->kind) {
+			case TEST_GRAY:
+			case TEST_ALMOST_GRAY:
+				pixel[0] = pixel[1] = pixel[2] = value;
+				pixel[3] = 255;
+				// only blue differs in the last pixel
+				if (test->kind == TEST_ALMOST_GRAY && i == count - 1) {
+					pixel[2] = pixel[0] ^ 1;
+				}
+				break;
+
+			case TEST_GRAY_ALPHA:
+				pixel[0] = pixel[1] = pixel[2] = value;
+				pixel[3] = value >> 8;
+				break;
+
+			case TEST_RGB:
+				pixel[0] = value;
+				pixel[1] = value >> 8;
+				pixel[2] = value >> 16;
+				pixel[3] = 255;
+				break;
+
+			default:
+				// every color is used at least once
+				memcpy(pixel, colors + (i < color_count ? i : value % color_count) * 4, 4);
+				break;
+		}
+	}
+
+	if (optimize_png_mem(&image, test->reduce, 1, &data, &size) != 0) {
+		fprintf(stderr, "%s: error optimizing PNG: %s\n", test->name, strerror(errno));
+		goto error;
+	}
+
+	if (size < 26 || data[25] != test->colortype) {
+		fprintf(stderr, "%s: color type is %u, expected %u\n", test->name, size < 26 ? 255 : data[25], test->colortype);
+		goto error;
+	}
+
+	if (test->colortype == 3) {
+		uint32_t plte_length = 0;
+		uint32_t trns_length = 0;
+
+		if (!test_find_chunk(data, size, "PLTE", &plte_length) || plte_length != color_count * 3) {
+			fprintf(stderr, "%s: PLTE chunk has %" PRIu32 " bytes, expected %" PRIuPTR "\n", test->name, plte_length, color_count * 3);
+			goto error;
+		}
+
+		// translucent entries come first, so tRNS stops after the last of them
+		size_t expected_length = 0;
+		for (size_t i = 0; i < color_count; ++ i) {
+			if (colors[i * 4 + 3] != 255) {
+				++ expected_length;
+			}
+		}
+
+		if (!test_find_chunk(data, size, "tRNS", &trns_length)) {
+			trns_length = 0;
+		}
+
+		if (trns_length != expected_length) {
+			fprintf(stderr, "%s: tRNS chunk has %" PRIu32 " bytes, expected %" PRIuPTR "\n", test->name, trns_length, expected_length);
+			goto error;
+		}
+	}
+
+	if (decode_png_mem(data, size, &decoded) != 0) {
+		fprintf(stderr, "%s: error decoding optimized PNG: %s\n", test->name, strerror(errno));
+		goto error;
+	}
+
+	if (decoded.width != image.width || decoded.height != image.height ||
+	    memcmp(decoded.pixels, image.pixels, count * 4) != 0) {
+		fprintf(stderr, "%s: pixels differ after optimizing\n", test->name);
+		goto error;
+	}
+
+	goto end;
+
+error:
+	status = -1;
+
+end:
+	free(data);
+	free_png_image(&image);
+	free_png_image(&decoded);
+
+	return status;
+}
+
+int main(int argc, char *argv[]) {
+	const size_t format_count = sizeof(test_formats) / sizeof(test_formats[0]);
+	const size_t optimization_count = sizeof(test_optimizations) / sizeof(test_optimizations[0]);
+	size_t failed = 0;
+
+	for (size_t i = 0; i < format_count; ++ i) {
+		if (test_format(&test_formats[i], (uint32_t)i + 1) != 0) {
+			++ failed;
+		}
+	}
+
+	for (size_t i = 0; i < optimization_count; ++ i) {
+		if (test_optimize(&test_optimizations[i], (uint32_t)i + 1) != 0) {
+			++ failed;
+		}
+	}
+
+	if (test_synthetic() != 0) {
+		++ failed;
+	}
+
+	for (int argind = 1; argind < argc; ++ argind) {
+		const char *filename = argv[argind];
+		struct png_image image = { 0, 0, NULL };
+		uint8_t *data = NULL;
+		size_t size = 0;
+
+		if (read_file(filename, &data, &size) != 0) {
+			perror(filename);
+			++ failed;
+			continue;
+		}
+
+		if (decode_png_mem(data, size, &image) != 0) {
+			fprintf(stderr, "%s: error decoding PNG: %s\n", filename, strerror(errno));
+			++ failed;
+		}
+		else if (test_round_trip(filename, &image) != 0) {
+			++ failed;
+		}
+
+		free(data);
+		free_png_image(&image);
+	}
+
+	printf("%" PRIuPTR " PNGs tested, %" PRIuPTR " failed\n", format_count + optimization_count + argc, failed);
+
+	return failed ? 1 : 0;
+}
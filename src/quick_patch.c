@@ -1,5 +1,4 @@
 #include "game_maker.h"
-#include "png_info.h"
 #include "cook_serve_hoomans.h"
 
 #include <stdio.h>
@@ -27,34 +26,11 @@ static const char *filename(const char *path) {
 	return path;
 }
 
-static int load_txtr_info(const char *filename, size_t index, struct gm_patch *patch) {
-	struct png_info info;
-	FILE *fp = fopen(filename, "rb");
-
-	if (!fp) {
-		return -1;
-	}
-
-	int status = parse_png_info(fp, &info);
-	int errnum = errno;
-
-	fclose(fp);
-	errno = errnum;
-
-	if (status != 0) {
-		return -1;
-	}
-
+static void add_txtr_patch(const char *filename, size_t index, struct gm_patch *patch) {
 	patch->section      = GM_TXTR;
 	patch->index        = index;
-	patch->type         = GM_PNG;
 	patch->patch_src    = GM_SRC_FILE;
 	patch->src.filename = filename;
-	patch->size         = info.filesize;
-	patch->meta.txtr.width  = info.width;
-	patch->meta.txtr.height = info.height;
-
-	return 0;
 }
 
 int main(int argc, char *argv[]) {
@@ -107,30 +83,26 @@ int main(int argc, char *argv[]) {
 	}
 
 	if (catering_filename) {
-		if (load_txtr_info(catering_filename, CSH_CATERING_INDEX, patch) != 0) {
-			perror(catering_filename);
-			goto error;
-		}
+		add_txtr_patch(catering_filename, CSH_CATERING_INDEX, patch);
 		patch ++;
 	}
 
 	if (icons_filename) {
-		if (load_txtr_info(icons_filename, CSH_ICONS_INDEX, patch) != 0) {
-			perror(icons_filename);
-			goto error;
-		}
+		add_txtr_patch(icons_filename, CSH_ICONS_INDEX, patch);
 		patch ++;
 	}
 
 	if (hoomans_filename) {
-		if (load_txtr_info(hoomans_filename, CSH_HOOMANS_INDEX, patch) != 0) {
-			perror(hoomans_filename);
-			goto error;
-		}
+		add_txtr_patch(hoomans_filename, CSH_HOOMANS_INDEX, patch);
 		patch ++;
 	}
 
-	if (gm_patch_archive(game_filename, patches) != 0) {
+	// the files report their own errors
+	if (gm_read_patch_files(patches, 0) != 0) {
+		goto error;
+	}
+
+	if (gm_patch_archive(game_filename, patches, NULL) != 0) {
 		fprintf(stderr, "*** ERROR: Error patching archive: %s\n", strerror(errno));
 		goto error;
 	}